@@ -0,0 +1,496 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+#include "utf8.h"
+
+unsigned int print_level = PRINT_ERR;
+
+#define BENCH_MIN_NS     (100 * 1000 * 1000ULL)  //!< minimum measuring time per benchmark
+#define BENCH_MAX_OPS    (1ULL << 26)            //!< maximum operations per benchmark
+#define BENCH_FRAGMENT   8                       //!< clusters per fragment in benchmark chain
+#define BENCH_TREE_FILES (1ULL << 20)            //!< files in directory tree benchmark image
+#define BENCH_TREE_DIR   1024                    //!< files in each sub directory of it
+
+/**
+ * image geometry for benchmark
+ */
+struct bench_geometry {
+	uint8_t sector_bits;   //!< log2 of bytes per sector
+	uint8_t cluster_bits;  //!< log2 of bytes per cluster
+};
+
+/**
+ * benchmark target
+ */
+struct bench {
+	const char *name;                                    //!< benchmark name
+	bool geometry;                                       //!< whether it depends on geometry
+	void (*setup)(struct super_block *sb);               //!< called once before measuring
+	void (*func)(struct super_block *sb, uint64_t ops);  //!< run @ops operations
+};
+
+static const struct bench_geometry geometries[] = {
+	{9, 12},   /* 512B sector,   4KiB cluster */
+	{9, 16},   /* 512B sector,  64KiB cluster */
+	{12, 12},  /*  4KiB sector,  4KiB cluster */
+	{12, 18},  /*  4KiB sector, 256KiB cluster */
+	{12, 25},  /*  4KiB sector,  32MiB cluster */
+};
+
+static volatile uint64_t bench_sink;  //!< keep results alive from optimizer
+static uint32_t data_start;           //!< the first cluster of benchmark chain
+
+/**
+ * @brief Get monotonic time
+ *
+ * @return nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Generate exFAT image for benchmark
+ * @param [in] path         output image
+ * @param [in] sector_bits  log2 of bytes per sector
+ * @param [in] cluster_bits log2 of bytes per cluster
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Image has one file which occupies about half of the volume, and its
+ *       cluster chain is fragmented every BENCH_FRAGMENT clusters.
+ */
+static int make_bench_image(const char *path, uint8_t sector_bits, uint8_t cluster_bits)
+{
+	/* keep image within 4GiB (but at least 128 clusters) */
+	uint64_t count = MIN(MAX((4ULL << 30) >> cluster_bits, 128), 65536);
+	struct mkimage_param param = {
+		.size = count << cluster_bits,
+		.sector_bits = sector_bits,
+		.cluster_bits = cluster_bits,
+		.num_fats = 1,
+		.files = 1,
+		.file_clusters = count / 2,
+		.fragment = BENCH_FRAGMENT,
+	};
+
+	return make_image(path, &param);
+}
+
+/**
+ * @brief Index of the N-th sector outside Cluster Heap (wraps around)
+ */
+static uint32_t bench_sector(struct super_block *sb, uint64_t n)
+{
+	return sb->fat_offset + n % (sb->heap_offset - sb->fat_offset);
+}
+
+/**
+ * @brief Index of the N-th cluster in benchmark chain area (wraps around)
+ */
+static uint32_t bench_cluster(struct super_block *sb, uint64_t n)
+{
+	return data_start + n % (sb->cluster_count + EXFAT_FIRST_CLUSTER - data_start);
+}
+
+static void setup_sector_hit(struct super_block *sb)
+{
+	get_sector_cache(sb, bench_sector(sb, 0));
+}
+
+static void bench_sector_hit(struct super_block *sb, uint64_t ops)
+{
+	uint32_t index = bench_sector(sb, 0);
+
+	while (ops--)
+		bench_sink += (uintptr_t)get_sector_cache(sb, index);
+}
+
+static void bench_sector_miss(struct super_block *sb, uint64_t ops)
+{
+	static uint64_t n;
+
+	/* cache limit evicts old sectors, so that every access misses */
+	while (ops--)
+		bench_sink += (uintptr_t)get_sector_cache(sb, bench_sector(sb, n++));
+}
+
+static void setup_cluster_hit(struct super_block *sb)
+{
+	get_cluster_cache(sb, bench_cluster(sb, 0));
+}
+
+static void bench_cluster_hit(struct super_block *sb, uint64_t ops)
+{
+	uint32_t index = bench_cluster(sb, 0);
+
+	while (ops--)
+		bench_sink += (uintptr_t)get_cluster_cache(sb, index);
+}
+
+static void bench_cluster_miss(struct super_block *sb, uint64_t ops)
+{
+	static uint64_t n;
+
+	while (ops--)
+		bench_sink += (uintptr_t)get_cluster_cache(sb, bench_cluster(sb, n++));
+}
+
+static void bench_fat_entry(struct super_block *sb, uint64_t ops)
+{
+	uint64_t n = 0;
+	uint32_t entry;
+
+	while (ops--) {
+		get_fat_entry(sb, bench_cluster(sb, n++ * 7919), &entry);
+		bench_sink += entry;
+	}
+}
+
+static void bench_fat_chain(struct super_block *sb, uint64_t ops)
+{
+	uint32_t clu = data_start, next;
+	struct inode inode = {0};
+
+	while (ops--) {
+		if (get_next_cluster(sb, &inode, clu, &next) || next == EXFAT_LASTCLUSTER)
+			next = data_start;
+		clu = next;
+	}
+	bench_sink += clu;
+}
+
+static void bench_bitmap_get(struct super_block *sb, uint64_t ops)
+{
+	uint64_t n = 0;
+
+	while (ops--)
+		bench_sink += get_alloc_bitmap(sb, bench_cluster(sb, n++ * 7919));
+}
+
+static void bench_bitmap_set(struct super_block *sb, uint64_t ops)
+{
+	uint64_t n = 0;
+
+	while (ops--)
+		bench_sink += set_alloc_bitmap(sb, bench_cluster(sb, n++ * 7919));
+}
+
+static unsigned char utf8_name[MAX_NAME_LENGTH * UTF8_MAX_CHARSIZE + 1];
+static uint16_t utf16_name[MAX_NAME_LENGTH];
+
+static void setup_utf(struct super_block *sb)
+{
+	int i;
+
+	/* the longest ASCII file name */
+	for (i = 0; i < MAX_NAME_LENGTH; i++) {
+		utf8_name[i] = 'a' + i % 26;
+		utf16_name[i] = 'a' + i % 26;
+	}
+}
+
+static void bench_utf8_to_utf16(struct super_block *sb, uint64_t ops)
+{
+	while (ops--)
+		bench_sink += utf8s_to_utf16s(utf8_name, MAX_NAME_LENGTH, utf16_name, MAX_NAME_LENGTH);
+}
+
+static void bench_utf16_to_utf8(struct super_block *sb, uint64_t ops)
+{
+	while (ops--)
+		bench_sink += utf16s_to_utf8s(utf16_name, MAX_NAME_LENGTH, utf8_name, sizeof(utf8_name));
+}
+
+static void bench_print_sector(struct super_block *sb, uint64_t ops)
+{
+	while (ops--)
+		bench_sink += print_sector(sb, 0, 1);
+}
+
+static void bench_boot_checksum(struct super_block *sb, uint64_t ops)
+{
+	static uint8_t region[12 * EXFAT_SECTOR_MAX];
+
+	while (ops--)
+		bench_sink += calc_boot_checksum(region, sb->sector_size);
+}
+
+static struct exfat_dentry entry_set[ENTRY_SET_MAX];
+
+static void setup_entry_set(struct super_block *sb)
+{
+	size_t i;
+
+	/* File, Stream and 17 FileName dentries for the longest file name */
+	entry_set[0].type = DENTRY_FILE;
+	entry_set[0].dentry.file.num_ext = 18;
+	entry_set[1].type = DENTRY_STREAM;
+	entry_set[1].dentry.stream.name_len = MAX_NAME_LENGTH;
+	for (i = 2; i < 19; i++)
+		entry_set[i].type = DENTRY_NAME;
+	setup_utf(sb);
+}
+
+static void bench_set_checksum(struct super_block *sb, uint64_t ops)
+{
+	while (ops--)
+		bench_sink += calc_set_checksum(entry_set, 19);
+}
+
+static void bench_name_hash(struct super_block *sb, uint64_t ops)
+{
+	while (ops--)
+		bench_sink += calc_name_hash(utf16_name, MAX_NAME_LENGTH, NULL);
+}
+
+static uint16_t upcase_table[UPCASE_TABLE_LEN];
+
+static void setup_upcase(struct super_block *sb)
+{
+	uint32_t c;
+
+	for (c = 0; c < UPCASE_TABLE_LEN; c++)
+		upcase_table[c] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+	setup_utf(sb);
+}
+
+static void bench_name_hash_table(struct super_block *sb, uint64_t ops)
+{
+	while (ops--)
+		bench_sink += calc_name_hash(utf16_name, MAX_NAME_LENGTH, upcase_table);
+}
+
+static void setup_entry_sets(struct super_block *sb)
+{
+	/* directory tree and Up-case table are loaded at first use */
+	get_dir_tree(sb);
+	get_upcase_table(sb);
+}
+
+static void bench_check_entry_sets(struct super_block *sb, uint64_t ops)
+{
+	uint64_t bad;
+
+	/* one operation verifies all entry sets in the tree */
+	while (ops--) {
+		check_all_entry_sets(sb, false, &bad);
+		bench_sink += bad;
+	}
+}
+
+static const struct bench benches[] = {
+	{"get_sector_cache_hit", true, setup_sector_hit, bench_sector_hit},
+	{"get_sector_cache_miss", true, NULL, bench_sector_miss},
+	{"get_cluster_cache_hit", true, setup_cluster_hit, bench_cluster_hit},
+	{"get_cluster_cache_miss", true, NULL, bench_cluster_miss},
+	{"get_fat_entry", true, NULL, bench_fat_entry},
+	{"get_next_cluster_walk", true, NULL, bench_fat_chain},
+	{"get_alloc_bitmap", true, NULL, bench_bitmap_get},
+	{"set_alloc_bitmap", true, NULL, bench_bitmap_set},
+	{"print_sector", true, NULL, bench_print_sector},
+	{"calc_boot_checksum", true, NULL, bench_boot_checksum},
+	{"calc_set_checksum", false, setup_entry_set, bench_set_checksum},
+	{"calc_name_hash", false, setup_utf, bench_name_hash},
+	{"calc_name_hash_upcase", false, setup_upcase, bench_name_hash_table},
+	{"utf8s_to_utf16s", false, setup_utf, bench_utf8_to_utf16},
+	{"utf16s_to_utf8s", false, setup_utf, bench_utf16_to_utf8},
+};
+
+static const struct bench tree_benches[] = {
+	{"check_all_entry_sets", false, setup_entry_sets, bench_check_entry_sets},
+};
+
+/**
+ * @brief Measure one benchmark and print result as JSON line
+ * @param [in] sb    Filesystem metadata
+ * @param [in] bench benchmark
+ * @param [in] geo   geometry (NULL if independent)
+ */
+static void run_bench(struct super_block *sb, const struct bench *bench,
+		const struct bench_geometry *geo)
+{
+	int out = -1, null;
+	uint64_t ops = 1, start, elapsed;
+
+	/* print_sector() writes into stdout */
+	if (bench->func == bench_print_sector) {
+		fflush(stdout);
+		out = dup(STDOUT_FILENO);
+		if ((null = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(null, STDOUT_FILENO);
+			close(null);
+		}
+	}
+
+	if (bench->setup)
+		bench->setup(sb);
+
+	/* double the number of operations until it takes long enough */
+	while (true) {
+		start = now_ns();
+		bench->func(sb, ops);
+		elapsed = now_ns() - start;
+		if (elapsed >= BENCH_MIN_NS || ops >= BENCH_MAX_OPS)
+			break;
+		ops = elapsed ? MIN(ops * MAX(2, BENCH_MIN_NS / elapsed), BENCH_MAX_OPS) : ops * 16;
+	}
+
+	if (out >= 0) {
+		fflush(stdout);
+		dup2(out, STDOUT_FILENO);
+		close(out);
+	}
+
+	if (geo)
+		printf("{\"bench\":\"%s\",\"sector_size\":%u,\"cluster_size\":%u,"
+				"\"ops\":%lu,\"ns_per_op\":%.2f}\n",
+				bench->name, 1U << geo->sector_bits, 1U << geo->cluster_bits,
+				ops, (double)elapsed / ops);
+	else
+		printf("{\"bench\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.2f}\n",
+				bench->name, ops, (double)elapsed / ops);
+	fflush(stdout);
+}
+
+/**
+ * @brief Run benchmarks on one geometry
+ * @param [in] geo    geometry
+ * @param [in] filter run benchmarks whose name contains @filter (NULL: all)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int run_geometry(const struct bench_geometry *geo, const char *filter)
+{
+	int fd, ret;
+	size_t i;
+	char path[] = "/tmp/breakexfat-bench-XXXXXX";
+	struct list_head *node;
+	struct super_block sb;
+
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return -errno;
+	}
+	close(fd);
+	if ((ret = make_bench_image(path, geo->sector_bits, geo->cluster_bits)) != 0)
+		goto out;
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (!benches[i].geometry || (filter && !strstr(benches[i].name, filter)))
+			continue;
+		/* fresh super block for each benchmark, so that caches are cold */
+		memset(&sb, 0, sizeof(sb));
+		/* small enough to make every "miss" benchmark miss */
+		sb.cache_limit = 4ULL << (strstr(benches[i].name, "sector_cache") ?
+				geo->sector_bits : geo->cluster_bits);
+		if ((ret = fill_super(&sb, path)) != 0)
+			goto out;
+		/* the last inode is the only file */
+		for (node = get_dir_tree(&sb); node && node->next; node = node->next)
+			;
+		if (!node) {
+			ret = -ENOMEM;
+			put_super(&sb);
+			goto out;
+		}
+		data_start = ((struct inode *)node->data)->clu;
+		run_bench(&sb, &benches[i], geo);
+		put_super(&sb);
+	}
+out:
+	unlink(path);
+	return ret;
+}
+
+/**
+ * @brief Run benchmarks on directory tree
+ * @param [in] filter run benchmarks whose name contains @filter (NULL: all)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Image has BENCH_TREE_FILES empty files in sub directories (4KiB
+ *       cluster), and whole tree is cached by setup before measuring.
+ */
+static int run_tree(const char *filter)
+{
+	int fd, ret = 0;
+	size_t i;
+	char path[] = "/tmp/breakexfat-bench-XXXXXX";
+	struct super_block sb;
+	struct mkimage_param param = {
+		.size = 1ULL << 30,
+		.sector_bits = 9,
+		.cluster_bits = 12,
+		.num_fats = 1,
+		.files = BENCH_TREE_FILES,
+		.files_per_dir = BENCH_TREE_DIR,
+	};
+
+	/* don't generate image if no benchmark is selected */
+	for (i = 0; i < sizeof(tree_benches) / sizeof(tree_benches[0]); i++)
+		if (!filter || strstr(tree_benches[i].name, filter))
+			break;
+	if (i == sizeof(tree_benches) / sizeof(tree_benches[0]))
+		return 0;
+
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return -errno;
+	}
+	close(fd);
+	if ((ret = make_image(path, &param)) != 0)
+		goto out;
+
+	for (i = 0; i < sizeof(tree_benches) / sizeof(tree_benches[0]); i++) {
+		if (filter && !strstr(tree_benches[i].name, filter))
+			continue;
+		memset(&sb, 0, sizeof(sb));
+		if ((ret = fill_super(&sb, path)) != 0)
+			goto out;
+		run_bench(&sb, &tree_benches[i], NULL);
+		put_super(&sb);
+	}
+out:
+	unlink(path);
+	return ret;
+}
+
+/**
+ * @brief main function
+ * @param [in] argc argument count
+ * @param [in] argv argument vector (optional benchmark name filter)
+ */
+int main(int argc, char *argv[])
+{
+	size_t i;
+	const char *filter = argc > 1 ? argv[1] : NULL;
+	struct super_block sb = {0};
+
+	for (i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++)
+		if (run_geometry(&geometries[i], filter))
+			return EXIT_FAILURE;
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+		if (!benches[i].geometry && (!filter || strstr(benches[i].name, filter)))
+			run_bench(&sb, &benches[i], NULL);
+
+	if (run_tree(filter))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
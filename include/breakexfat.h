@@ -13,6 +13,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <linux/types.h>
+#include <sys/uio.h>
 
 #include "exfat.h"
 #include "list.h"
@@ -63,6 +64,132 @@ enum {
  */
 enum {
 	OPT_ALL,      //!< All failure
+	OPT_READONLY, //!< Open image as read-only
+	OPT_PATCH,    //!< Output patch files instead of images
+	OPT_DIRECT,   //!< Open image with O_DIRECT
+	OPT_FIX_CHECKSUM, //!< Recalculate Boot Checksum after breaking
+	OPT_FIX_BACKUP,   //!< Also rewrite Backup Boot region with OPT_FIX_CHECKSUM
+};
+
+/**
+ * I/O backend
+ */
+enum {
+	IO_PREAD,       //!< pread/pwrite (default)
+	IO_MMAP,        //!< memory-mapped image
+	IO_URING,       //!< io_uring (fall back to pread if unavailable)
+};
+
+#define IO_QUEUE_DEPTH 32             //!< default queue depth for io_uring
+#define IO_MAX_SIZE    (1024 * 1024)  //!< default upper limit of merged request
+#define IO_MAX_VECS    1024           //!< upper limit of segments in one request (UIO_MAXIOV)
+#define IO_READAHEAD_SIZE (4 * 1024 * 1024) //!< default readahead of cluster chain walk
+
+/**
+ * Read/Write request for batched I/O
+ */
+struct io_request {
+	int fd;                  //!< target file (Negative: image)
+	void *data;              //!< buffer (unused if @vec is set)
+	struct iovec *vec;       //!< buffers of vectored request (NULL: @data)
+	int nr_vec;              //!< the number of buffers in @vec
+	off_t offset;            //!< byte offset in file
+	size_t size;             //!< byte size (total of @vec)
+	ssize_t ret;             //!< transferred bytes (or Negative errno)
+	struct iovec iov;        //!< used internally by io_uring
+};
+
+/**
+ * cluster chain being read window by window
+ */
+struct chain_reader {
+	struct inode *inode;  //!< target file/directory
+	uint32_t next;        //!< the first cluster not resolved yet
+	uint32_t *index;      //!< resolved clusters (@window + @ahead entries)
+	size_t resolved;      //!< the number of resolved clusters in @index
+	size_t count;         //!< the number of clusters in current window
+	size_t window;        //!< the number of clusters read at once
+	size_t ahead;         //!< the number of clusters hinted beyond window
+	int err;              //!< error while resolving chain
+};
+
+#define ENTRY_SET_MAX 256  //!< the maximum number of dentries in entry set (File + 255 secondary)
+
+/**
+ * entry set found by iterate_entry_set()
+ */
+struct entry_set {
+	struct inode *dir;                     //!< directory containing entry set
+	size_t count;                          //!< the number of dentries
+	uint32_t clu[ENTRY_SET_MAX];           //!< cluster of each dentry
+	uint32_t pos[ENTRY_SET_MAX];           //!< index of each dentry in cluster
+	struct exfat_dentry d[ENTRY_SET_MAX];  //!< copy of dentries
+};
+
+#define ENTRY_SET_BAD_CHECKSUM BIT(0)  //!< SetChecksum doesn't match
+#define ENTRY_SET_BAD_HASH     BIT(1)  //!< NameHash doesn't match
+
+/**
+ * Statistics output format
+ */
+enum {
+	STATS_NONE,     //!< not printed
+	STATS_TEXT,     //!< human readable
+	STATS_JSON,     //!< JSON object
+};
+
+#define STATS_PATTERN_MAX 64  //!< the maximum number of break patterns in statistics
+
+/**
+ * I/O, cache and break engine counters
+ */
+struct io_stats {
+	uint64_t read_calls;             //!< get_sector() calls
+	uint64_t read_bytes;             //!< bytes read by get_sector()
+	uint64_t write_calls;            //!< set_sector() calls
+	uint64_t write_bytes;            //!< bytes written by set_sector()
+	uint64_t batch_reads;            //!< read requests by submit_io()
+	uint64_t batch_read_bytes;       //!< bytes read by submit_io()
+	uint64_t batch_writes;           //!< write requests by submit_io()
+	uint64_t batch_write_bytes;      //!< bytes written by submit_io()
+	uint64_t readahead_hints;        //!< ranges hinted by readahead_io()
+	uint64_t readahead_bytes;        //!< bytes hinted by readahead_io()
+	uint64_t cache_hits;             //!< lookups found in cache
+	uint64_t cache_misses;           //!< lookups not found in cache
+	uint64_t cache_fills;            //!< caches filled from image
+	uint64_t cache_fill_bytes;       //!< bytes of filled caches
+	uint64_t cache_evictions;        //!< caches evicted by cache limit
+	uint64_t cache_writebacks;       //!< dirty caches written back
+	uint64_t cache_writeback_bytes;  //!< bytes of written back caches
+	uint64_t pattern_runs[STATS_PATTERN_MAX]; //!< runs of each break pattern
+	uint64_t pattern_ns[STATS_PATTERN_MAX];   //!< wall time of each break pattern
+	struct io_stats *parent;         //!< counters merged into by put_super() (variant only)
+};
+
+/**
+ * Add value into counter (if counters are enabled)
+ */
+#define stat_add(sb, member, n) \
+	do { \
+		if ((sb)->stats) \
+			(sb)->stats->member += (n); \
+	} while (0)
+
+/**
+ * Timestamp type in inode
+ */
+enum {
+	INODE_CTIME,    //!< CreateTimestamp
+	INODE_MTIME,    //!< LastModifiedTimestamp
+	INODE_ATIME,    //!< LastAccessedTimestamp
+};
+
+/**
+ * Cache type
+ */
+enum {
+	CACHE_SECTOR,   //!< sector cache
+	CACHE_CLUSTER,  //!< cluster cache
 };
 
 /**
@@ -71,13 +198,100 @@ enum {
 struct cache {
 	struct super_block *sb;  //!< super block cache
 	void *data;              //!< cached sector/cluster
+	int type;                //!< cache type (sector or cluster)
 	off_t offset;            //!< sector/cluster offset
 	size_t count;            //!< the number of cached data
 	bool dirty;              //!< whether cache is modified from storage
+	uint8_t *dirty_map;      //!< modified sectors (NULL: all data if @dirty)
+	bool mapped;             //!< whether data points into mapped image
 	int (*read)(struct super_block *, void *, off_t, size_t);  //!< read operator
 	int (*write)(struct super_block *, void *, off_t, size_t); //!< write operator
 	int (*print)(struct super_block *, off_t, size_t);         //!< print operator
 	struct list_head *next;  //!< next cache
+	struct list_head *node;  //!< node in sector/cluster list
+	struct cache *lru_prev;  //!< more recently used cache
+	struct cache *lru_next;  //!< less recently used cache
+};
+
+/**
+ * Hash index for cached data (open addressing)
+ */
+struct cache_index {
+	struct cache **slot;     //!< hash slots (NULL, tombstone or cache)
+	size_t size;             //!< the number of slots (power of 2)
+	size_t used;             //!< the number of registered caches
+	size_t removed;          //!< the number of tombstone slots
+	size_t stale;            //!< the number of list nodes for evicted caches
+};
+
+/**
+ * Modified byte range in patch
+ */
+struct patch_record {
+	off_t offset;            //!< byte offset in image
+	size_t len;              //!< byte length
+	unsigned char *data;     //!< modified data
+};
+
+/**
+ * Modification of image recorded instead of writing image
+ */
+struct patch {
+	char *path;                //!< output patch file
+	struct patch_record *rec;  //!< records (sorted by offset, never overlap)
+	size_t nr;                 //!< the number of records
+	size_t size;               //!< the number of allocated records
+};
+
+/**
+ * Run of contiguous clusters in FAT chain
+ */
+struct fat_extent {
+	uint32_t start;          //!< first cluster of the run
+	uint32_t len;            //!< the number of clusters (FAT[n] == n + 1 inside the run)
+	uint32_t next;           //!< FAT entry of the last cluster of the run
+};
+
+/**
+ * Active FAT in memory (read by pages on demand)
+ */
+struct fat_table {
+	uint32_t *entry;           //!< FAT entries (CPU endian, index is cluster)
+	uint32_t count;            //!< the number of entries
+	uint8_t *dirty;            //!< bitmap of modified FAT sectors
+	uint8_t *loaded;           //!< bitmap of pages read from image
+	size_t nr_pages;           //!< the number of pages
+	size_t nr_loaded;          //!< the number of loaded pages
+	struct fat_extent *ext;    //!< extents of allocated clusters (sorted by start)
+	size_t nr_ext;             //!< the number of extents
+	bool stale;                //!< whether extents need to be rebuilt
+};
+
+/**
+ * Active Allocation Bitmap loaded into memory
+ */
+struct alloc_bitmap {
+	uint64_t *word;            //!< bitmap (CPU endian, bit N is cluster N + 2)
+	uint32_t count;            //!< the number of bits
+	uint32_t *chain;           //!< clusters storing the bitmap
+	uint32_t nr_chain;         //!< the number of clusters storing the bitmap
+	uint8_t *dirty;            //!< bitmap of modified clusters in @chain
+};
+
+#define MKIMAGE_FILES_PER_DIR  1000  //!< default files in each sub directory of generated image
+
+/**
+ * Geometry and directory tree of generated image
+ */
+struct mkimage_param {
+	uint64_t size;           //!< volume size in bytes
+	uint8_t sector_bits;     //!< log2 of bytes per sector (0: 512 bytes)
+	uint8_t cluster_bits;    //!< log2 of bytes per cluster (0: depends on @size)
+	uint8_t num_fats;        //!< the number of FATs and Allocation Bitmaps (1 or 2)
+	uint64_t files;          //!< the number of regular files
+	uint32_t files_per_dir;  //!< files in each sub directory (0: all files in root)
+	uint32_t file_clusters;  //!< clusters in each file
+	uint32_t fragment;       //!< clusters per fragment of each file (0: contiguous)
 };
 
 #define MAX(a, b)      ((a) > (b) ? (a) : (b))  //!< compare and return max value
@@ -105,7 +319,7 @@ static inline bool is_power2(unsigned int n)
  */
 static inline uint64_t power2(uint32_t n)
 {
-	return 1 << n;
+	return 1ULL << n;
 }
 
 /**
@@ -150,24 +364,92 @@ int get_cluster(struct super_block *sb, void *data, off_t index, size_t count);
 int set_cluster(struct super_block *sb, void *data, off_t index, size_t count);
 int print_cluster(struct super_block *sb, off_t index, size_t count);
 
+int parse_io_backend(const char *name);
+int setup_io(struct super_block *sb);
+void cleanup_io(struct super_block *sb);
+void *map_sector(struct super_block *sb, off_t index, size_t count);
+void *map_cluster(struct super_block *sb, off_t index, size_t count);
+int submit_io(struct super_block *sb, struct io_request *req, size_t nr, bool write);
+void readahead_io(struct super_block *sb, off_t offset, size_t size);
+void *alloc_io_buffer(struct super_block *sb, size_t size);
+ssize_t pread_direct(int fd, void *buf, size_t size, off_t offset, size_t align);
+ssize_t pwrite_direct(int fd, const void *buf, size_t size, off_t offset, size_t align);
+
 int fill_super(struct super_block *sb, const char *name);
+int clone_super(struct super_block *sb, const struct super_block *base, int fd,
+		struct patch *patch);
 int put_super(struct super_block *sb);
 struct inode *alloc_inode(struct super_block *sb);
-int free_inode(struct inode *inode);
+struct inode *alloc_root_inode(struct super_block *sb);
+int free_inode(struct super_block *sb, struct inode *inode);
+int set_inode_name(struct super_block *sb, struct inode *inode, const char *name, size_t len);
+void free_all_inodes(struct super_block *sb);
+int get_inode_time(const struct inode *inode, int type, struct tm *t);
+int read_dir_tree(struct super_block *sb);
+struct list_head *get_dir_tree(struct super_block *sb);
+int iterate_entry_set(struct super_block *sb, struct inode *dir,
+		int (*func)(struct super_block *, struct entry_set *, void *), void *arg);
+int check_entry_set(struct entry_set *set, const uint16_t *upcase, bool fix);
+int check_all_entry_sets(struct super_block *sb, bool fix, uint64_t *bad);
 
 struct cache *create_cluster_cache(struct super_block *sb, uint32_t index, size_t count);
 struct cache *create_sector_cache(struct super_block *sb, uint32_t index, size_t count);
 struct cache *get_cluster_cache(struct super_block *sb, uint32_t index);
 struct cache *get_sector_cache(struct super_block *sb, uint32_t index);
+int add_cache(struct super_block *sb, struct cache *cache);
+void mark_cache_dirty(struct cache *cache, size_t offset, size_t len);
+int prefetch_cluster_cache(struct super_block *sb, const uint32_t *index, size_t nr);
+void start_chain_reader(struct chain_reader *chain, struct inode *inode);
+int read_cluster_chain(struct super_block *sb, struct chain_reader *chain, size_t *nr);
+int flush_cache_list(struct super_block *sb, struct list_head *head);
 int remove_cache(struct super_block *sb, struct list_head *prev);
 int remove_cache_list(struct super_block *sb, struct list_head *head);
 
+uint32_t calc_boot_checksum(const void *region, size_t sector_size);
+int update_boot_checksum(struct super_block *sb, bool backup);
+uint16_t calc_set_checksum(const struct exfat_dentry *d, size_t dentries);
+uint16_t calc_name_hash(const uint16_t *name, size_t len, const uint16_t *upcase);
+uint32_t calc_table_checksum(const void *data, size_t len);
+
+/* Metadata read by break pattern besides boot sector */
+#define BREAK_NEED_BITMAP BIT(0)  //!< Allocation Bitmap
+#define BREAK_NEED_UPCASE BIT(1)  //!< Up-case table (for NameHash)
+
+unsigned int count_break_pattern(void);
+unsigned int get_break_pattern_needs(uint64_t patterns);
+const char *get_break_pattern_name(unsigned int index);
 int enable_break_pattern(struct super_block *sb, unsigned int index);
 int disable_break_pattern(struct super_block *sb, unsigned int index);
 int enable_break_all_pattern(struct super_block *sb);
 int run_break(struct super_block *sb);
 
+int clone_image(int src, int dst, off_t size, size_t align);
+int run_break_batch(struct super_block *sb, const char *dir, char *line, unsigned int jobs);
+
+int run_pool(unsigned int nr_threads, size_t nr_jobs, int (*func)(void *, size_t), void *arg);
+
+struct patch *create_patch(const char *path);
+void free_patch(struct patch *patch);
+int patch_write(struct patch *patch, const void *data, off_t offset, size_t len);
+void patch_read(struct patch *patch, void *data, off_t offset, size_t len);
+int save_patch(struct super_block *sb, struct patch *patch);
+int apply_patch(const char *path, const char *image, const char *output);
+
+int parse_stats_format(const char *name);
+int get_stats(const struct super_block *sb, struct io_stats *stats);
+void merge_stats(struct io_stats *dst, const struct io_stats *src);
+void print_stats(FILE *fp, const struct io_stats *stats, int format);
+
+int make_image(const char *path, const struct mkimage_param *param);
+
 int update_active_fat(struct super_block *sb, int index);
+int load_fat_table(struct super_block *sb);
+int flush_fat_table(struct super_block *sb);
+void free_fat_table(struct super_block *sb);
+bool is_fat_table_loaded(struct super_block *sb);
+int get_cluster_run(struct super_block *sb, struct inode *inode, uint32_t clu,
+		uint32_t *len, uint32_t *next);
+int get_nth_cluster(struct super_block *sb, struct inode *inode, uint32_t n, uint32_t *clu);
 int get_fat_entry(struct super_block *sb, uint32_t clu, uint32_t *entry);
 int set_fat_entry(struct super_block *sb, uint32_t clu, uint32_t entry);
 int get_next_cluster(struct super_block *sb, struct inode *inode, uint32_t clu, uint32_t *entry);
@@ -176,5 +458,16 @@ int update_active_bitmap(struct super_block *sb, int index);
 int set_alloc_bitmap(struct super_block *sb, uint32_t clu);
 int unset_alloc_bitmap(struct super_block *sb, uint32_t clu);
 int get_alloc_bitmap(struct super_block *sb, uint32_t clu);
+int load_alloc_bitmap(struct super_block *sb);
+int flush_alloc_bitmap(struct super_block *sb);
+void free_alloc_bitmap(struct super_block *sb);
+int count_alloc_bitmap(struct super_block *sb, uint32_t *count);
+int find_free_cluster(struct super_block *sb, uint32_t clu, uint32_t *free);
+int find_free_run(struct super_block *sb, uint32_t clu, uint32_t len, uint32_t *start);
+int find_longest_free_run(struct super_block *sb, uint32_t *start, uint32_t *len);
+
+int load_upcase_table(struct super_block *sb);
+const uint16_t *get_upcase_table(struct super_block *sb);
+void free_upcase_table(struct super_block *sb);
 
 #endif /*_DEBUGFATFS_H */
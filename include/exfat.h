@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 #include <stdatomic.h>
 #include <linux/types.h>
@@ -28,6 +29,14 @@
 struct super_block {
 	int fd;                 //!< opened file for exFAT filesystem image
 	off_t total_size;       //!< volume size
+	int io;                 //!< I/O backend
+	void *map;              //!< mapped image (only IO_MMAP)
+	struct io_ring *ring;   //!< io_uring instance (only IO_URING)
+	unsigned int queue_depth; //!< the number of requests in flight (only IO_URING)
+	size_t max_io;          //!< upper limit of bytes in one merged request
+	size_t readahead;       //!< bytes hinted ahead in cluster chain walk (0: disabled)
+	size_t dio_align;       //!< alignment of O_DIRECT I/O (0: buffered I/O)
+	struct patch *patch;    //!< record modification here instead of writing image
 
 	/* Derived from Boot sector */
 	uint64_t part_offset;   //!< media-relative sector offset of the partition
@@ -45,15 +54,33 @@ struct super_block {
 	uint64_t alloc_length;  //!< length of Allocation Bitmap
 	uint32_t upcase_offset; //!< cluster index of the first cluster of the Up-case table
 	uint32_t upcase_size;   //!< length of Up-case table
+	uint32_t upcase_checksum; //!< TableChecksum of Up-case table
+	int active_fat;         //!< Active FAT(1st or 2nd)
+	int active_bitmap;      //!< Active Allocation Bitmap(1st or 2nd)
 
 	/* Meta Data */
 	uint64_t opt;           //!< Command line option
+	uint64_t patterns;      //!< enabled break patterns (bitmask)
+	size_t cache_limit;     //!< upper limit of cached data in bytes (0: unlimited)
+	struct io_stats *stats; //!< I/O and cache counters (NULL: not counted)
 
 	/* cached list */
-	struct list_head *inodes;       //!< cached inode
+	struct list_head *inodes;       //!< cached inode (linked by inode itself)
+	struct inode_arena *arena;      //!< storage for inodes and their names
+	bool tree_loaded;               //!< whether @inodes has whole directory tree
 
 	struct list_head *sector_list;  //!< cached sector
 	struct list_head *cluster_list; //!< cached cluster
+	struct cache_index *cache_index; //!< hash index for cached sector/cluster
+	struct fat_table *fat;          //!< in-memory active FAT
+	bool fat_shared;                //!< whether @fat is borrowed from the original image
+	struct alloc_bitmap *bitmap;    //!< in-memory active Allocation Bitmap
+	bool bitmap_shared;             //!< whether @bitmap is borrowed from the original image
+	uint16_t *upcase;               //!< in-memory Up-case table (UPCASE_TABLE_LEN entries)
+	bool upcase_shared;             //!< whether @upcase is borrowed from the original image
+	struct cache *lru_head;         //!< most recently used cache
+	struct cache *lru_tail;         //!< least recently used cache
+	size_t cache_size;              //!< total bytes of cached data
 };
 
 /**
@@ -67,11 +94,14 @@ struct inode {
 	uint32_t clu;     //!< FirstCluster in Stream dentry
 	uint64_t len;     //!< DataLength in Stream dentry
 
-	struct tm mtime;  //!< LastModified timestamp in File dentry
-	struct tm atime;  //!< LastAccessed timestamp in File dentry
-	struct tm ctime;  //!< LastCreate timestamp in File dentry
+	uint32_t mtime;   //!< LastModifiedTimestamp in File dentry (raw)
+	uint32_t atime;   //!< LastAccessedTimestamp in File dentry (raw)
+	uint32_t ctime;   //!< CreateTimestamp in File dentry (raw)
+	uint8_t mtime_cs; //!< LastModified10msIncrement in File dentry
+	uint8_t ctime_cs; //!< Create10msIncrement in File dentry
 
 	struct inode *p_inode;  //!< Parent Directory inode
+	struct list_head list;  //!< node in @sb->inodes (data points to this inode)
 
 	atomic_int refcount;    //!< reference count for inode
 };
@@ -80,6 +110,26 @@ struct inode {
 #define ALLOC_POSSIBLE BIT(0) //!< allocation in the Cluster Heap is possible
 #define NOFATCHAIN     BIT(1) //!< given allocation's cluster chain
 
+/* For FileAttributes Field */
+#define ATTR_READ_ONLY BIT(0) //!< file is read-only
+#define ATTR_HIDDEN    BIT(1) //!< file is hidden
+#define ATTR_SYSTEM    BIT(2) //!< file is system file
+#define ATTR_DIRECTORY BIT(4) //!< file is directory
+#define ATTR_ARCHIVE   BIT(5) //!< file is archive
+
+/* For VolumeFlags Field */
+#define ACTIVE_FAT     BIT(0) //!< 2nd FAT and Allocation Bitmap are active
+
+/* For EntryType Field */
+#define DENTRY_UNUSED  0x00 //!< end of directory
+#define DENTRY_BITMAP  0x81 //!< Allocation Bitmap directory entry
+#define DENTRY_UPCASE  0x82 //!< Up-case Table directory entry
+#define DENTRY_VOLUME  0x83 //!< Volume Label directory entry
+#define DENTRY_FILE    0x85 //!< File directory entry
+#define DENTRY_GUID    0xA0 //!< Volume GUID directory entry
+#define DENTRY_STREAM  0xC0 //!< Stream Extension directory entry
+#define DENTRY_NAME    0xC1 //!< File Name directory entry
+
 /* For Boot sector */
 #define BOOTSEC_JUMPBOOT_LEN  3  //!< length of JumpBoot
 #define BOOTSEC_FSNAME_LEN    8  //!< length of FileSystemName
@@ -88,6 +138,7 @@ struct inode {
 #define FILENAME_LEN     15  //!< length of the maximum FileName in dentry
 #define FILENAME_NUM     17  //!< the maximum number of File Name dentries
 #define MAX_NAME_LENGTH  (FILENAME_LEN * FILENAME_NUM) //!< length of the maximum FileName
+#define UPCASE_TABLE_LEN 0x10000 //!< the number of characters mapped by Up-case table
 
 /**
  * boot-strapping from an exFAT volume (512 bytes)
@@ -4,18 +4,22 @@
  */
 #ifndef _NLS_H
 #define _NLS_H
+#include <stddef.h>
 #include <stdint.h>
 
-#define SURROGATE_PAIR_MASK     0xF800	//1111 11?? ???? ????
+#define SURROGATE_PAIR_MASK     0xFC00	//1111 11?? ???? ????
 #define SURROGATE_PAIR_UPPER    0xD800	//1101 10?? ???? ????
 #define SURROGATE_PAIR_LOWER    0xDC00	//1101 11?? ???? ????
 
+#define IS_SURROGATE(c)         (((c) & 0xFFFFF800) == SURROGATE_PAIR_UPPER)
+
 #define UNICODE_MAX             0x10FFFF
+#define UNICODE_REPLACEMENT     0xFFFD
 
 #define UTF8_MAX_CHARSIZE       4
 
-int utf8s_to_utf16s(unsigned char *src, uint16_t namelen, uint16_t *dist);
-int utf16s_to_utf8s(uint16_t *, uint16_t, unsigned char *);
+int utf8s_to_utf16s(const unsigned char *src, size_t len, uint16_t *dist, size_t size);
+int utf16s_to_utf8s(const uint16_t *src, size_t len, unsigned char *dist, size_t size);
 
 #endif /*_NLS_H */
 
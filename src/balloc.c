@@ -7,24 +7,28 @@
 #include "endian.h"
 #include <limits.h>
 
-/**
- * Active Allocation Bitmap(1st or 2nd)
- */
-static int active_bitmap = 0;
-
 /**
  * @brief Update active Bitmap
  * @param [in] sb    Filesystem metadata
  * @param [in] index The number of Bitmap
  *
- * @return success or failed
+ * @retval 0 success
+ * @retval Negative failed (Bitmap of old index is kept in memory)
  */
 int update_active_bitmap(struct super_block *sb, int index)
 {
+	int ret;
+
 	switch (index) {
 	case 0:
 	case 1:
-		active_bitmap = index;
+		if (sb->bitmap && sb->active_bitmap != index) {
+			/* modified bits aren't lost, if they can't be written back */
+			if ((ret = flush_alloc_bitmap(sb)) != 0)
+				return ret;
+			free_alloc_bitmap(sb);
+		}
+		sb->active_bitmap = index;
 		break;
 	default:
 		pr_warn("Invalid index of active Bitmap (%d)\n", index);
@@ -33,6 +37,268 @@ int update_active_bitmap(struct super_block *sb, int index)
 	return 0;
 }
 
+#define BITS_PER_WORD  (sizeof(uint64_t) * CHAR_BIT)  //!< bits in one bitmap word
+
+/**
+ * @brief Count set bits by generic code
+ * @param [in] word bitmap words
+ * @param [in] nr   the number of words
+ *
+ * @return the number of set bits
+ */
+static uint64_t popcount_generic(const uint64_t *word, size_t nr)
+{
+	size_t i;
+	uint64_t count = 0;
+
+	for (i = 0; i < nr; i++)
+		count += __builtin_popcountll(word[i]);
+
+	return count;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/**
+ * @brief Count set bits by POPCNT instruction
+ * @param [in] word bitmap words
+ * @param [in] nr   the number of words
+ *
+ * @return the number of set bits
+ *
+ * @note Four independent accumulators hide the latency of POPCNT.
+ */
+__attribute__((target("popcnt")))
+static uint64_t popcount_hw(const uint64_t *word, size_t nr)
+{
+	size_t i;
+	uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+
+	for (i = 0; i + 4 <= nr; i += 4) {
+		c0 += __builtin_popcountll(word[i]);
+		c1 += __builtin_popcountll(word[i + 1]);
+		c2 += __builtin_popcountll(word[i + 2]);
+		c3 += __builtin_popcountll(word[i + 3]);
+	}
+	for (; i < nr; i++)
+		c0 += __builtin_popcountll(word[i]);
+
+	return c0 + c1 + c2 + c3;
+}
+#endif
+
+/**
+ * @brief Count set bits
+ * @param [in] word bitmap words
+ * @param [in] nr   the number of words
+ *
+ * @return the number of set bits
+ */
+static uint64_t popcount_words(const uint64_t *word, size_t nr)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (__builtin_cpu_supports("popcnt"))
+		return popcount_hw(word, nr);
+#endif
+	return popcount_generic(word, nr);
+}
+
+/**
+ * @brief Find next set/clear bit
+ * @param [in] bitmap Allocation Bitmap
+ * @param [in] pos    bit index to start searching
+ * @param [in] set    search set bit (true) or clear bit (false)
+ *
+ * @return bit index (or bitmap->count if not found)
+ */
+static uint32_t find_next_bit(const struct alloc_bitmap *bitmap, uint32_t pos, bool set)
+{
+	size_t i = pos / BITS_PER_WORD;
+	size_t nr = ROUNDUP((size_t)bitmap->count, BITS_PER_WORD);
+	uint64_t word;
+
+	if (pos >= bitmap->count)
+		return bitmap->count;
+
+	word = set ? bitmap->word[i] : ~bitmap->word[i];
+	word &= ~0ULL << (pos % BITS_PER_WORD);
+	while (!word) {
+		if (++i >= nr)
+			return bitmap->count;
+		word = set ? bitmap->word[i] : ~bitmap->word[i];
+	}
+
+	return MIN(i * BITS_PER_WORD + __builtin_ctzll(word), bitmap->count);
+}
+
+/**
+ * @brief Load active Allocation Bitmap into memory
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+int load_alloc_bitmap(struct super_block *sb)
+{
+	int ret = -ENOMEM;
+	uint32_t clu, len, next, i;
+	size_t nr, bytes;
+	struct alloc_bitmap *bitmap;
+	struct inode inode = {0};
+
+	inode.clu = sb->active_bitmap == 1 ? sb->alloc_second : sb->alloc_offset;
+	if (!inode.clu) {
+		pr_warn("Allocation Bitmap isn't found.\n");
+		return -ENOENT;
+	}
+
+	if ((bitmap = calloc(1, sizeof(struct alloc_bitmap))) == NULL)
+		return -ENOMEM;
+
+	bitmap->count = MIN(sb->cluster_count, sb->alloc_length * CHAR_BIT);
+	nr = ROUNDUP(ROUNDUP((size_t)bitmap->count, CHAR_BIT), sb->cluster_size);
+	bytes = MAX(nr * sb->cluster_size,
+			ROUNDUP((size_t)bitmap->count, BITS_PER_WORD) * sizeof(uint64_t));
+	if ((bitmap->word = calloc(1, bytes)) == NULL)
+		goto err;
+	if ((bitmap->chain = calloc(nr, sizeof(uint32_t))) == NULL)
+		goto err;
+	if ((bitmap->dirty = calloc(ROUNDUP(nr, CHAR_BIT), 1)) == NULL)
+		goto err;
+
+	/* read the bitmap by each run of contiguous clusters */
+	for (clu = inode.clu; bitmap->nr_chain < nr; clu = next) {
+		if ((ret = get_cluster_run(sb, &inode, clu, &len, &next)) != 0)
+			goto err;
+		len = MIN(len, nr - bitmap->nr_chain);
+		if ((ret = get_cluster(sb, (char *)bitmap->word +
+					bitmap->nr_chain * sb->cluster_size, clu, len)) != 0)
+			goto err;
+		for (i = 0; i < len; i++)
+			bitmap->chain[bitmap->nr_chain++] = clu + i;
+		if (bitmap->nr_chain < nr && (next == EXFAT_LASTCLUSTER || validate_cluster(sb, next))) {
+			pr_err("Cluster chain of Allocation Bitmap is too short.\n");
+			ret = -EINVAL;
+			goto err;
+		}
+	}
+
+	for (i = 0; i < ROUNDUP((size_t)bitmap->count, BITS_PER_WORD); i++)
+		bitmap->word[i] = le64_to_cpu(bitmap->word[i]);
+
+	sb->bitmap = bitmap;
+	sb->bitmap_shared = false;
+
+	return 0;
+err:
+	free(bitmap->dirty);
+	free(bitmap->chain);
+	free(bitmap->word);
+	free(bitmap);
+	return ret;
+}
+
+/**
+ * @brief Write modified Allocation Bitmap back
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+int flush_alloc_bitmap(struct super_block *sb)
+{
+	int ret = 0;
+	size_t c, i;
+	size_t word_per_cluster = sb->cluster_size / sizeof(uint64_t);
+	__le64 *buf;
+	struct alloc_bitmap *bitmap = sb->bitmap;
+
+	if (!bitmap || sb->bitmap_shared)
+		return 0;
+
+	if ((buf = malloc(sb->cluster_size)) == NULL)
+		return -ENOMEM;
+
+	for (c = 0; c < bitmap->nr_chain; c++) {
+		if (!(bitmap->dirty[c / CHAR_BIT] & BIT(c % CHAR_BIT)))
+			continue;
+		for (i = 0; i < word_per_cluster; i++)
+			buf[i] = cpu_to_le64(bitmap->word[c * word_per_cluster + i]);
+		if ((ret = set_cluster(sb, buf, bitmap->chain[c], 1)) != 0)
+			break;
+		bitmap->dirty[c / CHAR_BIT] &= ~BIT(c % CHAR_BIT);
+	}
+
+	free(buf);
+	return ret;
+}
+
+/**
+ * @brief Release in-memory Allocation Bitmap
+ * @param [in] sb Filesystem metadata
+ *
+ * @note Modified bits are discarded, call flush_alloc_bitmap() before.
+ */
+void free_alloc_bitmap(struct super_block *sb)
+{
+	struct alloc_bitmap *bitmap = sb->bitmap;
+
+	sb->bitmap = NULL;
+	if (!bitmap || sb->bitmap_shared)
+		return;
+
+	free(bitmap->dirty);
+	free(bitmap->chain);
+	free(bitmap->word);
+	free(bitmap);
+}
+
+/**
+ * @brief Get Allocation Bitmap (load or copy it if necessary)
+ * @param [in] sb     Filesystem metadata
+ * @param [in] modify whether caller modifies the bitmap
+ *
+ * @return Allocation Bitmap (or NULL)
+ *
+ * @note Batch variants borrow the bitmap of the original image,
+ *       and take own copy before modification.
+ */
+static struct alloc_bitmap *prepare_alloc_bitmap(struct super_block *sb, bool modify)
+{
+	size_t bytes;
+	struct alloc_bitmap *base, *bitmap;
+
+	if (!sb->bitmap && load_alloc_bitmap(sb))
+		return NULL;
+	if (!modify || !sb->bitmap_shared)
+		return sb->bitmap;
+
+	base = sb->bitmap;
+	if ((bitmap = calloc(1, sizeof(struct alloc_bitmap))) == NULL)
+		return NULL;
+
+	bitmap->count = base->count;
+	bitmap->nr_chain = base->nr_chain;
+	bytes = MAX(bitmap->nr_chain * sb->cluster_size,
+			ROUNDUP((size_t)bitmap->count, BITS_PER_WORD) * sizeof(uint64_t));
+	bitmap->word = malloc(bytes);
+	bitmap->chain = malloc(bitmap->nr_chain * sizeof(uint32_t));
+	bitmap->dirty = calloc(ROUNDUP((size_t)bitmap->nr_chain, CHAR_BIT), 1);
+	if (!bitmap->word || !bitmap->chain || !bitmap->dirty) {
+		free(bitmap->dirty);
+		free(bitmap->chain);
+		free(bitmap->word);
+		free(bitmap);
+		return NULL;
+	}
+	memcpy(bitmap->word, base->word, bytes);
+	memcpy(bitmap->chain, base->chain, bitmap->nr_chain * sizeof(uint32_t));
+
+	sb->bitmap = bitmap;
+	sb->bitmap_shared = false;
+
+	return bitmap;
+}
+
 /**
  * @brief Update bitmap entry
  * @param [in] sb  Filesystem metadata
@@ -44,32 +310,27 @@ int update_active_bitmap(struct super_block *sb, int index)
  */
 static int update_alloc_bitmap(struct super_block *sb, uint32_t clu, bool set)
 {
-	struct cache *cache;
-	uint8_t *raw_bitmap;
-	uint8_t bit = 0x01;
-	uint32_t bitmap_clu = active_bitmap == 1 ? sb->alloc_offset : sb->alloc_second;
-	size_t cluster_index = ((sb->cluster_size * CHAR_BIT + EXFAT_FIRST_CLUSTER) / clu);
-	size_t cluster_offset = ((sb->cluster_size * CHAR_BIT + EXFAT_FIRST_CLUSTER) % clu);
-	size_t byte_index = cluster_offset / CHAR_BIT;
-	size_t byte_offset = cluster_offset % CHAR_BIT;
+	uint32_t pos = clu - EXFAT_FIRST_CLUSTER;
+	size_t c;
+	struct alloc_bitmap *bitmap;
 
-	if (validate_cluster(sb, clu))
+	if (validate_cluster(sb, clu) || clu == EXFAT_LASTCLUSTER)
 		return -EINVAL;
 
-	if ((cache = get_cluster_cache(sb, bitmap_clu + cluster_index)) == NULL) {
+	if ((bitmap = prepare_alloc_bitmap(sb, true)) == NULL) {
 		pr_err("cluster %08x can't be loaded\n", clu);
 		return -EIO;
 	}
-
-	bit <<= byte_index;
-	raw_bitmap = cache->data;
+	if (pos >= bitmap->count)
+		return -EINVAL;
 
 	if (set)
-		raw_bitmap[byte_offset] |= bit;
+		bitmap->word[pos / BITS_PER_WORD] |= 1ULL << (pos % BITS_PER_WORD);
 	else
-		raw_bitmap[byte_offset] &= ~bit;
+		bitmap->word[pos / BITS_PER_WORD] &= ~(1ULL << (pos % BITS_PER_WORD));
 
-	cache->dirty = true;
+	c = pos / CHAR_BIT / sb->cluster_size;
+	bitmap->dirty[c / CHAR_BIT] |= BIT(c % CHAR_BIT);
 
 	return 0;
 }
@@ -101,34 +362,135 @@ int unset_alloc_bitmap(struct super_block *sb, uint32_t clu)
 }
 
 /**
- * @brief Update bitmap entry
+ * @brief Get bitmap entry
  * @param [in] sb   Filesystem metadata
  * @param [in] clu  index of the cluster want to check
  *
- * @retval 0 success
+ * @retval 1 allocated
+ * @retval 0 free
  * @retval Negative failed
  */
 int get_alloc_bitmap(struct super_block *sb, uint32_t clu)
 {
-	struct cache *cache;
-	uint8_t *raw_bitmap;
-	uint8_t bit = 0x01;
-	uint32_t bitmap_clu = active_bitmap == 1 ? sb->alloc_offset : sb->alloc_second;
-	size_t cluster_index = ((sb->cluster_size * CHAR_BIT + EXFAT_FIRST_CLUSTER) / clu);
-	size_t cluster_offset = ((sb->cluster_size * CHAR_BIT + EXFAT_FIRST_CLUSTER) % clu);
-	size_t byte_index = cluster_offset / CHAR_BIT;
-	size_t byte_offset = cluster_offset % CHAR_BIT;
+	uint32_t pos = clu - EXFAT_FIRST_CLUSTER;
+	struct alloc_bitmap *bitmap;
 
-	if (validate_cluster(sb, clu))
+	if (validate_cluster(sb, clu) || clu == EXFAT_LASTCLUSTER)
 		return -EINVAL;
 
-	if ((cache = get_cluster_cache(sb, bitmap_clu + cluster_index)) == NULL) {
+	if ((bitmap = prepare_alloc_bitmap(sb, false)) == NULL) {
 		pr_err("cluster %08x can't be loaded\n", clu);
 		return -EIO;
 	}
+	if (pos >= bitmap->count)
+		return -EINVAL;
+
+	return (bitmap->word[pos / BITS_PER_WORD] >> (pos % BITS_PER_WORD)) & 1;
+}
+
+/**
+ * @brief Count allocated clusters
+ * @param [in]  sb    Filesystem metadata
+ * @param [out] count the number of allocated clusters
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+int count_alloc_bitmap(struct super_block *sb, uint32_t *count)
+{
+	size_t nr;
+	uint32_t rest;
+	struct alloc_bitmap *bitmap;
+
+	if ((bitmap = prepare_alloc_bitmap(sb, false)) == NULL)
+		return -EIO;
+
+	nr = bitmap->count / BITS_PER_WORD;
+	rest = bitmap->count % BITS_PER_WORD;
+	*count = popcount_words(bitmap->word, nr);
+	/* ignore bits after the last cluster */
+	if (rest)
+		*count += __builtin_popcountll(bitmap->word[nr] & ((1ULL << rest) - 1));
+
+	return 0;
+}
+
+/**
+ * @brief Find free cluster
+ * @param [in]  sb   Filesystem metadata
+ * @param [in]  clu  index of the cluster to start searching
+ * @param [out] free index of the first free cluster at or after @clu
+ *
+ * @retval 0 success
+ * @retval -ENOSPC free cluster isn't found
+ * @retval Negative failed
+ */
+int find_free_cluster(struct super_block *sb, uint32_t clu, uint32_t *free)
+{
+	return find_free_run(sb, clu, 1, free);
+}
+
+/**
+ * @brief Find contiguous free clusters
+ * @param [in]  sb    Filesystem metadata
+ * @param [in]  clu   index of the cluster to start searching
+ * @param [in]  len   the number of clusters required
+ * @param [out] start index of the first cluster of the run
+ *
+ * @retval 0 success
+ * @retval -ENOSPC free run isn't found
+ * @retval Negative failed
+ */
+int find_free_run(struct super_block *sb, uint32_t clu, uint32_t len, uint32_t *start)
+{
+	uint32_t pos, end;
+	struct alloc_bitmap *bitmap;
+
+	if (!len)
+		return -EINVAL;
+	if ((bitmap = prepare_alloc_bitmap(sb, false)) == NULL)
+		return -EIO;
+
+	pos = clu < EXFAT_FIRST_CLUSTER ? 0 : clu - EXFAT_FIRST_CLUSTER;
+	for (pos = find_next_bit(bitmap, pos, false); pos < bitmap->count;
+			pos = find_next_bit(bitmap, end, false)) {
+		end = find_next_bit(bitmap, pos, true);
+		if (end - pos >= len) {
+			*start = pos + EXFAT_FIRST_CLUSTER;
+			return 0;
+		}
+	}
+
+	return -ENOSPC;
+}
+
+/**
+ * @brief Find the longest free run
+ * @param [in]  sb    Filesystem metadata
+ * @param [out] start index of the first cluster of the run
+ * @param [out] len   the number of clusters in the run
+ *
+ * @retval 0 success
+ * @retval -ENOSPC no free cluster
+ * @retval Negative failed
+ */
+int find_longest_free_run(struct super_block *sb, uint32_t *start, uint32_t *len)
+{
+	uint32_t pos, end;
+	struct alloc_bitmap *bitmap;
+
+	if ((bitmap = prepare_alloc_bitmap(sb, false)) == NULL)
+		return -EIO;
 
-	bit <<= byte_index;
-	raw_bitmap = cache->data;
+	*len = 0;
+	for (pos = find_next_bit(bitmap, 0, false); pos < bitmap->count;
+			pos = find_next_bit(bitmap, end, false)) {
+		end = find_next_bit(bitmap, pos, true);
+		if (end - pos > *len) {
+			*start = pos + EXFAT_FIRST_CLUSTER;
+			*len = end - pos;
+		}
+	}
 
-	return (raw_bitmap[byte_offset] & bit);
+	return *len ? 0 : -ENOSPC;
 }
@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+
+/**
+ * @brief Parse one variant ("N" or "N+M+...")
+ * @param [in]  token    variant string
+ * @param [out] patterns enabled break patterns
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int parse_break_variant(char *token, uint64_t *patterns)
+{
+	long pattern;
+	char *ptr, *end, *save;
+
+	*patterns = 0;
+	for (ptr = strtok_r(token, "+", &save); ptr; ptr = strtok_r(NULL, "+", &save)) {
+		pattern = strtol(ptr, &end, 10);
+		if (*end != '\0' || pattern < 0 || pattern >= count_break_pattern()) {
+			pr_warn("Irregular pattern found %s\n", ptr);
+			return -EINVAL;
+		}
+		*patterns |= BIT(pattern);
+	}
+
+	return *patterns ? 0 : -EINVAL;
+}
+
+/**
+ * @brief Generate one broken image from the parsed image
+ * @param [in] sb       Filesystem metadata of the original image
+ * @param [in] dir      output directory
+ * @param [in] patterns enabled break patterns
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int run_break_variant(struct super_block *sb, const char *dir, uint64_t patterns)
+{
+	int i, fd, ret, err;
+	size_t len = 0;
+	char name[NAME_MAX] = "";
+	char path[PATH_MAX];
+	struct super_block variant;
+	struct patch *patch = NULL;
+
+	/* e.g. "5+6.img" */
+	for (i = 0; i < count_break_pattern(); i++)
+		if (patterns & BIT(i))
+			len += snprintf(name + len, sizeof(name) - len, "%s%d", len ? "+" : "", i);
+	if (snprintf(path, sizeof(path), "%s/%s.%s", dir, name,
+				(sb->opt & BIT(OPT_PATCH)) ? "patch" : "img") >= sizeof(path))
+		return -ENAMETOOLONG;
+
+	if (sb->opt & BIT(OPT_PATCH)) {
+		/* read the original image, and record modification only */
+		if ((patch = create_patch(path)) == NULL)
+			return -ENOMEM;
+		if ((fd = dup(sb->fd)) < 0) {
+			pr_err("dup: %s\n", strerror(errno));
+			free_patch(patch);
+			return -errno;
+		}
+	} else {
+		if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			pr_err("open: %s: %s\n", path, strerror(errno));
+			return -errno;
+		}
+		if ((ret = clone_image(sb->fd, fd, sb->total_size, sb->dio_align)) != 0) {
+			close(fd);
+			return ret;
+		}
+	}
+
+	if ((ret = clone_super(&variant, sb, fd, patch)) != 0) {
+		free_patch(patch);
+		close(fd);
+		return ret;
+	}
+
+	pr_msg("Output: %s\n", path);
+	variant.patterns = patterns;
+	ret = run_break(&variant);
+	/* broken image is incomplete if modification isn't written back */
+	if ((err = put_super(&variant)) != 0 && !ret)
+		ret = err;
+
+	return ret;
+}
+
+/**
+ * variants to be generated by thread pool
+ */
+struct break_batch {
+	struct super_block *sb;  //!< Filesystem metadata of the original image
+	const char *dir;         //!< output directory
+	uint64_t *variants;      //!< enabled break patterns for each variant
+};
+
+/**
+ * @brief Generate one variant in thread pool
+ * @param [in] arg batch
+ * @param [in] job index of variant
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int run_break_job(void *arg, size_t job)
+{
+	struct break_batch *batch = arg;
+
+	return run_break_variant(batch->sb, batch->dir, batch->variants[job]);
+}
+
+/**
+ * @brief Load metadata of the original image used by variants
+ * @param [in] sb    Filesystem metadata of the original image
+ * @param [in] needs metadata read by variants (BREAK_NEED_*)
+ *
+ * @note Variants share it only if it is loaded here. Otherwise, each
+ *       variant loads own copy. So failure isn't fatal.
+ *       FAT isn't loaded here, because variants read only a few pages of
+ *       it on demand. Nothing is loaded for boot sector patterns.
+ */
+static void prepare_break_batch(struct super_block *sb, unsigned int needs)
+{
+	if ((needs & BREAK_NEED_BITMAP) && !sb->bitmap && load_alloc_bitmap(sb))
+		pr_warn("Allocation Bitmap can't be shared with variants.\n");
+	/* the table (or its fallback) is shared read-only by all variants */
+	if ((needs & BREAK_NEED_UPCASE) && !get_upcase_table(sb))
+		pr_warn("Up-case table can't be shared with variants.\n");
+}
+
+/**
+ * @brief Generate broken images for each variant
+ * @param [in] sb   Filesystem metadata of the original image
+ * @param [in] dir  output directory
+ * @param [in] line variants ("N,N+M,...", NULL means each pattern)
+ * @param [in] jobs the number of variants generated in parallel
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note The original image is parsed only once and never modified.
+ *       Each variant has own super_block and caches, and borrows only
+ *       metadata loaded by prepare_break_batch() read-only.
+ */
+int run_break_batch(struct super_block *sb, const char *dir, char *line, unsigned int jobs)
+{
+	int ret = 0;
+	unsigned int i, needs = 0;
+	size_t nr = 0;
+	char *ptr, *save;
+	struct break_batch batch = {.sb = sb, .dir = dir};
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		pr_err("mkdir: %s: %s\n", dir, strerror(errno));
+		return -errno;
+	}
+
+	if (!line) {
+		if ((batch.variants = calloc(count_break_pattern(), sizeof(uint64_t))) == NULL)
+			return -ENOMEM;
+		for (i = 0; i < count_break_pattern(); i++)
+			batch.variants[nr++] = BIT(i);
+	} else {
+		/* the number of variants is less than or equal to the number of ',' + 1 */
+		for (ptr = line, i = 1; *ptr; ptr++)
+			i += (*ptr == ',');
+		if ((batch.variants = calloc(i, sizeof(uint64_t))) == NULL)
+			return -ENOMEM;
+		for (ptr = strtok_r(line, ",", &save); ptr; ptr = strtok_r(NULL, ",", &save))
+			if ((ret = parse_break_variant(ptr, &batch.variants[nr++])) != 0)
+				goto out;
+	}
+
+	for (i = 0; i < nr; i++)
+		needs |= get_break_pattern_needs(batch.variants[i]);
+	if (nr > 1)
+		prepare_break_batch(sb, needs);
+	ret = run_pool(jobs, nr, run_break_job, &batch);
+out:
+	free(batch.variants);
+	return ret;
+}
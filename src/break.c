@@ -2,18 +2,20 @@
 /*
  *  Copyright (C) 2022 LeavaTail
  */
+#include <time.h>
 
 #include "exfat.h"
 #include "breakexfat.h"
+#include "endian.h"
 
 /**
  * break exFAT image information
  */
 struct break_pattern_information {
 	char *name;
-	bool choice;
 	int type;
 	int (*func)(struct super_block *, int);
+	unsigned int needs;  //!< metadata read by the pattern (BREAK_NEED_*)
 };
 
 static int break_boot_jumpboot(struct super_block *sb, int type);
@@ -34,42 +36,96 @@ static int break_boot_numfats(struct super_block *sb, int type);
 static int break_boot_inuse(struct super_block *sb, int type);
 static int break_boot_bootcode(struct super_block *sb, int type);
 static int break_boot_bootsig(struct super_block *sb, int type);
+static int break_dentry_checksum(struct super_block *sb, int type);
 
 //! Array for break pattern information
-static struct break_pattern_information break_boot_info[] =
+static const struct break_pattern_information break_boot_info[] =
 {
-	{"Invalid JumpBoot", false, 0, break_boot_jumpboot},
-	{"Invalid FileSystemName", false, 0, break_boot_fsname},
-	{"Not zero in MustBeZero", false, 0, break_boot_zero},
-	{"Invalid PartitionOffset", false, 0, break_boot_partoff},
-	{"Too small VolumeLength", false, 0, break_boot_vollen},
-	{"Too small FatOffset", false, 0, break_boot_fatoff},
-	{"Too large FatOffset", false, 1, break_boot_fatoff},
-	{"Too small FatLength", false, 0, break_boot_fatlen},
-	{"Too large FatLength", false, 1, break_boot_fatlen},
-	{"Too small ClusterHeapOffset", false, 0, break_boot_cluoff},
-	{"Too large ClusterHeapOffset", false, 1, break_boot_cluoff},
-	{"Too small ClusterCount", false, 0, break_boot_clucount},
-	{"Too large ClusterCount", false, 1, break_boot_clucount},
-	{"Too small FirstClusterOfRootDirectory", false, 0, break_boot_rootclu},
-	{"Too large FirstClusterOfRootDirectory", false, 1, break_boot_rootclu},
-	{"Invalid FirstClusterOfRootDirectory", false, 2, break_boot_rootclu},
-	{"Too small FileSystemRevision", false, 0, break_boot_fsrev},
-	{"Too large FileSystemRevision", false, 1, break_boot_fsrev},
-	{"Set ActiveFat in VolumeFlags", false, 0, break_boot_volflags},
-	{"Set VolumeDirty in VolumeFlags", false, 1, break_boot_volflags},
-	{"Set MediaFailure in VolumeFlags", false, 2, break_boot_volflags},
-	{"Set ClearToZero in VolumeFlags", false, 3, break_boot_volflags},
-	{"Too small BytesPerSectorShift", false, 0, break_boot_bps},
-	{"Too large BytesPerSectorShift", false, 1, break_boot_bps},
-	{"Too large SectorPerClusterShift", false, 0, break_boot_spc},
-	{"Too small NumberOfFats", false, 0, break_boot_numfats},
-	{"Too large NumberOfFats", false, 1, break_boot_numfats},
-	{"Too large PercentInUse", false, 0, break_boot_inuse},
-	{"Invalid BootCode", false, 0, break_boot_bootcode},
-	{"Invalid BootSignature", false, 0, break_boot_bootsig},
+	{"Invalid JumpBoot", 0, break_boot_jumpboot},
+	{"Invalid FileSystemName", 0, break_boot_fsname},
+	{"Not zero in MustBeZero", 0, break_boot_zero},
+	{"Invalid PartitionOffset", 0, break_boot_partoff},
+	{"Too small VolumeLength", 0, break_boot_vollen},
+	{"Too small FatOffset", 0, break_boot_fatoff},
+	{"Too large FatOffset", 1, break_boot_fatoff},
+	{"Too small FatLength", 0, break_boot_fatlen},
+	{"Too large FatLength", 1, break_boot_fatlen},
+	{"Too small ClusterHeapOffset", 0, break_boot_cluoff},
+	{"Too large ClusterHeapOffset", 1, break_boot_cluoff},
+	{"Too small ClusterCount", 0, break_boot_clucount},
+	{"Too large ClusterCount", 1, break_boot_clucount},
+	{"Too small FirstClusterOfRootDirectory", 0, break_boot_rootclu},
+	{"Too large FirstClusterOfRootDirectory", 1, break_boot_rootclu},
+	{"Invalid FirstClusterOfRootDirectory", 2, break_boot_rootclu},
+	{"Too small FileSystemRevision", 0, break_boot_fsrev},
+	{"Too large FileSystemRevision", 1, break_boot_fsrev},
+	{"Set ActiveFat in VolumeFlags", 0, break_boot_volflags},
+	{"Set VolumeDirty in VolumeFlags", 1, break_boot_volflags},
+	{"Set MediaFailure in VolumeFlags", 2, break_boot_volflags},
+	{"Set ClearToZero in VolumeFlags", 3, break_boot_volflags},
+	{"Too small BytesPerSectorShift", 0, break_boot_bps},
+	{"Too large BytesPerSectorShift", 1, break_boot_bps},
+	{"Too large SectorPerClusterShift", 0, break_boot_spc},
+	{"Too small NumberOfFats", 0, break_boot_numfats},
+	{"Too large NumberOfFats", 1, break_boot_numfats},
+	{"Too large PercentInUse", 0, break_boot_inuse},
+	{"Invalid BootCode", 0, break_boot_bootcode},
+	{"Invalid BootSignature", 0, break_boot_bootsig},
+	/* new patterns are appended, so that existing indices are kept */
+	{"Mismatched PercentInUse", 1, break_boot_inuse, BREAK_NEED_BITMAP},
+	{"Mismatched SetChecksum", 0, break_dentry_checksum, BREAK_NEED_UPCASE},
+	{"Mismatched NameHash", 1, break_dentry_checksum, BREAK_NEED_UPCASE},
 };
 
+//! The number of break patterns
+#define BREAK_PATTERN_NUM (sizeof(break_boot_info) / sizeof(break_boot_info[0]))
+
+_Static_assert(BREAK_PATTERN_NUM <= sizeof(uint64_t) * CHAR_BIT,
+		"break patterns must fit in super_block.patterns");
+_Static_assert(BREAK_PATTERN_NUM <= STATS_PATTERN_MAX,
+		"break patterns must fit in io_stats");
+
+/**
+ * @brief Get the number of break patterns
+ *
+ * @return the number of break patterns
+ */
+unsigned int count_break_pattern(void)
+{
+	return BREAK_PATTERN_NUM;
+}
+
+/**
+ * @brief Get metadata read by break patterns
+ * @param [in] patterns enabled break patterns (bitmask)
+ *
+ * @return BREAK_NEED_* of all @patterns (0: boot sector only)
+ */
+unsigned int get_break_pattern_needs(uint64_t patterns)
+{
+	unsigned int i, needs = 0;
+
+	for (i = 0; i < BREAK_PATTERN_NUM; i++)
+		if (patterns & BIT(i))
+			needs |= break_boot_info[i].needs;
+
+	return needs;
+}
+
+/**
+ * @brief Get name of break pattern
+ * @param [in] index index of break_info
+ *
+ * @return pattern name (or NULL)
+ */
+const char *get_break_pattern_name(unsigned int index)
+{
+	if (BREAK_PATTERN_NUM <= index)
+		return NULL;
+
+	return break_boot_info[index].name;
+}
+
 /**
  * @brief Enable break pattern
  * @param [in] sb    Filesystem metadata
@@ -80,10 +136,10 @@ static struct break_pattern_information break_boot_info[] =
  */
 int enable_break_pattern(struct super_block *sb, unsigned int index)
 {
-	if (sizeof(break_boot_info)/sizeof(break_boot_info[0]) < index)
+	if (BREAK_PATTERN_NUM <= index)
 		return -EINVAL;
 
-	break_boot_info[index].choice = true;
+	sb->patterns |= BIT(index);
 
 	return 0;
 }
@@ -98,10 +154,10 @@ int enable_break_pattern(struct super_block *sb, unsigned int index)
  */
 int disable_break_pattern(struct super_block *sb, unsigned int index)
 {
-	if (sizeof(break_boot_info)/sizeof(break_boot_info[0]) < index)
+	if (BREAK_PATTERN_NUM <= index)
 		return -EINVAL;
 
-	break_boot_info[index].choice = false;
+	sb->patterns &= ~BIT(index);
 
 	return 0;
 }
@@ -117,10 +173,9 @@ int enable_break_all_pattern(struct super_block *sb)
 {
 	int i;
 
-	for (i = 0; i < sizeof(break_boot_info)/sizeof(break_boot_info[0]); i++)
-		if (break_boot_info[i].choice == 0)
-			if (enable_break_pattern(sb, i))
-				return -EINVAL;
+	for (i = 0; i < BREAK_PATTERN_NUM; i++)
+		if (enable_break_pattern(sb, i))
+			return -EINVAL;
 
 	return 0;
 }
@@ -131,21 +186,33 @@ int enable_break_all_pattern(struct super_block *sb)
  *
  * @retval 0 success
  * @retval Negative failed
+ *
+ * @note With OPT_FIX_CHECKSUM, Boot Checksum is recalculated after all
+ *       patterns, so that checkers reach the broken field itself.
  */
 int run_break(struct super_block *sb)
 {
-	int i;
+	int i, ret = 0;
+	struct timespec start, end;
 	struct break_pattern_information tmp;
 
-	for (i = 0; i < sizeof(break_boot_info) / sizeof(break_boot_info[0]); i++) {
+	for (i = 0; i < BREAK_PATTERN_NUM; i++) {
 		tmp = break_boot_info[i];
-		if (tmp.choice) {
+		if (sb->patterns & BIT(i)) {
 			pr_msg("Break pattern: %s\n", tmp.name);
-			tmp.func(sb, tmp.choice);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			tmp.func(sb, tmp.type);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			stat_add(sb, pattern_runs[i], 1);
+			stat_add(sb, pattern_ns[i], (end.tv_sec - start.tv_sec) * 1000000000ULL +
+					end.tv_nsec - start.tv_nsec);
 		}
 	}
 
-	return 0;
+	if (sb->opt & BIT(OPT_FIX_CHECKSUM))
+		ret = update_boot_checksum(sb, sb->opt & BIT(OPT_FIX_BACKUP));
+
+	return ret;
 }
 
 /**
@@ -164,7 +231,7 @@ static int break_boot_jumpboot(struct super_block *sb, int type)
 	boot->jmp_boot[0] = 0xFF;
 	boot->jmp_boot[1] = 0xFF;
 	boot->jmp_boot[2] = 0xFF;
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -183,7 +250,7 @@ static int break_boot_fsname(struct super_block *sb, int type)
 	struct boot_sector *boot = cache->data;
 
 	memcpy(boot->fs_name, "        ", BOOTSEC_FSNAME_LEN);
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -204,7 +271,7 @@ static int break_boot_zero(struct super_block *sb, int type)
 
 	for (i = 0; i < BOOTSEC_ZERO_LEN; i++)
 		boot->must_be_zero[i] = 0xff;
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -223,7 +290,7 @@ static int break_boot_partoff(struct super_block *sb, int type)
 	struct boot_sector *boot = cache->data;
 
 	boot->partition_offset = ULONG_MAX;
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -242,7 +309,7 @@ static int break_boot_vollen(struct super_block *sb, int type)
 	struct boot_sector *boot = cache->data;
 
 	boot->vol_length = (power2(20) / sb->sector_size) - 1;
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -270,7 +337,7 @@ static int break_boot_fatoff(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -300,7 +367,7 @@ static int break_boot_fatlen(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -328,7 +395,7 @@ static int break_boot_cluoff(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -356,7 +423,7 @@ static int break_boot_clucount(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -387,7 +454,7 @@ static int break_boot_rootclu(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -417,7 +484,7 @@ static int break_boot_fsrev(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -451,7 +518,7 @@ static int break_boot_volflags(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -479,7 +546,7 @@ static int break_boot_bps(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -498,7 +565,7 @@ static int break_boot_spc(struct super_block *sb, int type)
 	struct boot_sector *boot = cache->data;
 
 	boot->sect_per_clus_bits = log_2(EXFAT_CLUSTER_MAX) - boot->sect_size_bits + 1;
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -526,7 +593,7 @@ static int break_boot_numfats(struct super_block *sb, int type)
 		default:
 			return -EINVAL;
 	}
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -541,11 +608,25 @@ static int break_boot_numfats(struct super_block *sb, int type)
  */
 static int break_boot_inuse(struct super_block *sb, int type)
 {
+	int ret;
+	uint32_t used;
 	struct cache *cache = get_sector_cache(sb, 0);
 	struct boot_sector *boot = cache->data;
 
-	boot->percent_in_use = 100 + 1;
-	cache->dirty = true;
+	switch (type) {
+		case 0:
+			boot->percent_in_use = 100 + 1;
+			break;
+		case 1:
+			if ((ret = count_alloc_bitmap(sb, &used)) != 0)
+				return ret;
+			/* valid value, but far from actual usage */
+			boot->percent_in_use = ((uint64_t)used * 100 / sb->cluster_count) < 50 ? 100 : 0;
+			break;
+		default:
+			return -EINVAL;
+	}
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -564,7 +645,7 @@ static int break_boot_bootcode(struct super_block *sb, int type)
 	struct boot_sector *boot = cache->data;
 
 	memset(boot->boot_code, 0, 390);
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
@@ -583,8 +664,88 @@ static int break_boot_bootsig(struct super_block *sb, int type)
 	struct boot_sector *boot = cache->data;
 
 	boot->signature = 0;
-	cache->dirty = true;
+	mark_cache_dirty(cache, 0, sizeof(struct boot_sector));
 
 	return 0;
 }
 
+/**
+ * arguments of break_dentry_func()
+ */
+struct break_dentry {
+	int type;                //!< break pattern
+	const uint16_t *upcase;  //!< Up-case table
+	bool done;               //!< whether entry set is broken
+};
+
+/**
+ * @brief Break the first entry set which has Stream dentry
+ * @param [in] sb  Filesystem metadata
+ * @param [in] set entry set
+ * @param [in] arg struct break_dentry
+ *
+ * @retval 1 entry set is broken
+ * @retval 0 entry set is skipped
+ * @retval -ECANCELED entry set is already broken
+ */
+static int break_dentry_func(struct super_block *sb, struct entry_set *set, void *arg)
+{
+	int bad;
+	uint16_t hash;
+	struct break_dentry *brk = arg;
+	struct exfat_dentry *stream = &set->d[1];
+
+	if (brk->done)
+		return -ECANCELED;
+	if (set->count < 2 || stream->type != DENTRY_STREAM)
+		return 0;
+
+	/* fields already mismatched (e.g. by other pattern) are kept broken */
+	bad = check_entry_set(set, brk->upcase, false);
+	switch (brk->type) {
+		case 0:
+			hash = calc_set_checksum(set->d, set->count);
+			set->d[0].dentry.file.checksum = cpu_to_le16(~hash);
+			break;
+		case 1:
+			hash = le16_to_cpu(stream->dentry.stream.name_hash);
+			if (!(bad & ENTRY_SET_BAD_HASH))
+				stream->dentry.stream.name_hash = cpu_to_le16(~hash);
+			/* SetChecksum covers NameHash, so that only NameHash is broken */
+			hash = calc_set_checksum(set->d, set->count);
+			if (!(bad & ENTRY_SET_BAD_CHECKSUM))
+				set->d[0].dentry.file.checksum = cpu_to_le16(hash);
+			break;
+	}
+	brk->done = true;
+
+	return 1;
+}
+
+/**
+ * @brief break SetChecksum or NameHash of entry set in root directory
+ * @param [in] sb    Filesystem metadata
+ * @param [in] type  break pattern
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int break_dentry_checksum(struct super_block *sb, int type)
+{
+	int ret;
+	struct inode root = {.name = "/", .name_len = 1, .clu = sb->root_offset};
+	struct break_dentry brk = {.type = type, .upcase = get_upcase_table(sb)};
+
+	if (type != 0 && type != 1)
+		return -EINVAL;
+
+	ret = iterate_entry_set(sb, &root, break_dentry_func, &brk);
+	if (ret && ret != -ECANCELED)
+		return ret;
+	if (!brk.done) {
+		pr_warn("Entry set isn't found in root directory.\n");
+		return -ENOENT;
+	}
+
+	return 0;
+}
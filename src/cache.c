@@ -6,6 +6,456 @@
 #include "breakexfat.h"
 #include "list.h"
 
+/**
+ * initial number of slots in cache index
+ */
+#define CACHE_INDEX_MIN 64
+
+/**
+ * removed slot in cache index
+ */
+static struct cache cache_tombstone;
+
+/**
+ * @brief calculate hash slot of cache
+ * @param [in] type  Cache type
+ * @param [in] index Start sector/cluster index
+ * @param [in] size  The number of slots (power of 2)
+ *
+ * @return first slot to be probed
+ */
+static inline size_t cache_hash(int type, off_t index, size_t size)
+{
+	uint64_t key = ((uint64_t)index << 1) | (type == CACHE_CLUSTER);
+
+	/* Fibonacci hashing */
+	key *= 0x9E3779B97F4A7C15ULL;
+	return (key >> 32) & (size - 1);
+}
+
+/**
+ * @brief resize cache index
+ * @param [in] ci   Cache index
+ * @param [in] size The number of new slots (power of 2)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int resize_cache_index(struct cache_index *ci, size_t size)
+{
+	size_t i, pos;
+	struct cache **old = ci->slot;
+	struct cache *cache;
+
+	if ((ci->slot = calloc(size, sizeof(struct cache *))) == NULL) {
+		pr_err("calloc: %s\n", strerror(errno));
+		ci->slot = old;
+		return -ENOMEM;
+	}
+
+	for (i = 0; old && i < ci->size; i++) {
+		cache = old[i];
+		if (!cache || cache == &cache_tombstone)
+			continue;
+		pos = cache_hash(cache->type, cache->offset, size);
+		while (ci->slot[pos])
+			pos = (pos + 1) & (size - 1);
+		ci->slot[pos] = cache;
+	}
+
+	free(old);
+	ci->size = size;
+	ci->removed = 0;
+
+	return 0;
+}
+
+/**
+ * @brief register cache into cache index
+ * @param [in] sb    Filesystem metadata
+ * @param [in] cache registered cache
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int insert_cache_index(struct super_block *sb, struct cache *cache)
+{
+	size_t pos, size;
+	struct cache_index *ci = sb->cache_index;
+
+	if (!ci) {
+		if ((ci = calloc(1, sizeof(struct cache_index))) == NULL) {
+			pr_err("calloc: %s\n", strerror(errno));
+			return -ENOMEM;
+		}
+		if (resize_cache_index(ci, CACHE_INDEX_MIN)) {
+			free(ci);
+			return -ENOMEM;
+		}
+		sb->cache_index = ci;
+	}
+
+	/* Keep load factor (including tombstones) under 3/4 */
+	if ((ci->used + ci->removed + 1) * 4 > ci->size * 3) {
+		size = ci->size;
+		if ((ci->used + 1) * 2 > size)
+			size <<= 1;
+		if (resize_cache_index(ci, size))
+			return -ENOMEM;
+	}
+
+	pos = cache_hash(cache->type, cache->offset, ci->size);
+	while (ci->slot[pos] && ci->slot[pos] != &cache_tombstone)
+		pos = (pos + 1) & (ci->size - 1);
+
+	if (ci->slot[pos] == &cache_tombstone)
+		ci->removed--;
+	ci->slot[pos] = cache;
+	ci->used++;
+
+	return 0;
+}
+
+/**
+ * @brief unregister cache from cache index
+ * @param [in] sb    Filesystem metadata
+ * @param [in] cache unregistered cache
+ */
+static void delete_cache_index(struct super_block *sb, struct cache *cache)
+{
+	size_t pos;
+	struct cache_index *ci = sb->cache_index;
+
+	if (!ci)
+		return;
+
+	pos = cache_hash(cache->type, cache->offset, ci->size);
+	while (ci->slot[pos]) {
+		if (ci->slot[pos] == cache) {
+			ci->slot[pos] = &cache_tombstone;
+			ci->used--;
+			ci->removed++;
+			return;
+		}
+		pos = (pos + 1) & (ci->size - 1);
+	}
+}
+
+/**
+ * @brief release cache and its data
+ * @param [in] cache target cache
+ */
+static void release_cache(struct cache *cache)
+{
+	if (!cache->mapped)
+		free(cache->data);
+	free(cache->dirty_map);
+	free(cache);
+}
+
+/**
+ * @brief calculate the size of cached data
+ * @param [in] cache target cache
+ *
+ * @return byte size of cached data
+ */
+static inline size_t cache_bytes(struct cache *cache)
+{
+	struct super_block *sb = cache->sb;
+
+	if (cache->type == CACHE_CLUSTER)
+		return sb->cluster_size * cache->count;
+	return sb->sector_size * cache->count;
+}
+
+/**
+ * @brief calculate byte offset of cached data in image
+ * @param [in] cache target cache
+ *
+ * @return byte offset in image
+ */
+static inline off_t cache_position(struct cache *cache)
+{
+	struct super_block *sb = cache->sb;
+	off_t sector = cache->offset;
+
+	if (cache->type == CACHE_CLUSTER)
+		sector = sb->heap_offset +
+			(cache->offset - EXFAT_FIRST_CLUSTER) * (sb->cluster_size / sb->sector_size);
+
+	return sector * sb->sector_size;
+}
+
+/**
+ * @brief unlink cache from LRU list
+ * @param [in] sb    Filesystem metadata
+ * @param [in] cache target cache
+ */
+static void lru_del(struct super_block *sb, struct cache *cache)
+{
+	if (cache->lru_prev)
+		cache->lru_prev->lru_next = cache->lru_next;
+	else if (sb->lru_head == cache)
+		sb->lru_head = cache->lru_next;
+
+	if (cache->lru_next)
+		cache->lru_next->lru_prev = cache->lru_prev;
+	else if (sb->lru_tail == cache)
+		sb->lru_tail = cache->lru_prev;
+
+	cache->lru_prev = NULL;
+	cache->lru_next = NULL;
+}
+
+/**
+ * @brief mark cache as most recently used
+ * @param [in] sb    Filesystem metadata
+ * @param [in] cache target cache
+ */
+static void lru_add(struct super_block *sb, struct cache *cache)
+{
+	cache->lru_prev = NULL;
+	cache->lru_next = sb->lru_head;
+	if (sb->lru_head)
+		sb->lru_head->lru_prev = cache;
+	sb->lru_head = cache;
+	if (!sb->lru_tail)
+		sb->lru_tail = cache;
+}
+
+/**
+ * @brief move cache to the head of LRU list
+ * @param [in] sb    Filesystem metadata
+ * @param [in] cache target cache
+ */
+static inline void lru_touch(struct super_block *sb, struct cache *cache)
+{
+	if (sb->lru_head == cache)
+		return;
+	lru_del(sb, cache);
+	lru_add(sb, cache);
+}
+
+/**
+ * @brief the number of sectors in cache
+ * @param [in] cache target cache
+ *
+ * @return the number of sectors
+ */
+static inline size_t cache_sectors(struct cache *cache)
+{
+	return cache_bytes(cache) / cache->sb->sector_size;
+}
+
+/**
+ * @brief Mark byte range of cache as modified
+ * @param [in] cache  target cache
+ * @param [in] offset byte offset in cached data
+ * @param [in] len    byte length of modified data
+ *
+ * @note Only sectors including the range are written back. If the range
+ *       can't be recorded, whole data is written back instead.
+ */
+void mark_cache_dirty(struct cache *cache, size_t offset, size_t len)
+{
+	size_t i, nr = cache_sectors(cache);
+	size_t sector_size = cache->sb->sector_size;
+
+	if (!len)
+		return;
+
+	/* whole data is already dirty */
+	if (cache->dirty && !cache->dirty_map)
+		return;
+
+	if (offset + len > nr * sector_size || nr == 1) {
+		free(cache->dirty_map);
+		cache->dirty_map = NULL;
+		cache->dirty = true;
+		return;
+	}
+
+	if (!cache->dirty_map &&
+			(cache->dirty_map = calloc(ROUNDUP(nr, CHAR_BIT), sizeof(uint8_t))) == NULL) {
+		cache->dirty = true;
+		return;
+	}
+
+	for (i = offset / sector_size; i <= (offset + len - 1) / sector_size; i++)
+		cache->dirty_map[i / CHAR_BIT] |= BIT(i % CHAR_BIT);
+	cache->dirty = true;
+}
+
+/**
+ * @brief Find next run of modified sectors in cache
+ * @param [in]     cache target cache
+ * @param [in,out] start sector index to start search (start of run)
+ * @param [out]    len   the number of sectors in run
+ *
+ * @retval true  run is found
+ * @retval false no more modified sector
+ */
+static bool next_dirty_run(struct cache *cache, size_t *start, size_t *len)
+{
+	size_t i, nr = cache_sectors(cache);
+
+	if (!cache->dirty)
+		return false;
+
+	if (!cache->dirty_map) {
+		if (*start)
+			return false;
+		*len = nr;
+		return true;
+	}
+
+	for (i = *start; i < nr && !(cache->dirty_map[i / CHAR_BIT] & BIT(i % CHAR_BIT)); i++)
+		;
+	if (i == nr)
+		return false;
+	*start = i;
+	for (; i < nr && (cache->dirty_map[i / CHAR_BIT] & BIT(i % CHAR_BIT)); i++)
+		;
+	*len = i - *start;
+
+	return true;
+}
+
+/**
+ * @brief Mark cache as written back
+ * @param [in] cache target cache
+ */
+static void clear_cache_dirty(struct cache *cache)
+{
+	free(cache->dirty_map);
+	cache->dirty_map = NULL;
+	cache->dirty = false;
+}
+
+/**
+ * @brief write back cache if it is modified
+ * @param [in] sb    Filesystem metadata
+ * @param [in] cache target cache
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int writeback_cache(struct super_block *sb, struct cache *cache)
+{
+	int ret;
+	size_t start = 0, len, bytes = 0;
+	off_t sector = cache_position(cache) / sb->sector_size;
+
+	if (!cache->dirty)
+		return 0;
+
+	if (!cache->dirty_map) {
+		if ((ret = cache->write(sb, cache->data, cache->offset, cache->count)) != 0)
+			return ret;
+		bytes = cache_bytes(cache);
+	} else {
+		for (; next_dirty_run(cache, &start, &len); start += len) {
+			if ((ret = set_sector(sb, (char *)cache->data + start * sb->sector_size,
+							sector + start, len)) != 0)
+				return ret;
+			bytes += len * sb->sector_size;
+		}
+	}
+
+	stat_add(sb, cache_writebacks, 1);
+	stat_add(sb, cache_writeback_bytes, bytes);
+	clear_cache_dirty(cache);
+	return 0;
+}
+
+/**
+ * @brief drop list nodes of evicted caches
+ * @param [in] head list of caches
+ */
+static void compact_cache_list(struct list_head **head)
+{
+	struct list_head *node, *prev = NULL, *next;
+
+	for (node = *head; node != NULL; node = next) {
+		next = node->next;
+		if (node->data) {
+			prev = node;
+			continue;
+		}
+		if (prev)
+			prev->next = next;
+		else
+			*head = next;
+		free(node);
+	}
+}
+
+/**
+ * @brief evict least recently used cache
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int evict_cache(struct super_block *sb)
+{
+	int ret;
+	struct cache *cache = sb->lru_tail;
+	struct cache_index *ci = sb->cache_index;
+
+	if (!cache)
+		return -ENOENT;
+
+	if ((ret = writeback_cache(sb, cache)) != 0) {
+		pr_err("Failed to write back %s#%lx\n",
+				cache->type == CACHE_CLUSTER ? "cluster" : "sector", cache->offset);
+		return ret;
+	}
+
+	pr_debug("Evict cache for %s#%lx (nums: %lu)\n",
+			cache->type == CACHE_CLUSTER ? "cluster" : "sector",
+			cache->offset, cache->count);
+
+	lru_del(sb, cache);
+	delete_cache_index(sb, cache);
+	sb->cache_size -= cache_bytes(cache);
+	stat_add(sb, cache_evictions, 1);
+
+	/* list node is released later by compact_cache_list() */
+	cache->node->data = NULL;
+	release_cache(cache);
+
+	if (++ci->stale > ci->used) {
+		compact_cache_list(&sb->sector_list);
+		compact_cache_list(&sb->cluster_list);
+		ci->stale = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief evict caches until new data fits in cache limit
+ * @param [in] sb   Filesystem metadata
+ * @param [in] size byte size of new data
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int shrink_cache(struct super_block *sb, size_t size)
+{
+	int ret;
+
+	if (!sb->cache_limit)
+		return 0;
+
+	while (sb->lru_tail && sb->cache_size + size > sb->cache_limit)
+		if ((ret = evict_cache(sb)) != 0)
+			return ret;
+
+	return 0;
+}
+
 /**
  * @brief create cache
  * @param [in] sb    Filesystem metadata
@@ -25,52 +475,109 @@ static struct cache *create_cache(struct super_block *sb, uint32_t index, size_t
 
 	cache->sb = sb;
 	cache->data = NULL;
+	cache->type = CACHE_SECTOR;
 	cache->offset = index;
 	cache->count = count;
 	cache->dirty = false;
+	cache->dirty_map = NULL;
+	cache->mapped = false;
 	cache->read = NULL;
 	cache->write = NULL;
 	cache->print = NULL;
 	cache->next = NULL;
+	cache->node = NULL;
+	cache->lru_prev = NULL;
+	cache->lru_next = NULL;
 	return cache;
 }
 
 /**
- * @brief create cache for cluster
+ * @brief allocate cache for cluster without reading
  * @param [in] sb    Filesystem metadata
  * @param [in] index Start cluster index
  * @param [in] count The number of cluster
  *
- * @return created cache (or NULL)
+ * @return allocated cache (or NULL)
  */
-struct cache *create_cluster_cache(struct super_block *sb, uint32_t index, size_t count)
+static struct cache *alloc_cluster_cache(struct super_block *sb, uint32_t index, size_t count)
 {
-	void *data;
 	struct cache *clu;
 
 	if ((clu = create_cache(sb, index, count)) == NULL)
-		goto err;
-
-	if ((data = malloc(sb->cluster_size * count)) == NULL)
-		goto free_clu;
+		return NULL;
 
-	if (get_cluster(sb, data, index, count))
-		goto free_data;
+	if ((clu->data = map_cluster(sb, index, count)) != NULL) {
+		clu->mapped = true;
+	} else if ((clu->data = alloc_io_buffer(sb, sb->cluster_size * count)) == NULL) {
+		pr_err("malloc: %s\n", strerror(errno));
+		free(clu);
+		return NULL;
+	}
 
-	clu->data = data;
+	clu->type = CACHE_CLUSTER;
 	clu->read = get_cluster;
 	clu->write = set_cluster;
 	clu->print = print_cluster;
-	pr_debug("Create cache for cluster#%x (nums: %lu)\n", index, count);
 
 	return clu;
+}
 
-free_data:
-	free(data);
-free_clu:
-	free(clu);
-err:
-	return NULL;
+/**
+ * @brief allocate cache for sector without reading
+ * @param [in] sb    Filesystem metadata
+ * @param [in] index Start sector index
+ * @param [in] count The number of sectors
+ *
+ * @return allocated cache (or NULL)
+ */
+static struct cache *alloc_sector_cache(struct super_block *sb, uint32_t index, size_t count)
+{
+	struct cache *sec;
+
+	if ((sec = create_cache(sb, index, count)) == NULL)
+		return NULL;
+
+	if ((sec->data = map_sector(sb, index, count)) != NULL) {
+		sec->mapped = true;
+	} else if ((sec->data = alloc_io_buffer(sb, sb->sector_size * count)) == NULL) {
+		pr_err("malloc: %s\n", strerror(errno));
+		free(sec);
+		return NULL;
+	}
+
+	sec->type = CACHE_SECTOR;
+	sec->read = get_sector;
+	sec->write = set_sector;
+	sec->print = print_sector;
+
+	return sec;
+}
+
+/**
+ * @brief create cache for cluster
+ * @param [in] sb    Filesystem metadata
+ * @param [in] index Start cluster index
+ * @param [in] count The number of cluster
+ *
+ * @return created cache (or NULL)
+ */
+struct cache *create_cluster_cache(struct super_block *sb, uint32_t index, size_t count)
+{
+	struct cache *clu;
+
+	if ((clu = alloc_cluster_cache(sb, index, count)) == NULL)
+		return NULL;
+
+	if (!clu->mapped && get_cluster(sb, clu->data, index, count)) {
+		release_cache(clu);
+		return NULL;
+	}
+	stat_add(sb, cache_fills, 1);
+	stat_add(sb, cache_fill_bytes, cache_bytes(clu));
+
+	pr_debug("Create cache for cluster#%x (nums: %lu)\n", index, count);
+
+	return clu;
 }
 
 /**
@@ -83,56 +590,92 @@ err:
  */
 struct cache *create_sector_cache(struct super_block *sb, uint32_t index, size_t count)
 {
-	void *data;
-	struct cache *clu;
-
-	if ((clu = create_cache(sb, index, count)) == NULL)
-		goto err;
+	struct cache *sec;
 
-	if ((data = malloc(sb->sector_size * count)) == NULL)
-		goto free_clu;
+	if ((sec = alloc_sector_cache(sb, index, count)) == NULL)
+		return NULL;
 
-	if (get_sector(sb, data, index, count))
-		goto free_data;
+	if (!sec->mapped && get_sector(sb, sec->data, index, count)) {
+		release_cache(sec);
+		return NULL;
+	}
+	stat_add(sb, cache_fills, 1);
+	stat_add(sb, cache_fill_bytes, cache_bytes(sec));
 
-	clu->data = data;
-	clu->read = get_sector;
-	clu->write = set_sector;
-	clu->print = print_sector;
 	pr_debug("Create cache for sector#%x (nums: %lu)\n", index, count);
 
-	return clu;
-
-free_data:
-	free(data);
-free_clu:
-	free(clu);
-err:
-	return NULL;
+	return sec;
 }
 
 /**
- * @brief Search cache from list
+ * @brief Search cache from cache index
  * @param [in] sb    Filesystem metadata
- * @param [in] index Start sector index
- * @param [in] list  Searched list
+ * @param [in] type  Cache type
+ * @param [in] index Start sector/cluster index
  *
  * @return target cache (or NULL)
  */
-static struct cache *search_cache(struct super_block *sb, struct list_head *head, uint32_t index)
+static struct cache *search_cache(struct super_block *sb, int type, uint32_t index)
 {
-	struct list_head *node;
+	size_t pos;
 	struct cache *cache;
+	struct cache_index *ci = sb->cache_index;
 
-	for (node = head; node != NULL; node = node->next) {
-		cache = node->data;
-		if (cache->offset == index)
+	if (!ci)
+		return NULL;
+
+	pos = cache_hash(type, index, ci->size);
+	while ((cache = ci->slot[pos]) != NULL) {
+		if (cache != &cache_tombstone &&
+				cache->type == type && cache->offset == index)
 			return cache;
+		pos = (pos + 1) & (ci->size - 1);
 	}
 
 	return NULL;
 }
 
+/**
+ * @brief Add cache into list and cache index
+ * @param [in] sb    Filesystem metadata
+ * @param [in] cache added cache
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note If cache limit is set, least recently used caches are written back
+ *       and evicted to make room. Cache got before may be released.
+ */
+int add_cache(struct super_block *sb, struct cache *cache)
+{
+	int ret;
+	struct list_head **head;
+
+	if (!cache)
+		return -EINVAL;
+
+	/* modified data which can't be written back is kept in cache */
+	if ((ret = shrink_cache(sb, cache_bytes(cache))) != 0)
+		return ret;
+
+	if (insert_cache_index(sb, cache))
+		return -ENOMEM;
+
+	head = cache->type == CACHE_CLUSTER ? &sb->cluster_list : &sb->sector_list;
+	if (*head) {
+		list_add(*head, cache);
+		cache->node = (*head)->next;
+	} else {
+		*head = init_list_head(cache);
+		cache->node = *head;
+	}
+
+	lru_add(sb, cache);
+	sb->cache_size += cache_bytes(cache);
+
+	return 0;
+}
+
 /**
  * @brief Get cluster cache
  * @param [in] sb    Filesystem metadata
@@ -144,14 +687,21 @@ struct cache *get_cluster_cache(struct super_block *sb, uint32_t index)
 {
 	struct cache *cache;
 
-	if ((cache = search_cache(sb, sb->cluster_list, index)) != NULL)
+	if ((cache = search_cache(sb, CACHE_CLUSTER, index)) != NULL) {
+		stat_add(sb, cache_hits, 1);
+		lru_touch(sb, cache);
 		return cache;
+	}
+	stat_add(sb, cache_misses, 1);
 
 	cache = create_cluster_cache(sb, index, 1);
 	if (!cache)
 		return NULL;
 
-	list_add(sb->cluster_list, cache);
+	if (add_cache(sb, cache)) {
+		release_cache(cache);
+		return NULL;
+	}
 
 	return cache;
 }
@@ -167,27 +717,392 @@ struct cache *get_sector_cache(struct super_block *sb, uint32_t index)
 {
 	struct cache *cache;
 
-	if ((cache = search_cache(sb, sb->sector_list, index)) != NULL)
+	if ((cache = search_cache(sb, CACHE_SECTOR, index)) != NULL) {
+		stat_add(sb, cache_hits, 1);
+		lru_touch(sb, cache);
 		return cache;
+	}
+	stat_add(sb, cache_misses, 1);
 
 	cache = create_sector_cache(sb, index, 1);
 	if (!cache)
 		return NULL;
 
-	list_add(sb->sector_list, cache);
+	if (add_cache(sb, cache)) {
+		release_cache(cache);
+		return NULL;
+	}
 
 	return cache;
 }
 
+/**
+ * @brief compare caches by offset in image
+ * @param [in] a pointer to cache
+ * @param [in] b pointer to cache
+ *
+ * @return negative, zero or positive
+ */
+static int compare_cache_position(const void *a, const void *b)
+{
+	off_t x = cache_position(*(struct cache **)a);
+	off_t y = cache_position(*(struct cache **)b);
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Read clusters into cache in one batch
+ * @param [in] sb    Filesystem metadata
+ * @param [in] index cluster indexes
+ * @param [in] nr    the number of clusters
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Uncached clusters are sorted by offset in image, and physically
+ *       contiguous clusters are read by one vectored request (scattered
+ *       into each cache) up to @sb->max_io bytes.
+ */
+int prefetch_cluster_cache(struct super_block *sb, const uint32_t *index, size_t nr)
+{
+	size_t i, n = 0, nr_req = 0;
+	int ret = 0;
+	size_t *slot = NULL;
+	struct cache **caches;
+	struct iovec *vec = NULL;
+	struct io_request *req = NULL;
+
+	if (!nr)
+		return 0;
+
+	/* mapped image doesn't need to read */
+	if (sb->map) {
+		for (i = 0; i < nr; i++)
+			if (!get_cluster_cache(sb, index[i]))
+				ret = -EIO;
+		return ret;
+	}
+
+	if ((caches = calloc(nr, sizeof(struct cache *))) == NULL ||
+			(vec = calloc(nr, sizeof(struct iovec))) == NULL ||
+			(req = calloc(nr, sizeof(struct io_request))) == NULL ||
+			(slot = calloc(nr, sizeof(size_t))) == NULL) {
+		free(req);
+		free(vec);
+		free(caches);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (search_cache(sb, CACHE_CLUSTER, index[i])) {
+			stat_add(sb, cache_hits, 1);
+			continue;
+		}
+		stat_add(sb, cache_misses, 1);
+		if (validate_cluster(sb, index[i]) || index[i] == EXFAT_LASTCLUSTER) {
+			ret = -EINVAL;
+			continue;
+		}
+		if ((caches[n] = alloc_cluster_cache(sb, index[i], 1)) == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		n++;
+	}
+	qsort(caches, n, sizeof(struct cache *), compare_cache_position);
+
+	for (i = 0; i < n; i++) {
+		struct io_request *r = nr_req ? &req[nr_req - 1] : NULL;
+
+		vec[i].iov_base = caches[i]->data;
+		vec[i].iov_len = cache_bytes(caches[i]);
+		if (r && r->offset + r->size == cache_position(caches[i]) &&
+				r->size + vec[i].iov_len <= sb->max_io && r->nr_vec < IO_MAX_VECS) {
+			r->size += vec[i].iov_len;
+			r->nr_vec++;
+		} else {
+			r = &req[nr_req++];
+			r->fd = -1;
+			r->vec = &vec[i];
+			r->nr_vec = 1;
+			r->offset = cache_position(caches[i]);
+			r->size = vec[i].iov_len;
+		}
+		slot[i] = nr_req - 1;
+	}
+
+	submit_io(sb, req, nr_req, false);
+
+	for (i = 0; i < n; i++) {
+		int err = req[slot[i]].ret;
+
+		/* short read leaves stale data in cache */
+		if (err >= 0 && req[slot[i]].ret != req[slot[i]].size)
+			err = -EIO;
+
+		/* the same cluster may be requested twice */
+		if (err >= 0 && search_cache(sb, CACHE_CLUSTER, caches[i]->offset)) {
+			release_cache(caches[i]);
+			continue;
+		}
+		if (err >= 0)
+			err = add_cache(sb, caches[i]);
+		if (err < 0) {
+			ret = err;
+			release_cache(caches[i]);
+			continue;
+		}
+		stat_add(sb, cache_fills, 1);
+		stat_add(sb, cache_fill_bytes, vec[i].iov_len);
+	}
+
+	free(slot);
+	free(req);
+	free(vec);
+	free(caches);
+	return ret;
+}
+
+/**
+ * @brief Start reading cluster chain
+ * @param [out] chain chain reader (@index, @window and @ahead are kept)
+ * @param [in]  inode target file/directory
+ */
+void start_chain_reader(struct chain_reader *chain, struct inode *inode)
+{
+	chain->inode = inode;
+	chain->next = inode->clu ? inode->clu : EXFAT_LASTCLUSTER;
+	chain->resolved = 0;
+	chain->count = 0;
+	chain->err = 0;
+}
+
+/**
+ * @brief Resolve cluster chain until @chain->index is full
+ * @param [in] sb    Filesystem metadata
+ * @param [in] chain chain reader
+ *
+ * @note The chain is resolved by each extent. An error is kept in
+ *       @chain->err, and no more clusters are resolved after it.
+ */
+static void resolve_cluster_chain(struct super_block *sb, struct chain_reader *chain)
+{
+	size_t i, size = chain->window + chain->ahead;
+	uint32_t len, next;
+
+	while (!chain->err && chain->resolved < size && chain->next != EXFAT_LASTCLUSTER) {
+		if ((chain->err = get_cluster_run(sb, chain->inode, chain->next, &len, &next)) != 0)
+			break;
+		for (i = 0; i < len && chain->resolved < size; i++)
+			chain->index[chain->resolved++] = chain->next++;
+		if (i == len)
+			chain->next = next;
+	}
+}
+
+/**
+ * @brief Hint clusters to be read soon
+ * @param [in] sb    Filesystem metadata
+ * @param [in] index cluster indexes
+ * @param [in] nr    the number of clusters
+ */
+static void readahead_clusters(struct super_block *sb, const uint32_t *index, size_t nr)
+{
+	size_t i, j;
+	off_t heap = (off_t)sb->heap_offset * sb->sector_size;
+
+	/* contiguous clusters are hinted at once */
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr && index[j] == index[j - 1] + 1; j++)
+			;
+		readahead_io(sb, heap + (off_t)(index[i] - EXFAT_FIRST_CLUSTER) * sb->cluster_size,
+				(j - i) * sb->cluster_size);
+	}
+}
+
+/**
+ * @brief Read the next window of cluster chain into cache
+ * @param [in]  sb    Filesystem metadata
+ * @param [in]  chain chain reader started by start_chain_reader()
+ * @param [out] nr    the number of clusters in window (0: end of chain)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note The window is @chain->index[0 .. @nr), and it is read by
+ *       prefetch_cluster_cache(). The chain is resolved up to @chain->ahead
+ *       clusters beyond the window, and they are hinted by readahead_io(),
+ *       so that the device reads them while the caller processes the
+ *       window. If the chain is broken, its error is returned after all
+ *       clusters before it are read.
+ */
+int read_cluster_chain(struct super_block *sb, struct chain_reader *chain, size_t *nr)
+{
+	int ret;
+	size_t hinted;
+
+	/* clusters beyond the previous window are already hinted */
+	chain->resolved -= chain->count;
+	memmove(chain->index, chain->index + chain->count, chain->resolved * sizeof(uint32_t));
+	hinted = chain->resolved;
+
+	resolve_cluster_chain(sb, chain);
+	chain->count = MIN(chain->window, chain->resolved);
+	*nr = chain->count;
+	if (!chain->count)
+		return chain->err;
+
+	ret = prefetch_cluster_cache(sb, chain->index, chain->count);
+
+	hinted = MAX(hinted, chain->count);
+	readahead_clusters(sb, chain->index + hinted, chain->resolved - hinted);
+
+	return ret;
+}
+
+/**
+ * modified range of cache to be written back
+ */
+struct dirty_run {
+	struct cache *cache;  //!< cache containing the range
+	off_t offset;         //!< byte offset in image
+	size_t size;          //!< byte size
+	void *data;           //!< modified data
+	size_t req;           //!< index of merged request
+};
+
+/**
+ * @brief compare dirty ranges by offset in image
+ * @param [in] a dirty range
+ * @param [in] b dirty range
+ *
+ * @return negative, zero or positive
+ */
+static int compare_dirty_run(const void *a, const void *b)
+{
+	const struct dirty_run *x = a, *y = b;
+
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/**
+ * @brief Write back all modified caches in list in one batch
+ * @param [in] sb    Filesystem metadata
+ * @param [in] head  head of list
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Modified ranges are sorted by offset in image, and adjacent ranges
+ *       are merged into one vectored request up to @sb->max_io bytes.
+ */
+int flush_cache_list(struct super_block *sb, struct list_head *head)
+{
+	size_t i, j, n = 0, nr_req = 0, start, len;
+	int ret = 0;
+	struct list_head *node;
+	struct cache *cache;
+	struct dirty_run *runs;
+	struct iovec *vec = NULL;
+	struct io_request *req = NULL;
+
+	/* one range for each run of modified sectors */
+	for (node = head; node != NULL; node = node->next)
+		if ((cache = node->data) != NULL && !cache->mapped)
+			for (start = 0; next_dirty_run(cache, &start, &len); start += len)
+				n++;
+	if (!n)
+		goto mapped;
+
+	if ((runs = calloc(n, sizeof(struct dirty_run))) == NULL ||
+			(vec = calloc(n, sizeof(struct iovec))) == NULL ||
+			(req = calloc(n, sizeof(struct io_request))) == NULL) {
+		free(vec);
+		free(runs);
+		return -ENOMEM;
+	}
+
+	n = 0;
+	for (node = head; node != NULL; node = node->next) {
+		if ((cache = node->data) == NULL || cache->mapped)
+			continue;
+		for (start = 0; next_dirty_run(cache, &start, &len); start += len) {
+			runs[n].cache = cache;
+			runs[n].data = (char *)cache->data + start * sb->sector_size;
+			runs[n].offset = cache_position(cache) + start * sb->sector_size;
+			runs[n].size = len * sb->sector_size;
+			n++;
+		}
+	}
+	qsort(runs, n, sizeof(struct dirty_run), compare_dirty_run);
+
+	for (i = 0; i < n; i++) {
+		struct io_request *r = nr_req ? &req[nr_req - 1] : NULL;
+
+		vec[i].iov_base = runs[i].data;
+		vec[i].iov_len = runs[i].size;
+		if (r && r->offset + r->size == runs[i].offset &&
+				r->size + runs[i].size <= sb->max_io && r->nr_vec < IO_MAX_VECS) {
+			r->size += runs[i].size;
+			r->nr_vec++;
+		} else {
+			r = &req[nr_req++];
+			r->fd = -1;
+			r->vec = &vec[i];
+			r->nr_vec = 1;
+			r->offset = runs[i].offset;
+			r->size = runs[i].size;
+		}
+		runs[i].req = nr_req - 1;
+	}
+
+	submit_io(sb, req, nr_req, true);
+
+	/* caches with any failed (or short) range stay dirty and are retried by remove_cache() */
+	for (i = 0; i < n; i++) {
+		if (req[runs[i].req].ret == req[runs[i].req].size)
+			continue;
+		ret = -EIO;
+		cache = runs[i].cache;
+		for (j = 0; j < n; j++)
+			if (runs[j].cache == cache)
+				runs[j].cache = NULL;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(cache = runs[i].cache))
+			continue;
+		stat_add(sb, cache_writeback_bytes, runs[i].size);
+		if (cache->dirty) {
+			clear_cache_dirty(cache);
+			stat_add(sb, cache_writebacks, 1);
+		}
+	}
+
+	free(req);
+	free(vec);
+	free(runs);
+mapped:
+	/* mapped data is already in place */
+	for (node = head; node != NULL; node = node->next)
+		if ((cache = node->data) != NULL && cache->mapped && cache->dirty)
+			clear_cache_dirty(cache);
+	return ret;
+}
+
 /**
  * @brief remove node from list
  * @param [in] sb    Filesystem metadata
  * @param [in] prev  removed previous node
  *
- * @return success or failed
+ * @retval 0 success
+ * @retval Negative failed to write back modified data
+ *
+ * @note Cache is released even if it failed to be written back.
  */
 int remove_cache(struct super_block *sb, struct list_head *prev)
 {
+	int ret;
 	struct list_head *node;
 	struct cache *cache;
 
@@ -197,16 +1112,27 @@ int remove_cache(struct super_block *sb, struct list_head *prev)
 	if ((node = prev->next) == NULL)
 		node = prev;
 
-	cache = node->data;
-	if (cache->dirty)
-		cache->write(sb, cache->data, cache->offset, cache->count);
+	if ((cache = node->data) == NULL) {
+		/* node for evicted cache */
+		if (sb->cache_index && sb->cache_index->stale)
+			sb->cache_index->stale--;
+		list_del(prev);
+		return 0;
+	}
 
-	free(cache->data);
-	free(cache);
+	if ((ret = writeback_cache(sb, cache)) != 0)
+		pr_err("Failed to write back %s#%lx\n",
+				cache->type == CACHE_CLUSTER ? "cluster" : "sector", cache->offset);
+
+	lru_del(sb, cache);
+	delete_cache_index(sb, cache);
+	sb->cache_size -= cache_bytes(cache);
+
+	release_cache(cache);
 
 	list_del(prev);
 
-	return 0;
+	return ret;
 }
 
 /**
@@ -214,17 +1140,31 @@ int remove_cache(struct super_block *sb, struct list_head *prev)
  * @param [in] sb    Filesystem metadata
  * @param [in] head  removed head of list
  *
- * @return success or failed
+ * @retval 0 success
+ * @retval Negative failed to write back some caches (the first error)
  */
 int remove_cache_list(struct super_block *sb, struct list_head *head)
 {
+	int ret = 0, err;
+
 	if (!head)
 		return 0;
 
+	/* failed ranges stay dirty, and are written back again by remove_cache() */
+	flush_cache_list(sb, head);
+
 	while (head->next != NULL) {
-		remove_cache(sb, head);
+		if ((err = remove_cache(sb, head)) != 0 && !ret)
+			ret = err;
 	}
-	remove_cache(sb, head);
+	if ((err = remove_cache(sb, head)) != 0 && !ret)
+		ret = err;
 
-	return 0;
+	if (sb->cache_index && !sb->cache_index->used) {
+		free(sb->cache_index->slot);
+		free(sb->cache_index);
+		sb->cache_index = NULL;
+	}
+
+	return ret;
 }
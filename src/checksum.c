@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include <stddef.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+#include "endian.h"
+
+/**
+ * the number of sectors covered by Boot Checksum
+ */
+#define BOOT_CHECKSUM_SECTORS 11
+
+/**
+ * @brief Add bytes into exFAT checksum
+ * @param [in] checksum current checksum
+ * @param [in] data     bytes
+ * @param [in] len      byte length
+ *
+ * @return updated checksum
+ *
+ * @note Each step depends on the previous one (rotate right and add),
+ *       so bytes can't be summed in parallel. Rotation is written without
+ *       branch, so that it is compiled into one instruction.
+ */
+static inline uint32_t add_checksum32(uint32_t checksum, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		checksum = ((checksum >> 1) | (checksum << 31)) + data[i];
+		checksum = ((checksum >> 1) | (checksum << 31)) + data[i + 1];
+		checksum = ((checksum >> 1) | (checksum << 31)) + data[i + 2];
+		checksum = ((checksum >> 1) | (checksum << 31)) + data[i + 3];
+	}
+	for (; i < len; i++)
+		checksum = ((checksum >> 1) | (checksum << 31)) + data[i];
+
+	return checksum;
+}
+
+/**
+ * @brief Add bytes into 16-bit exFAT checksum
+ * @param [in] checksum current checksum
+ * @param [in] data     bytes
+ * @param [in] len      byte length
+ *
+ * @return updated checksum
+ */
+static inline uint16_t add_checksum16(uint16_t checksum, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		checksum = (uint16_t)((checksum >> 1) | (checksum << 15)) + data[i];
+		checksum = (uint16_t)((checksum >> 1) | (checksum << 15)) + data[i + 1];
+		checksum = (uint16_t)((checksum >> 1) | (checksum << 15)) + data[i + 2];
+		checksum = (uint16_t)((checksum >> 1) | (checksum << 15)) + data[i + 3];
+	}
+	for (; i < len; i++)
+		checksum = (uint16_t)((checksum >> 1) | (checksum << 15)) + data[i];
+
+	return checksum;
+}
+
+/**
+ * @brief Calculate Boot Checksum of boot region
+ * @param [in] region      Main (or Backup) Boot Sector and the following 10 sectors
+ * @param [in] sector_size bytes per sector
+ *
+ * @return Boot Checksum
+ *
+ * @note VolumeFlags and PercentInUse in Boot Sector are excluded, since
+ *       they are changed without updating Boot Checksum.
+ */
+uint32_t calc_boot_checksum(const void *region, size_t sector_size)
+{
+	const uint8_t *data = region;
+	size_t flags = offsetof(struct boot_sector, vol_flags);
+	size_t inuse = offsetof(struct boot_sector, percent_in_use);
+	uint32_t checksum = 0;
+
+	/* excluded bytes are skipped outside the loop */
+	checksum = add_checksum32(checksum, data, flags);
+	checksum = add_checksum32(checksum, data + flags + sizeof(__le16),
+			inuse - flags - sizeof(__le16));
+	checksum = add_checksum32(checksum, data + inuse + 1,
+			BOOT_CHECKSUM_SECTORS * sector_size - inuse - 1);
+
+	return checksum;
+}
+
+/**
+ * @brief Recalculate Boot Checksum sector from cached boot region
+ * @param [in] sb     Filesystem metadata
+ * @param [in] backup also copy Main Boot region into Backup Boot region
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Broken fields in Boot Sector are kept, and only Boot Checksum
+ *       sector is rewritten so that it matches them. Geometry is taken
+ *       from @sb, not from (possibly broken) Boot Sector.
+ */
+int update_boot_checksum(struct super_block *sb, bool backup)
+{
+	int ret = 0;
+	size_t i;
+	uint8_t *region;
+	uint32_t *sum;
+	struct cache *cache;
+
+	if ((region = malloc((BOOT_CHECKSUM_SECTORS + 1) * sb->sector_size)) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < BOOT_CHECKSUM_SECTORS; i++) {
+		if ((cache = get_sector_cache(sb, i)) == NULL) {
+			ret = -EIO;
+			goto out;
+		}
+		memcpy(region + i * sb->sector_size, cache->data, sb->sector_size);
+	}
+
+	sum = (uint32_t *)(region + BOOT_CHECKSUM_SECTORS * sb->sector_size);
+	sum[0] = cpu_to_le32(calc_boot_checksum(region, sb->sector_size));
+	for (i = 1; i < sb->sector_size / sizeof(uint32_t); i++)
+		sum[i] = sum[0];
+
+	if ((cache = get_sector_cache(sb, BOOT_CHECKSUM_SECTORS)) == NULL) {
+		ret = -EIO;
+		goto out;
+	}
+	if (memcmp(cache->data, sum, sb->sector_size)) {
+		memcpy(cache->data, sum, sb->sector_size);
+		mark_cache_dirty(cache, 0, sb->sector_size);
+	}
+	pr_debug("Boot Checksum: %08x\n", le32_to_cpu(sum[0]));
+
+	if (!backup)
+		goto out;
+
+	/* Backup Boot region follows Main Boot region */
+	for (i = 0; i <= BOOT_CHECKSUM_SECTORS; i++) {
+		if ((cache = get_sector_cache(sb, BOOT_CHECKSUM_SECTORS + 1 + i)) == NULL) {
+			ret = -EIO;
+			goto out;
+		}
+		if (memcmp(cache->data, region + i * sb->sector_size, sb->sector_size)) {
+			memcpy(cache->data, region + i * sb->sector_size, sb->sector_size);
+			mark_cache_dirty(cache, 0, sb->sector_size);
+		}
+	}
+
+out:
+	free(region);
+	return ret;
+}
+
+/**
+ * @brief Calculate SetChecksum of entry set
+ * @param [in] d        the first dentry in entry set
+ * @param [in] dentries the number of dentries in entry set
+ *
+ * @return SetChecksum
+ */
+uint16_t calc_set_checksum(const struct exfat_dentry *d, size_t dentries)
+{
+	const uint8_t *data = (const uint8_t *)d;
+	size_t field = offsetof(struct exfat_dentry, dentry.file.checksum);
+	uint16_t checksum = 0;
+
+	/* SetChecksum field itself is skipped */
+	checksum = add_checksum16(checksum, data, field);
+	checksum = add_checksum16(checksum, data + field + sizeof(__le16),
+			dentries * sizeof(struct exfat_dentry) - field - sizeof(__le16));
+
+	return checksum;
+}
+
+/**
+ * @brief Calculate NameHash of file name
+ * @param [in] name   FileName (UTF-16)
+ * @param [in] len    NameLength
+ * @param [in] upcase Up-case table indexed by character (NULL: ASCII only)
+ *
+ * @return NameHash
+ *
+ * @note Without @upcase, only 'a' to 'z' are up-cased, which is same as
+ *       the minimum Up-case table.
+ */
+uint16_t calc_name_hash(const uint16_t *name, size_t len, const uint16_t *upcase)
+{
+	size_t i;
+	uint16_t c, hash = 0;
+
+	for (i = 0; i < len; i++) {
+		c = name[i];
+		if (upcase)
+			c = upcase[c];
+		else if (c - 'a' < 26U)
+			c -= 'a' - 'A';
+		hash = (uint16_t)((hash >> 1) | (hash << 15)) + (c & 0xFF);
+		hash = (uint16_t)((hash >> 1) | (hash << 15)) + (c >> 8);
+	}
+
+	return hash;
+}
+
+/**
+ * @brief Calculate TableChecksum of Up-case table
+ * @param [in] data Up-case table on disk
+ * @param [in] len  bytes of @data
+ *
+ * @return TableChecksum
+ */
+uint32_t calc_table_checksum(const void *data, size_t len)
+{
+	return add_checksum32(0, data, len);
+}
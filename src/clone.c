@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+
+/**
+ * buffer size for copying image by read/write
+ */
+#define CLONE_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * @brief Copy range of file by read/write
+ * @param [in] src    source file
+ * @param [in] dst    destination file
+ * @param [in] offset start byte offset
+ * @param [in] len    byte length
+ * @param [in] align  alignment required by @src (0: none)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int copy_range_rw(int src, int dst, off_t offset, off_t len, size_t align)
+{
+	int ret = 0;
+	ssize_t n;
+	char *buf;
+
+	if ((errno = posix_memalign((void **)&buf, MAX(align, sizeof(void *)), CLONE_BUFFER_SIZE)) != 0)
+		return -ENOMEM;
+
+	while (len > 0) {
+		if ((n = pread_direct(src, buf, MIN(len, CLONE_BUFFER_SIZE), offset, align)) <= 0) {
+			ret = n < 0 ? -errno : -EIO;
+			pr_err("read: %s\n", strerror(-ret));
+			break;
+		}
+		if (pwrite(dst, buf, n, offset) != n) {
+			ret = -errno;
+			pr_err("write: %s\n", strerror(errno));
+			break;
+		}
+		offset += n;
+		len -= n;
+	}
+
+	free(buf);
+	return ret;
+}
+
+/**
+ * @brief Copy range of file
+ * @param [in] src    source file
+ * @param [in] dst    destination file
+ * @param [in] offset start byte offset
+ * @param [in] len    byte length
+ * @param [in] align  alignment required by @src (0: none)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int copy_range(int src, int dst, off_t offset, off_t len, size_t align)
+{
+	ssize_t n;
+	loff_t in = offset, out = offset;
+
+	while (len > 0) {
+		if ((n = copy_file_range(src, &in, dst, &out, len, 0)) <= 0) {
+			if (n == 0)
+				return -EIO;
+			/* copy_file_range isn't supported in this combination */
+			if (errno == EXDEV || errno == ENOSYS ||
+					errno == EINVAL || errno == EOPNOTSUPP)
+				return copy_range_rw(src, dst, in, len, align);
+			pr_err("copy_file_range: %s\n", strerror(errno));
+			return -errno;
+		}
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Copy only data extents of file
+ * @param [in] src   source file
+ * @param [in] dst   destination file (already truncated to @size)
+ * @param [in] size  file size
+ * @param [in] align alignment required by @src (0: none)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Holes are left as holes in @dst, so that copy time and disk usage
+ *       depend on allocated data rather than volume size.
+ */
+static int copy_sparse(int src, int dst, off_t size, size_t align)
+{
+	int ret;
+	off_t data, hole = 0;
+
+	while (hole < size) {
+		if ((data = lseek(src, hole, SEEK_DATA)) < 0) {
+			/* no more data after this offset */
+			if (errno == ENXIO)
+				return 0;
+			/* SEEK_DATA isn't supported, copy whole range */
+			if (errno == EINVAL || errno == EOPNOTSUPP)
+				return copy_range(src, dst, hole, size - hole, align);
+			pr_err("lseek: %s\n", strerror(errno));
+			return -errno;
+		}
+		if ((hole = lseek(src, data, SEEK_HOLE)) < 0) {
+			pr_err("lseek: %s\n", strerror(errno));
+			return -errno;
+		}
+		hole = MIN(hole, size);
+		pr_debug("Copy data extent %lx - %lx\n", data, hole);
+		if ((ret = copy_range(src, dst, data, hole - data, align)) != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Clone image into another file
+ * @param [in] src   source image
+ * @param [in] dst   destination file (opened for writing)
+ * @param [in] size  image size
+ * @param [in] align alignment required by @src with O_DIRECT (0: none)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Try reflink (FICLONE) first so that the copy shares all extents
+ *       with @src, and fall back to copying data extents only.
+ */
+int clone_image(int src, int dst, off_t size, size_t align)
+{
+	if (ioctl(dst, FICLONE, src) == 0)
+		return 0;
+	pr_debug("FICLONE: %s\n", strerror(errno));
+
+	if (ftruncate(dst, size) < 0) {
+		pr_err("truncate: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return copy_sparse(src, dst, size, align);
+}
@@ -28,12 +28,29 @@ int get_sector(struct super_block *sb, void *data, off_t index, size_t count)
 
 	pr_debug("Get: Sector from 0x%lx to 0x%lx\n",
 			offset, offset + (count * sb->sector_size) - 1);
+	stat_add(sb, read_calls, 1);
+	stat_add(sb, read_bytes, sb->sector_size * count);
 
-	if ((pread(sb->fd, data, sb->sector_size * count, offset)) < 0) {
+	if (sb->map) {
+		void *src = map_sector(sb, index, count);
+
+		if (!src) {
+			pr_err("Internal Error: invalid sector range %lu ~ %lu.\n", index, index + count - 1);
+			return -EINVAL;
+		}
+		if (src != data)
+			memcpy(data, src, sb->sector_size * count);
+		return 0;
+	}
+
+	if ((pread_direct(sb->fd, data, sb->sector_size * count, offset, sb->dio_align)) < 0) {
 		pr_err("read: %s\n", strerror(errno));
 		return -errno;
 	}
 
+	if (sb->patch)
+		patch_read(sb->patch, data, offset, sb->sector_size * count);
+
 	return 0;
 }
 
@@ -56,8 +73,25 @@ int set_sector(struct super_block *sb, void *data, off_t index, size_t count)
 
 	pr_debug("Set: Sector from 0x%lx to 0x%lx\n",
 			offset, offset + (count * sb->sector_size) - 1);
+	stat_add(sb, write_calls, 1);
+	stat_add(sb, write_bytes, sb->sector_size * count);
+
+	if (sb->patch)
+		return patch_write(sb->patch, data, offset, sb->sector_size * count);
+
+	if (sb->map) {
+		void *dst = map_sector(sb, index, count);
+
+		if (!dst) {
+			pr_err("Internal Error: invalid sector range %lu ~ %lu.\n", index, index + count - 1);
+			return -EINVAL;
+		}
+		if (dst != data)
+			memcpy(dst, data, sb->sector_size * count);
+		return 0;
+	}
 
-	if ((pwrite(sb->fd, data, sb->sector_size * count, offset)) < 0) {
+	if ((pwrite_direct(sb->fd, data, sb->sector_size * count, offset, sb->dio_align)) < 0) {
 		pr_err("write: %s\n", strerror(errno));
 		return -errno;
 	}
@@ -127,16 +161,16 @@ out:
 int get_cluster(struct super_block *sb, void *data, off_t index, size_t count)
 {
 	size_t clu_per_sec = sb->cluster_size / sb->sector_size;
-	off_t heap_start = sb->heap_offset * sb->sector_size;
+	off_t heap_start = sb->heap_offset;
 
-	if (index < EXFAT_FIRST_CLUSTER || index + count > sb->cluster_count) {
+	if (index < EXFAT_FIRST_CLUSTER || index + count > sb->cluster_count + EXFAT_FIRST_CLUSTER) {
 		pr_err("Internal Error: invalid cluster range %lu ~ %lu.\n", index, index + count - 1);
 		return -EINVAL;
 	}
 
 	return get_sector(sb,
 			data,
-			heap_start + ((index - EXFAT_FIRST_CLUSTER) * sb->cluster_size),
+			heap_start + ((index - EXFAT_FIRST_CLUSTER) * clu_per_sec),
 			clu_per_sec * count);
 }
 
@@ -156,16 +190,16 @@ int get_cluster(struct super_block *sb, void *data, off_t index, size_t count)
 int set_cluster(struct super_block *sb, void *data, off_t index, size_t count)
 {
 	size_t clu_per_sec = sb->cluster_size / sb->sector_size;
-	off_t heap_start = sb->heap_offset * sb->sector_size;
+	off_t heap_start = sb->heap_offset;
 
-	if (index < EXFAT_FIRST_CLUSTER || index + count > sb->cluster_count) {
+	if (index < EXFAT_FIRST_CLUSTER || index + count > sb->cluster_count + EXFAT_FIRST_CLUSTER) {
 		pr_err("Internal Error: invalid cluster range %lu ~ %lu.\n", index, index + count - 1);
 		return -EINVAL;
 	}
 
 	return set_sector(sb,
 			data,
-			heap_start + ((index - EXFAT_FIRST_CLUSTER) * sb->cluster_size),
+			heap_start + ((index - EXFAT_FIRST_CLUSTER) * clu_per_sec),
 			clu_per_sec * count);
 }
 
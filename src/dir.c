@@ -0,0 +1,582 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include <limits.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+#include "endian.h"
+#include "utf8.h"
+
+/**
+ * the minimum number of directory clusters read at once
+ */
+#define DIR_READAHEAD 64
+
+/**
+ * entry set being parsed (may span clusters)
+ */
+struct dentry_set {
+	struct inode *inode;   //!< inode for the entry set (NULL: no entry set)
+	uint8_t secondary;     //!< the number of remaining secondary entries
+	uint8_t name_len;      //!< NameLength in Stream dentry
+	uint8_t name_pos;      //!< the number of parsed characters
+	bool stream;           //!< whether Stream dentry is parsed
+	uint16_t name[MAX_NAME_LENGTH]; //!< FileName (UTF-16)
+};
+
+/**
+ * directory tree scanner
+ */
+struct dir_scanner {
+	struct inode **queue;  //!< directories to be scanned
+	size_t head;           //!< next directory in @queue
+	size_t tail;           //!< end of @queue
+	size_t size;           //!< allocated size of @queue
+	struct list_head *last; //!< the last node in inode list
+	uint64_t clusters;     //!< the number of scanned directory clusters
+	uint64_t files;        //!< the number of found files/directories
+	struct chain_reader chain; //!< reader of directory clusters
+};
+
+/**
+ * @brief Queue directory to be scanned
+ * @param [in] scan  scanner
+ * @param [in] inode directory
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int push_dir(struct dir_scanner *scan, struct inode *inode)
+{
+	struct inode **tmp;
+
+	if (scan->tail == scan->size) {
+		/* reuse the space of scanned directories first */
+		if (scan->head) {
+			memmove(scan->queue, scan->queue + scan->head,
+					(scan->tail - scan->head) * sizeof(struct inode *));
+			scan->tail -= scan->head;
+			scan->head = 0;
+		} else {
+			scan->size = scan->size ? scan->size * 2 : 64;
+			if ((tmp = realloc(scan->queue, scan->size * sizeof(struct inode *))) == NULL)
+				return -ENOMEM;
+			scan->queue = tmp;
+		}
+	}
+	scan->queue[scan->tail++] = inode;
+
+	return 0;
+}
+
+/**
+ * @brief Finish entry set and register inode
+ * @param [in] sb   Filesystem metadata
+ * @param [in] scan scanner
+ * @param [in] set  parsed entry set
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int commit_dentry_set(struct super_block *sb, struct dir_scanner *scan,
+		struct dentry_set *set)
+{
+	int len;
+	unsigned char buf[MAX_NAME_LENGTH * UTF8_MAX_CHARSIZE + 1];
+	struct inode *inode = set->inode;
+
+	set->inode = NULL;
+
+	if (!set->stream || set->name_pos < set->name_len) {
+		pr_warn("Entry set is incomplete, skip it.\n");
+		free_inode(sb, inode);
+		return 0;
+	}
+
+	len = utf16s_to_utf8s(set->name, set->name_len, buf, sizeof(buf) - 1);
+	if (len < 0) {
+		pr_warn("FileName can't be converted, skip it.\n");
+		free_inode(sb, inode);
+		return 0;
+	}
+	if (set_inode_name(sb, inode, (char *)buf, len)) {
+		free_inode(sb, inode);
+		return -ENOMEM;
+	}
+	inode->name_len = set->name_len;
+
+	scan->last->next = &inode->list;
+	scan->last = &inode->list;
+	inode->p_inode->refcount++;
+	scan->files++;
+	pr_debug("Found %s (cluster: %08x, size: %lu)\n", inode->name, inode->clu, inode->len);
+
+	if ((inode->attr & ATTR_DIRECTORY) && inode->clu)
+		return push_dir(scan, inode);
+
+	return 0;
+}
+
+/**
+ * @brief Parse one directory entry
+ * @param [in] sb   Filesystem metadata
+ * @param [in] scan scanner
+ * @param [in] dir  directory containing @d
+ * @param [in] set  entry set being parsed
+ * @param [in] d    directory entry
+ *
+ * @retval 1 end of directory
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int parse_dentry(struct super_block *sb, struct dir_scanner *scan,
+		struct inode *dir, struct dentry_set *set, struct exfat_dentry *d)
+{
+	size_t len;
+	struct inode *inode;
+
+	if (set->inode) {
+		switch (d->type) {
+		case DENTRY_STREAM:
+			if (set->stream)
+				break;
+			inode = set->inode;
+			inode->flags = d->dentry.stream.flags;
+			inode->clu = le32_to_cpu(d->dentry.stream.start_clu);
+			inode->len = le64_to_cpu(d->dentry.stream.size);
+			set->name_len = d->dentry.stream.name_len;
+			set->stream = true;
+			goto next;
+		case DENTRY_NAME:
+			if (!set->stream)
+				break;
+			len = MIN(FILENAME_LEN, set->name_len - set->name_pos);
+			memcpy(set->name + set->name_pos, d->dentry.name.name, len * sizeof(uint16_t));
+			set->name_pos += len;
+			goto next;
+		default:
+			/* benign secondary dentry (e.g. Vendor Extension) */
+			if ((d->type & 0xC0) == 0xC0)
+				goto next;
+			break;
+		}
+		/* unexpected dentry, parse it as the next primary dentry */
+		pr_warn("Entry set of %08x is broken.\n", dir->clu);
+		set->secondary = 0;
+		free_inode(sb, set->inode);
+		set->inode = NULL;
+	}
+
+	switch (d->type) {
+	case DENTRY_UNUSED:
+		return 1;
+	case DENTRY_FILE:
+		if ((inode = alloc_inode(sb)) == NULL)
+			return -ENOMEM;
+		inode->attr = le16_to_cpu(d->dentry.file.attr);
+		inode->p_inode = dir;
+		/* timestamps are decoded on demand by get_inode_time() */
+		inode->ctime = (uint32_t)le16_to_cpu(d->dentry.file.create_date) << 16 |
+			le16_to_cpu(d->dentry.file.create_time);
+		inode->mtime = (uint32_t)le16_to_cpu(d->dentry.file.modify_date) << 16 |
+			le16_to_cpu(d->dentry.file.modify_time);
+		inode->atime = (uint32_t)le16_to_cpu(d->dentry.file.access_date) << 16 |
+			le16_to_cpu(d->dentry.file.access_time);
+		inode->ctime_cs = d->dentry.file.create_time_cs;
+		inode->mtime_cs = d->dentry.file.modify_time_cs;
+		set->inode = inode;
+		set->secondary = d->dentry.file.num_ext;
+		set->name_len = 0;
+		set->name_pos = 0;
+		set->stream = false;
+		if (!set->secondary)
+			return commit_dentry_set(sb, scan, set);
+		return 0;
+	default:
+		/* other primary or unused dentry doesn't describe file */
+		return 0;
+	}
+
+next:
+	if (--set->secondary == 0)
+		return commit_dentry_set(sb, scan, set);
+	return 0;
+}
+
+/**
+ * @brief Parse all directory entries in directory
+ * @param [in] sb   Filesystem metadata
+ * @param [in] scan scanner
+ * @param [in] dir  directory
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Directory clusters are read by @scan->chain.window clusters at once
+ *       (even across fragments), and entry sets are parsed while the
+ *       following clusters are read ahead.
+ */
+static int scan_dir(struct super_block *sb, struct dir_scanner *scan, struct inode *dir)
+{
+	int ret = 0;
+	size_t i, j, n;
+	size_t dentries = sb->cluster_size / sizeof(struct exfat_dentry);
+	struct cache *cache;
+	struct dentry_set *set;
+
+	if ((set = calloc(1, sizeof(struct dentry_set))) == NULL)
+		return -ENOMEM;
+
+	start_chain_reader(&scan->chain, dir);
+	while (true) {
+		/* clusters failed to be read are reported by get_cluster_cache() */
+		if (read_cluster_chain(sb, &scan->chain, &n) && !n)
+			pr_warn("Cluster chain of %s is broken.\n", dir->name);
+		if (!n)
+			goto out;
+
+		/* a directory points to its ancestor, or chain is looped */
+		if ((scan->clusters += n) > sb->cluster_count) {
+			pr_err("Directory tree is looped.\n");
+			ret = -EINVAL;
+			goto out;
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((cache = get_cluster_cache(sb, scan->chain.index[i])) == NULL) {
+				ret = -EIO;
+				goto out;
+			}
+			for (j = 0; j < dentries; j++) {
+				ret = parse_dentry(sb, scan, dir, set,
+						(struct exfat_dentry *)cache->data + j);
+				if (ret)
+					goto out;
+			}
+		}
+	}
+
+out:
+	if (set->inode) {
+		pr_warn("Entry set of %08x is incomplete.\n", dir->clu);
+		free_inode(sb, set->inode);
+	}
+	free(set);
+	/* end of directory */
+	return ret > 0 ? 0 : ret;
+}
+
+/**
+ * @brief Read whole directory tree into inode list
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Directories are scanned in breadth-first order, so that parent
+ *       directory always precedes its children in @sb->inodes.
+ */
+int read_dir_tree(struct super_block *sb)
+{
+	int ret = 0;
+	struct dir_scanner scan = {0};
+
+	if (!sb->inodes)
+		return -EINVAL;
+
+	/* large enough to fill one request, but small enough to stay in cache */
+	scan.chain.window = MAX(DIR_READAHEAD, sb->max_io / sb->cluster_size);
+	if (sb->cache_limit)
+		scan.chain.window = MAX(MIN(scan.chain.window, sb->cache_limit / sb->cluster_size), 1);
+	scan.chain.ahead = ROUNDUP(sb->readahead, sb->cluster_size);
+	if ((scan.chain.index = malloc((scan.chain.window + scan.chain.ahead) *
+					sizeof(uint32_t))) == NULL)
+		return -ENOMEM;
+
+	scan.last = list_last(sb->inodes);
+	if ((ret = push_dir(&scan, sb->inodes->data)) != 0)
+		goto out;
+
+	while (scan.head < scan.tail) {
+		if ((ret = scan_dir(sb, &scan, scan.queue[scan.head++])) != 0)
+			break;
+	}
+
+	pr_info("Found %lu files in %lu directory clusters\n", scan.files, scan.clusters);
+out:
+	free(scan.chain.index);
+	free(scan.queue);
+
+	return ret;
+}
+
+/**
+ * @brief Get whole directory tree (read it at first use)
+ * @param [in] sb Filesystem metadata
+ *
+ * @return inode list whose first inode is root directory (or NULL)
+ *
+ * @note Boot sector patterns don't need directory tree, so that it isn't
+ *       read at mount. Broken directory tree has inodes read before it.
+ */
+struct list_head *get_dir_tree(struct super_block *sb)
+{
+	struct inode *root;
+
+	if (sb->tree_loaded)
+		return sb->inodes;
+
+	/* variant doesn't take over inodes of the original image */
+	if (!sb->inodes) {
+		if ((root = alloc_root_inode(sb)) == NULL)
+			return NULL;
+		sb->inodes = &root->list;
+	}
+
+	sb->tree_loaded = true;
+	if (read_dir_tree(sb))
+		pr_warn("Failed to load directory tree\n");
+
+	return sb->inodes;
+}
+
+/**
+ * @brief Write back modified entry set into cluster caches
+ * @param [in] sb  Filesystem metadata
+ * @param [in] set entry set
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int write_entry_set(struct super_block *sb, struct entry_set *set)
+{
+	size_t i;
+	struct cache *cache;
+	struct exfat_dentry *d;
+
+	for (i = 0; i < set->count; i++) {
+		if ((cache = get_cluster_cache(sb, set->clu[i])) == NULL)
+			return -EIO;
+		d = (struct exfat_dentry *)cache->data + set->pos[i];
+		if (!memcmp(d, &set->d[i], sizeof(struct exfat_dentry)))
+			continue;
+		*d = set->d[i];
+		mark_cache_dirty(cache, set->pos[i] * sizeof(struct exfat_dentry),
+				sizeof(struct exfat_dentry));
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Iterate entry sets in directory
+ * @param [in] sb   Filesystem metadata
+ * @param [in] dir  directory
+ * @param [in] func called for each entry set
+ *                  (1: @set is modified, 0: continue, Negative: stop)
+ * @param [in] arg  argument for @func
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Entry set is copied into one buffer even if it spans clusters,
+ *       and written back into cluster caches if @func modified it.
+ *       Entry set which lacks secondary dentries is skipped.
+ */
+int iterate_entry_set(struct super_block *sb, struct inode *dir,
+		int (*func)(struct super_block *, struct entry_set *, void *), void *arg)
+{
+	int ret = 0;
+	size_t i, j, n, need = 0;
+	size_t dentries = sb->cluster_size / sizeof(struct exfat_dentry);
+	uint64_t clusters = 0;
+	struct chain_reader chain = {0};
+	struct entry_set *set;
+	struct exfat_dentry *d;
+	struct cache *cache;
+
+	chain.window = DIR_READAHEAD;
+	chain.ahead = ROUNDUP(sb->readahead, sb->cluster_size);
+	if ((set = malloc(sizeof(struct entry_set))) == NULL ||
+			(chain.index = malloc((chain.window + chain.ahead) * sizeof(uint32_t))) == NULL) {
+		free(set);
+		return -ENOMEM;
+	}
+	set->dir = dir;
+	set->count = 0;
+
+	start_chain_reader(&chain, dir);
+	while (true) {
+		if (read_cluster_chain(sb, &chain, &n) && !n)
+			pr_warn("Cluster chain of %s is broken.\n", dir->name);
+		if (!n)
+			break;
+		/* chain is looped */
+		if ((clusters += n) > sb->cluster_count) {
+			ret = -EINVAL;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((cache = get_cluster_cache(sb, chain.index[i])) == NULL) {
+				ret = -EIO;
+				goto out;
+			}
+			for (j = 0; j < dentries; j++) {
+				d = (struct exfat_dentry *)cache->data + j;
+				/* primary dentry interrupts entry set */
+				if (set->count && !(d->type & 0x40)) {
+					pr_warn("Entry set of %08x is incomplete.\n", set->clu[0]);
+					set->count = 0;
+				}
+				if (!set->count) {
+					if (d->type == DENTRY_UNUSED)
+						goto out;
+					if (d->type != DENTRY_FILE)
+						continue;
+					need = 1 + d->dentry.file.num_ext;
+				}
+
+				set->clu[set->count] = chain.index[i];
+				set->pos[set->count] = j;
+				set->d[set->count++] = *d;
+				if (set->count < need)
+					continue;
+
+				set->count = need;
+				if ((ret = func(sb, set, arg)) < 0)
+					goto out;
+				if (ret > 0) {
+					if ((ret = write_entry_set(sb, set)) < 0)
+						goto out;
+					/* current cluster may be evicted by writing back */
+					if ((cache = get_cluster_cache(sb, chain.index[i])) == NULL) {
+						ret = -EIO;
+						goto out;
+					}
+				}
+				set->count = 0;
+			}
+		}
+	}
+
+out:
+	free(chain.index);
+	free(set);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * @brief Verify (or recalculate) SetChecksum and NameHash of entry set
+ * @param [in] set    entry set
+ * @param [in] upcase Up-case table indexed by character (NULL: ASCII only)
+ * @param [in] fix    rewrite mismatched fields in @set
+ *
+ * @return mismatched fields (ENTRY_SET_BAD_CHECKSUM, ENTRY_SET_BAD_HASH)
+ *
+ * @note NameHash is checked only if Stream dentry and whole FileName are
+ *       in entry set.
+ */
+int check_entry_set(struct entry_set *set, const uint16_t *upcase, bool fix)
+{
+	int bad = 0;
+	size_t i, j, len = 0, pos = 0;
+	uint16_t hash, name[MAX_NAME_LENGTH];
+	struct exfat_dentry *stream = &set->d[1];
+
+	if (set->count >= 2 && stream->type == DENTRY_STREAM) {
+		len = stream->dentry.stream.name_len;
+		for (i = 2; i < set->count && pos < len; i++) {
+			if (set->d[i].type != DENTRY_NAME)
+				continue;
+			for (j = 0; j < FILENAME_LEN && pos < len; j++)
+				name[pos++] = le16_to_cpu(set->d[i].dentry.name.name[j]);
+		}
+	}
+
+	if (len && pos == len) {
+		hash = calc_name_hash(name, len, upcase);
+		if (le16_to_cpu(stream->dentry.stream.name_hash) != hash) {
+			bad |= ENTRY_SET_BAD_HASH;
+			if (fix)
+				stream->dentry.stream.name_hash = cpu_to_le16(hash);
+		}
+	}
+
+	hash = calc_set_checksum(set->d, set->count);
+	if (le16_to_cpu(set->d[0].dentry.file.checksum) != hash) {
+		bad |= ENTRY_SET_BAD_CHECKSUM;
+		if (fix)
+			set->d[0].dentry.file.checksum = cpu_to_le16(hash);
+	}
+
+	return bad;
+}
+
+/**
+ * arguments of check_all_entry_sets()
+ */
+struct entry_set_check {
+	const uint16_t *upcase;  //!< Up-case table
+	bool fix;                //!< rewrite mismatched fields
+	uint64_t bad;            //!< the number of mismatched entry sets
+};
+
+/**
+ * @brief Verify one entry set for check_all_entry_sets()
+ * @param [in] sb  Filesystem metadata
+ * @param [in] set entry set
+ * @param [in] arg struct entry_set_check
+ *
+ * @retval 1 entry set is fixed
+ * @retval 0 entry set is valid (or not fixed)
+ */
+static int check_entry_set_func(struct super_block *sb, struct entry_set *set, void *arg)
+{
+	struct entry_set_check *check = arg;
+
+	if (!check_entry_set(set, check->upcase, check->fix))
+		return 0;
+
+	check->bad++;
+	pr_debug("Entry set at %08x:%u is inconsistent.\n", set->clu[0], set->pos[0]);
+	return check->fix;
+}
+
+/**
+ * @brief Verify (or recalculate) all entry sets in directory tree
+ * @param [in]  sb  Filesystem metadata
+ * @param [in]  fix rewrite mismatched SetChecksum and NameHash
+ * @param [out] bad the number of mismatched entry sets (may be NULL)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Directories are taken from get_dir_tree(), and NameHash is
+ *       calculated by Up-case table loaded by get_upcase_table().
+ */
+int check_all_entry_sets(struct super_block *sb, bool fix, uint64_t *bad)
+{
+	int ret = 0;
+	struct list_head *tree, *node;
+	struct inode *inode;
+	struct entry_set_check check = {get_upcase_table(sb), fix, 0};
+
+	if ((tree = get_dir_tree(sb)) == NULL)
+		return -ENOMEM;
+
+	for (node = tree; node && !ret; node = node->next) {
+		inode = node->data;
+		/* the first inode is root directory */
+		if ((node != tree && !(inode->attr & ATTR_DIRECTORY)) || !inode->clu)
+			continue;
+		ret = iterate_entry_set(sb, inode, check_entry_set_func, &check);
+	}
+
+	if (bad)
+		*bad = check.bad;
+	return ret;
+}
+
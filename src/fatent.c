@@ -2,28 +2,39 @@
 /*
  *  Copyright (C) 2022 LeavaTail
  */
+#include <limits.h>
+
 #include "exfat.h"
 #include "breakexfat.h"
 #include "endian.h"
 
 /**
- * Active FAT(1st or 2nd)
+ * the number of FAT sectors read at once (readahead window)
  */
-static int active_fat = 0;
+#define FAT_PAGE_SECTORS 8
 
 /**
  * @brief Update active FAT
  * @param [in] sb    Filesystem metadata
  * @param [in] index The number of FATs
  *
- * @return success or failed
+ * @retval 0 success
+ * @retval Negative failed (FAT of old index is kept in memory)
  */
 int update_active_fat(struct super_block *sb, int index)
 {
+	int ret;
+
 	switch (index) {
 	case 0:
 	case 1:
-		active_fat = index;
+		if (sb->fat && sb->active_fat != index) {
+			/* modified entries aren't lost, if they can't be written back */
+			if ((ret = flush_fat_table(sb)) != 0)
+				return ret;
+			free_fat_table(sb);
+		}
+		sb->active_fat = index;
 		break;
 	default:
 		pr_warn("Invalid index of active FAT (%d)\n", index);
@@ -32,6 +43,333 @@ int update_active_fat(struct super_block *sb, int index)
 	return 0;
 }
 
+/**
+ * @brief Build extents of allocated clusters
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @attention All pages of FAT must be loaded.
+ */
+static int build_fat_extent(struct super_block *sb)
+{
+	uint32_t clu, start;
+	size_t nr = 0, size;
+	struct fat_table *fat = sb->fat;
+	struct fat_extent *ext, *tmp;
+
+	size = 64;
+	if ((ext = malloc(size * sizeof(struct fat_extent))) == NULL)
+		return -ENOMEM;
+
+	for (clu = EXFAT_FIRST_CLUSTER; clu < fat->count; clu++) {
+		/* free cluster doesn't belong to any chain */
+		if (!fat->entry[clu])
+			continue;
+
+		start = clu;
+		while (clu + 1 < fat->count && fat->entry[clu] == clu + 1)
+			clu++;
+
+		if (nr == size) {
+			size *= 2;
+			if ((tmp = realloc(ext, size * sizeof(struct fat_extent))) == NULL) {
+				free(ext);
+				return -ENOMEM;
+			}
+			ext = tmp;
+		}
+		ext[nr].start = start;
+		ext[nr].len = clu - start + 1;
+		ext[nr].next = fat->entry[clu];
+		nr++;
+	}
+
+	free(fat->ext);
+	fat->ext = ext;
+	fat->nr_ext = nr;
+	fat->stale = false;
+	pr_debug("FAT has %lu extents in %u entries\n", nr, fat->count);
+
+	return 0;
+}
+
+/**
+ * @brief Search extent including cluster
+ * @param [in] sb  Filesystem metadata
+ * @param [in] clu index of the cluster
+ *
+ * @return extent (or NULL)
+ *
+ * @attention All pages of FAT must be loaded.
+ */
+static struct fat_extent *search_fat_extent(struct super_block *sb, uint32_t clu)
+{
+	size_t low = 0, high, mid;
+	struct fat_table *fat = sb->fat;
+
+	if (fat->stale && build_fat_extent(sb))
+		return NULL;
+
+	high = fat->nr_ext;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (fat->ext[mid].start <= clu)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (!low || clu >= fat->ext[low - 1].start + fat->ext[low - 1].len)
+		return NULL;
+
+	return &fat->ext[low - 1];
+}
+
+/**
+ * @brief Allocate in-memory FAT without reading it
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Entries are read by FAT_PAGE_SECTORS sectors when they are used
+ *       first. The entry array is allocated by calloc(), so that pages
+ *       which are never read don't consume memory.
+ */
+static int init_fat_table(struct super_block *sb)
+{
+	size_t entry_per_sector = sb->sector_size / sizeof(uint32_t);
+	size_t sectors;
+	struct fat_table *fat;
+
+	if ((fat = calloc(1, sizeof(struct fat_table))) == NULL)
+		return -ENOMEM;
+
+	fat->count = sb->cluster_count + EXFAT_FIRST_CLUSTER;
+	sectors = ROUNDUP((size_t)fat->count, entry_per_sector);
+	fat->nr_pages = ROUNDUP(sectors, FAT_PAGE_SECTORS);
+	fat->entry = calloc(fat->nr_pages * FAT_PAGE_SECTORS, sb->sector_size);
+	fat->dirty = calloc(ROUNDUP(sectors, CHAR_BIT), 1);
+	fat->loaded = calloc(ROUNDUP(fat->nr_pages, CHAR_BIT), 1);
+	if (!fat->entry || !fat->dirty || !fat->loaded) {
+		free(fat->loaded);
+		free(fat->dirty);
+		free(fat->entry);
+		free(fat);
+		return -ENOMEM;
+	}
+	fat->stale = true;
+
+	sb->fat = fat;
+	sb->fat_shared = false;
+
+	return 0;
+}
+
+/**
+ * @brief Read pages of FAT
+ * @param [in] sb    Filesystem metadata
+ * @param [in] page  index of the first page
+ * @param [in] count the number of pages
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Entries out of FAT region (broken FatLength) are treated as free.
+ */
+static int read_fat_pages(struct super_block *sb, size_t page, size_t count)
+{
+	int ret;
+	size_t i;
+	size_t entry_per_page = sb->sector_size / sizeof(uint32_t) * FAT_PAGE_SECTORS;
+	size_t sector = page * FAT_PAGE_SECTORS;
+	size_t sectors = count * FAT_PAGE_SECTORS;
+	uint32_t *entry;
+	struct fat_table *fat = sb->fat;
+
+	entry = fat->entry + page * entry_per_page;
+	if (sector < sb->fat_length) {
+		sectors = MIN(sectors, sb->fat_length - sector);
+		if ((ret = get_sector(sb, entry,
+				sb->fat_offset + sb->fat_length * sb->active_fat + sector, sectors)) != 0)
+			return ret;
+		for (i = 0; i < sectors * sb->sector_size / sizeof(uint32_t); i++)
+			entry[i] = le32_to_cpu(entry[i]);
+	}
+
+	for (i = page; i < page + count; i++)
+		fat->loaded[i / CHAR_BIT] |= BIT(i % CHAR_BIT);
+	fat->nr_loaded += count;
+
+	return 0;
+}
+
+/**
+ * @brief Make FAT entry available
+ * @param [in] sb  Filesystem metadata
+ * @param [in] clu index of the cluster
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static inline int fault_fat_entry(struct super_block *sb, uint32_t clu)
+{
+	size_t page;
+	struct fat_table *fat;
+
+	if (!sb->fat && init_fat_table(sb))
+		return -ENOMEM;
+
+	fat = sb->fat;
+	page = clu / (sb->sector_size / sizeof(uint32_t) * FAT_PAGE_SECTORS);
+	if (fat->loaded[page / CHAR_BIT] & BIT(page % CHAR_BIT))
+		return 0;
+
+	return read_fat_pages(sb, page, 1);
+}
+
+/**
+ * @brief Load whole active FAT into memory
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Pages not loaded yet are read with as few requests as possible,
+ *       and then extents are built. After that, chain walks cost
+ *       O(log extents) per fragment.
+ */
+int load_fat_table(struct super_block *sb)
+{
+	int ret;
+	size_t page, end;
+	struct fat_table *fat;
+
+	if (!sb->fat && (ret = init_fat_table(sb)) != 0)
+		return ret;
+
+	fat = sb->fat;
+	for (page = 0; page < fat->nr_pages && fat->nr_loaded < fat->nr_pages; page = end) {
+		for (; page < fat->nr_pages; page++)
+			if (!(fat->loaded[page / CHAR_BIT] & BIT(page % CHAR_BIT)))
+				break;
+		for (end = page; end < fat->nr_pages; end++)
+			if (fat->loaded[end / CHAR_BIT] & BIT(end % CHAR_BIT))
+				break;
+		if (end > page && (ret = read_fat_pages(sb, page, end - page)) != 0)
+			return ret;
+	}
+
+	return fat->stale ? build_fat_extent(sb) : 0;
+}
+
+/**
+ * @brief Write modified FAT sectors back
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+int flush_fat_table(struct super_block *sb)
+{
+	int ret = 0;
+	size_t s, e, i;
+	size_t entry_per_sector = sb->sector_size / sizeof(uint32_t);
+	size_t sectors, max_sectors = MAX(sb->max_io / sb->sector_size, 1);
+	__le32 *buf;
+	struct fat_table *fat = sb->fat;
+
+	if (!fat || sb->fat_shared)
+		return 0;
+
+	sectors = MIN(ROUNDUP((size_t)fat->count, entry_per_sector), sb->fat_length);
+	max_sectors = MIN(max_sectors, sectors);
+	if ((buf = alloc_io_buffer(sb, max_sectors * sb->sector_size)) == NULL)
+		return -ENOMEM;
+
+	for (s = 0; s < sectors; s = e) {
+		if (!(fat->dirty[s / CHAR_BIT] & BIT(s % CHAR_BIT))) {
+			e = s + 1;
+			continue;
+		}
+		/* write consecutive modified sectors at once */
+		for (e = s; e < sectors && e - s < max_sectors &&
+				(fat->dirty[e / CHAR_BIT] & BIT(e % CHAR_BIT)); e++)
+			;
+		for (i = 0; i < (e - s) * entry_per_sector; i++)
+			buf[i] = cpu_to_le32(fat->entry[s * entry_per_sector + i]);
+		if ((ret = set_sector(sb, buf,
+				sb->fat_offset + sb->fat_length * sb->active_fat + s, e - s)) != 0)
+			break;
+		for (i = s; i < e; i++)
+			fat->dirty[i / CHAR_BIT] &= ~BIT(i % CHAR_BIT);
+	}
+
+	free(buf);
+	return ret;
+}
+
+/**
+ * @brief Release in-memory FAT
+ * @param [in] sb Filesystem metadata
+ *
+ * @note Modified entries are discarded, call flush_fat_table() before.
+ */
+void free_fat_table(struct super_block *sb)
+{
+	struct fat_table *fat = sb->fat;
+
+	sb->fat = NULL;
+	if (!fat || sb->fat_shared)
+		return;
+
+	free(fat->ext);
+	free(fat->loaded);
+	free(fat->dirty);
+	free(fat->entry);
+	free(fat);
+}
+
+/**
+ * @brief Check whether FAT can be shared with batch variants
+ * @param [in] sb Filesystem metadata
+ *
+ * @return true if all pages are loaded (FAT is never changed by reading)
+ */
+bool is_fat_table_loaded(struct super_block *sb)
+{
+	return sb->fat && sb->fat->nr_loaded == sb->fat->nr_pages;
+}
+
+/**
+ * @brief Take own copy of FAT borrowed from the original image
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int unshare_fat_table(struct super_block *sb)
+{
+	struct fat_table *base = sb->fat;
+
+	sb->fat = NULL;
+	if (init_fat_table(sb)) {
+		sb->fat = base;
+		return -ENOMEM;
+	}
+
+	memcpy(sb->fat->entry, base->entry,
+			base->nr_pages * FAT_PAGE_SECTORS * sb->sector_size);
+	memset(sb->fat->loaded, 0xFF, ROUNDUP(base->nr_pages, CHAR_BIT));
+	sb->fat->nr_loaded = base->nr_pages;
+	/* extents are rebuilt on demand after modification */
+	sb->fat->stale = true;
+
+	return 0;
+}
+
 /**
  * @brief  Get FAT entry
  * @param [in]  sb    Filesystem metadata
@@ -43,23 +381,15 @@ int update_active_fat(struct super_block *sb, int index)
  */
 int get_fat_entry(struct super_block *sb, uint32_t clu, uint32_t *entry)
 {
-	size_t entry_per_sector = sb->sector_size / sizeof(uint32_t);
-	uint32_t index = (clu) % entry_per_sector;
-	uint32_t offset = sb->fat_offset;
-	__le32 *fat;
-	struct cache *cache;
-
-	offset += sb->fat_length * active_fat;
-
-	cache = get_sector_cache(sb, offset);
-	fat = cache->data;
-
-	if (validate_cluster(sb, clu))  {
+	if (validate_cluster(sb, clu) || clu == EXFAT_LASTCLUSTER)  {
 		pr_err("Internal Error: Cluster %08x is invalid.\n", clu);
 		return -EINVAL;
 	}
 
-	*entry = cpu_to_le32(fat[index]);
+	if (fault_fat_entry(sb, clu))
+		return -EIO;
+
+	*entry = sb->fat->entry[clu];
 	pr_debug("Get: FAT[%08x] %08x\n", clu, *entry);
 
 	return 0;
@@ -77,24 +407,24 @@ int get_fat_entry(struct super_block *sb, uint32_t clu, uint32_t *entry)
 int set_fat_entry(struct super_block *sb, uint32_t clu, uint32_t entry)
 {
 	size_t entry_per_sector = sb->sector_size / sizeof(uint32_t);
-	uint32_t index = (clu) % entry_per_sector;
-	uint32_t offset = sb->fat_offset;
-	__le32 *fat;
-	struct cache *cache;
+	size_t sector = clu / entry_per_sector;
+	struct fat_table *fat;
 
-	offset += sb->fat_length * active_fat;
-
-	cache = get_sector_cache(sb, offset);
-	fat = cache->data;
-
-	if (validate_cluster(sb, clu) || (validate_cluster(sb, entry))) {
+	if (validate_cluster(sb, clu) || clu == EXFAT_LASTCLUSTER || validate_cluster(sb, entry)) {
 		pr_err("Internal Error: Cluster %08x,%08x is invalid.\n", clu, entry);
 		return -EINVAL;
 	}
 
-	fat[index] = cpu_to_le32(entry);
-	cache->dirty = true;
-	pr_debug("Set: FAT[%08x] %08x\n", clu, fat[index]);
+	if (sb->fat_shared && unshare_fat_table(sb))
+		return -ENOMEM;
+	if (fault_fat_entry(sb, clu))
+		return -EIO;
+
+	fat = sb->fat;
+	fat->entry[clu] = entry;
+	fat->dirty[sector / CHAR_BIT] |= BIT(sector % CHAR_BIT);
+	fat->stale = true;
+	pr_debug("Set: FAT[%08x] %08x\n", clu, entry);
 
 	return 0;
 }
@@ -124,3 +454,130 @@ int get_next_cluster(struct super_block *sb, struct inode *inode, uint32_t clu,
 	return 0;
 }
 
+/**
+ * @brief  Get contiguous clusters in FAT chain by walking entries
+ * @param [in]  sb    Filesystem metadata
+ * @param [in]  clu   index of the cluster in the chain
+ * @param [out] len   the number of contiguous clusters from @clu
+ * @param [out] next  next cluster after the run
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int walk_cluster_run(struct super_block *sb, uint32_t clu, uint32_t *len, uint32_t *next)
+{
+	uint32_t pos = clu;
+	uint32_t entry;
+
+	if (get_fat_entry(sb, pos, &entry))
+		return -EIO;
+	if (!entry) {
+		pr_err("Cluster %08x isn't allocated in FAT.\n", clu);
+		return -EINVAL;
+	}
+
+	while (entry == pos + 1 && entry < sb->fat->count) {
+		pos++;
+		if (fault_fat_entry(sb, pos))
+			return -EIO;
+		entry = sb->fat->entry[pos];
+	}
+
+	*len = pos - clu + 1;
+	*next = entry;
+
+	return 0;
+}
+
+/**
+ * @brief  Get contiguous clusters in FAT chain
+ * @param [in]  sb    Filesystem metadata
+ * @param [in]  inode target file/directory
+ * @param [in]  clu   index of the cluster in the chain
+ * @param [out] len   the number of contiguous clusters from @clu
+ * @param [out] next  next cluster after the run (EXFAT_LASTCLUSTER if end)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Without FAT chain, the rest of the file is returned as one run.
+ */
+int get_cluster_run(struct super_block *sb, struct inode *inode, uint32_t clu,
+		uint32_t *len, uint32_t *next)
+{
+	uint64_t rest;
+	struct fat_extent *ext;
+
+	if (validate_cluster(sb, clu) || clu == EXFAT_LASTCLUSTER) {
+		pr_err("Internal Error: Cluster %08x is invalid.\n", clu);
+		return -EINVAL;
+	}
+
+	if (inode->flags & NOFATCHAIN) {
+		rest = ROUNDUP(inode->len, sb->cluster_size);
+		if (clu < inode->clu || clu - inode->clu >= rest) {
+			pr_err("Internal Error: Cluster %08x is out of file.\n", clu);
+			return -EINVAL;
+		}
+		*len = MIN(rest - (clu - inode->clu), sb->cluster_count + EXFAT_FIRST_CLUSTER - clu);
+		*next = EXFAT_LASTCLUSTER;
+		return 0;
+	}
+
+	/* walk entries while only a part of FAT is loaded */
+	if (!is_fat_table_loaded(sb))
+		return walk_cluster_run(sb, clu, len, next);
+
+	if ((ext = search_fat_extent(sb, clu)) == NULL) {
+		pr_err("Cluster %08x isn't allocated in FAT.\n", clu);
+		return -EINVAL;
+	}
+
+	*len = ext->start + ext->len - clu;
+	*next = ext->next;
+
+	return 0;
+}
+
+/**
+ * @brief  Get N-th cluster of file
+ * @param [in]  sb    Filesystem metadata
+ * @param [in]  inode target file/directory
+ * @param [in]  n     index of the cluster in the file (0 origin)
+ * @param [out] clu   index of the cluster
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Whole FAT is loaded at first, so that cost depends on the number
+ *       of fragments, not on @n.
+ */
+int get_nth_cluster(struct super_block *sb, struct inode *inode, uint32_t n, uint32_t *clu)
+{
+	int ret;
+	uint32_t pos = inode->clu, len, next;
+	uint64_t walked = 0;
+
+	if (!(inode->flags & NOFATCHAIN) && (ret = load_fat_table(sb)) != 0)
+		return ret;
+
+	while (true) {
+		if ((ret = get_cluster_run(sb, inode, pos, &len, &next)) != 0)
+			return ret;
+		if (n < len) {
+			*clu = pos + n;
+			return 0;
+		}
+		n -= len;
+		walked += len;
+		if (next == EXFAT_LASTCLUSTER || validate_cluster(sb, next)) {
+			pr_err("Cluster chain ends before the cluster.\n");
+			return -EINVAL;
+		}
+		if (walked >= sb->cluster_count) {
+			pr_err("Cluster chain is looped.\n");
+			return -EINVAL;
+		}
+		pos = next;
+	}
+}
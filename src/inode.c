@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include "exfat.h"
+#include "breakexfat.h"
+#include "list.h"
+
+#define INODE_SLAB_NUM   1024         //!< the number of inodes in one slab
+#define NAME_CHUNK_SIZE  (64 * 1024)  //!< default size of name chunk
+
+/**
+ * fixed-size block of inodes
+ */
+struct inode_slab {
+	struct inode_slab *next;             //!< next slab
+	size_t used;                         //!< the number of handed out inodes
+	struct inode inode[INODE_SLAB_NUM];  //!< inodes
+};
+
+/**
+ * block of packed names
+ */
+struct name_chunk {
+	struct name_chunk *next;  //!< next chunk
+	size_t used;              //!< used bytes in @data
+	size_t size;              //!< size of @data
+	char data[];              //!< names (NUL-terminated)
+};
+
+/**
+ * storage for inodes and their names
+ */
+struct inode_arena {
+	struct inode_slab *slab;   //!< slabs (the newest first)
+	struct name_chunk *chunk;  //!< name chunks (the newest first)
+	struct inode *free;        //!< released inodes (linked by p_inode)
+};
+
+/**
+ * @brief Get inode arena (create it if necessary)
+ * @param [in] sb Filesystem metadata
+ *
+ * @return inode arena (or NULL)
+ */
+static struct inode_arena *get_inode_arena(struct super_block *sb)
+{
+	if (!sb->arena)
+		sb->arena = calloc(1, sizeof(struct inode_arena));
+
+	return sb->arena;
+}
+
+/**
+ * @brief allocate inode
+ * @param [in] sb Filesystem metadata
+ *
+ * @return allocated inode (or NULL)
+ *
+ * @note Inode is taken from slab, and released all at once by free_all_inodes().
+ */
+struct inode *alloc_inode(struct super_block *sb)
+{
+	struct inode *inode;
+	struct inode_slab *slab;
+	struct inode_arena *arena;
+
+	if ((arena = get_inode_arena(sb)) == NULL)
+		return NULL;
+
+	if ((inode = arena->free) != NULL) {
+		arena->free = inode->p_inode;
+	} else {
+		slab = arena->slab;
+		if (!slab || slab->used == INODE_SLAB_NUM) {
+			if ((slab = malloc(sizeof(struct inode_slab))) == NULL)
+				return NULL;
+			slab->next = arena->slab;
+			slab->used = 0;
+			arena->slab = slab;
+		}
+		inode = &slab->inode[slab->used++];
+	}
+
+	memset(inode, 0, sizeof(struct inode));
+	inode->refcount = 1;
+	/* list node is embedded, so that inode list needs no allocation */
+	inode->list.data = inode;
+
+	return inode;
+}
+
+/**
+ * @brief allocate inode of root directory
+ * @param [in] sb Filesystem metadata
+ *
+ * @return allocated inode (or NULL)
+ */
+struct inode *alloc_root_inode(struct super_block *sb)
+{
+	struct inode *root;
+
+	if ((root = alloc_inode(sb)) == NULL)
+		return NULL;
+
+	if (set_inode_name(sb, root, "/", strlen("/"))) {
+		free_inode(sb, root);
+		return NULL;
+	}
+	root->name_len = 1;
+	root->clu = sb->root_offset;
+	root->flags = 0;
+
+	return root;
+}
+
+/**
+ * @brief release inode
+ * @param [in] sb    Filesystem metadata
+ * @param [in] inode file/directory
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Inode is reused by next alloc_inode(), but its name isn't.
+ */
+int free_inode(struct super_block *sb, struct inode *inode)
+{
+	if (inode->refcount > 1) {
+		pr_warn("other inodes are used by this inode(%p)\n", inode);
+		return -EINVAL;
+	}
+
+	inode->name = NULL;
+	inode->p_inode = sb->arena->free;
+	sb->arena->free = inode;
+
+	return 0;
+}
+
+/**
+ * @brief Set name of inode
+ * @param [in] sb    Filesystem metadata
+ * @param [in] inode file/directory
+ * @param [in] name  name (UTF-8)
+ * @param [in] len   byte length of @name
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Names are packed into chunks with their actual length.
+ */
+int set_inode_name(struct super_block *sb, struct inode *inode, const char *name, size_t len)
+{
+	size_t size;
+	struct name_chunk *chunk;
+	struct inode_arena *arena;
+
+	if ((arena = get_inode_arena(sb)) == NULL)
+		return -ENOMEM;
+
+	chunk = arena->chunk;
+	if (!chunk || chunk->size - chunk->used < len + 1) {
+		size = MAX(NAME_CHUNK_SIZE, len + 1);
+		if ((chunk = malloc(sizeof(struct name_chunk) + size)) == NULL)
+			return -ENOMEM;
+		chunk->used = 0;
+		chunk->size = size;
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+	}
+
+	inode->name = chunk->data + chunk->used;
+	memcpy(inode->name, name, len);
+	inode->name[len] = '\0';
+	chunk->used += len + 1;
+
+	return 0;
+}
+
+/**
+ * @brief Release all inodes
+ * @param [in] sb Filesystem metadata
+ */
+void free_all_inodes(struct super_block *sb)
+{
+	struct inode_slab *slab;
+	struct name_chunk *chunk;
+	struct inode_arena *arena = sb->arena;
+
+	/* list nodes are released with their inodes */
+	sb->inodes = NULL;
+	sb->tree_loaded = false;
+
+	if (!arena)
+		return;
+
+	while ((slab = arena->slab) != NULL) {
+		arena->slab = slab->next;
+		free(slab);
+	}
+	while ((chunk = arena->chunk) != NULL) {
+		arena->chunk = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+	sb->arena = NULL;
+}
+
+/**
+ * @brief Get timestamp of inode
+ * @param [in]  inode file/directory
+ * @param [in]  type  INODE_CTIME, INODE_MTIME or INODE_ATIME
+ * @param [out] t     timestamp (local time)
+ *
+ * @retval 0 success
+ * @retval Negative failed (e.g. root directory has no timestamp)
+ *
+ * @note Timestamps are kept in raw format of File dentry, and decoded here.
+ */
+int get_inode_time(const struct inode *inode, int type, struct tm *t)
+{
+	uint32_t raw;
+	uint8_t cs = 0;
+
+	switch (type) {
+	case INODE_CTIME:
+		raw = inode->ctime;
+		cs = inode->ctime_cs;
+		break;
+	case INODE_MTIME:
+		raw = inode->mtime;
+		cs = inode->mtime_cs;
+		break;
+	case INODE_ATIME:
+		raw = inode->atime;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	memset(t, 0, sizeof(struct tm));
+	if (!raw)
+		return -ENODATA;
+
+	/* DoubleSeconds, Minute, Hour, Day, Month, Year (from 1980) */
+	t->tm_sec = (raw & 0x1F) * 2 + cs / 100;
+	t->tm_min = (raw >> 5) & 0x3F;
+	t->tm_hour = (raw >> 11) & 0x1F;
+	t->tm_mday = (raw >> 16) & 0x1F;
+	t->tm_mon = ((raw >> 21) & 0x0F) - 1;
+	t->tm_year = (raw >> 25) + 80;
+	t->tm_isdst = -1;
+
+	return 0;
+}
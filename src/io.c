@@ -0,0 +1,770 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "exfat.h"
+#include "breakexfat.h"
+
+/**
+ * I/O backend name
+ */
+static const char *io_backend_name[] = {
+	[IO_PREAD] = "pread",
+	[IO_MMAP]  = "mmap",
+	[IO_URING] = "io_uring",
+};
+
+/**
+ * io_uring instance
+ */
+struct io_ring {
+	int fd;                   //!< io_uring file descriptor
+	unsigned int entries;     //!< the number of SQ entries
+	void *sq_ptr;             //!< mapped submission queue ring
+	size_t sq_len;            //!< length of sq_ptr
+	void *cq_ptr;             //!< mapped completion queue ring
+	size_t cq_len;            //!< length of cq_ptr
+	void *sqes;               //!< mapped submission queue entries
+	size_t sqes_len;          //!< length of sqes
+	unsigned int *sq_head;    //!< SQ head (updated by kernel)
+	unsigned int *sq_tail;    //!< SQ tail (updated by us)
+	unsigned int *sq_mask;    //!< SQ ring mask
+	unsigned int *sq_array;   //!< SQ index array
+	unsigned int *cq_head;    //!< CQ head (updated by us)
+	unsigned int *cq_tail;    //!< CQ tail (updated by kernel)
+	unsigned int *cq_mask;    //!< CQ ring mask
+	void *cqes;               //!< CQ entries
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+/**
+ * @brief Release io_uring instance
+ * @param [in] ring io_uring instance
+ */
+static void release_ring(struct io_ring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
+
+/**
+ * @brief Create io_uring instance
+ * @param [in] entries the number of SQ entries (queue depth)
+ *
+ * @return io_uring instance (or NULL)
+ */
+static struct io_ring *create_ring(unsigned int entries)
+{
+	struct io_ring *ring;
+	struct io_uring_params p;
+
+	if ((ring = calloc(1, sizeof(struct io_ring))) == NULL)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		pr_info("io_uring_setup: %s\n", strerror(errno));
+		free(ring);
+		return NULL;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_len = ring->cq_len = MAX(ring->sq_len, ring->cq_len);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED)
+		goto err;
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err;
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (char *)ring->cq_ptr + p.cq_off.cqes;
+
+	return ring;
+err:
+	pr_info("mmap: %s\n", strerror(errno));
+	release_ring(ring);
+	return NULL;
+}
+
+/**
+ * @brief Queue one request into submission queue
+ * @param [in] ring  io_uring instance
+ * @param [in] req   I/O request
+ * @param [in] id    index of request
+ * @param [in] write write request or not
+ */
+static void queue_ring(struct io_ring *ring, struct io_request *req, size_t id, bool write)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+
+	req->iov.iov_base = req->data;
+	req->iov.iov_len = req->size;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = req->fd;
+	sqe->off = req->offset;
+	sqe->addr = (unsigned long)(req->vec ? req->vec : &req->iov);
+	sqe->len = req->vec ? req->nr_vec : 1;
+	sqe->user_data = id;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Take completed requests from completion queue
+ * @param [in] ring io_uring instance
+ * @param [in] req  I/O requests
+ *
+ * @return the number of completed requests
+ */
+static unsigned int reap_ring(struct io_ring *ring, struct io_request *req)
+{
+	unsigned int n = 0, head, tail;
+	struct io_uring_cqe *cqe;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+		req[cqe->user_data].ret = cqe->res;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/**
+ * @brief Submit requests via io_uring and wait for completion
+ * @param [in] ring  io_uring instance
+ * @param [in] req   I/O requests
+ * @param [in] nr    the number of requests
+ * @param [in] write write requests or not
+ *
+ * @retval 0 success
+ * @retval Negative failed to submit (results are stored in @req)
+ *
+ * @note Request which the kernel didn't accept is left with -ECANCELED,
+ *       so that caller can issue it by itself. Even if submission failed,
+ *       this returns only after all accepted requests are completed,
+ *       because the kernel still writes into their buffers.
+ */
+static int submit_ring(struct io_ring *ring, struct io_request *req, size_t nr, bool write)
+{
+	int n, ret = 0;
+	size_t next = 0, i;
+	unsigned int inflight = 0, queued = 0, done;
+
+	for (i = 0; i < nr; i++)
+		req[i].ret = -ECANCELED;
+
+	while (inflight || queued || (!ret && next < nr)) {
+		while (!ret && next < nr && inflight + queued < ring->entries) {
+			queue_ring(ring, &req[next], next, write);
+			next++;
+			queued++;
+		}
+
+		n = syscall(__NR_io_uring_enter, ring->fd, queued, inflight + queued ? 1 : 0,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n >= 0) {
+			/* the kernel may accept a part of queued requests */
+			queued -= n;
+			inflight += n;
+		} else if (errno == EINTR || ((errno == EAGAIN || errno == EBUSY) && inflight)) {
+			/* retry after completions are reaped */
+		} else {
+			if (!ret) {
+				pr_err("io_uring_enter: %s\n", strerror(errno));
+				ret = -errno;
+			}
+			if (queued) {
+				/* withdraw requests which the kernel didn't take */
+				__atomic_store_n(ring->sq_tail,
+						__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+						__ATOMIC_RELEASE);
+				queued = 0;
+			} else {
+				/* can't wait in the kernel, poll completion queue instead */
+				sched_yield();
+			}
+		}
+
+		done = reap_ring(ring, req);
+		inflight -= done;
+	}
+
+	return ret;
+}
+#else
+static void release_ring(struct io_ring *ring)
+{
+}
+
+static struct io_ring *create_ring(unsigned int entries)
+{
+	pr_info("io_uring isn't supported in this build\n");
+	return NULL;
+}
+
+static int submit_ring(struct io_ring *ring, struct io_request *req, size_t nr, bool write)
+{
+	return -ENOSYS;
+}
+#endif
+
+/**
+ * @brief Convert I/O backend name to index
+ * @param [in] name backend name
+ *
+ * @return I/O backend (or Negative if unknown)
+ */
+int parse_io_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(io_backend_name) / sizeof(io_backend_name[0]); i++)
+		if (!strcmp(name, io_backend_name[i]))
+			return i;
+
+	return -EINVAL;
+}
+
+/**
+ * @brief Prepare I/O backend for opened image
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+int setup_io(struct super_block *sb)
+{
+	void *map;
+
+	sb->map = NULL;
+	sb->ring = NULL;
+	if (!sb->max_io)
+		sb->max_io = IO_MAX_SIZE;
+
+	switch (sb->io) {
+	case IO_PREAD:
+		break;
+	case IO_URING:
+		if (!sb->queue_depth)
+			sb->queue_depth = IO_QUEUE_DEPTH;
+		if ((sb->ring = create_ring(sb->queue_depth)) == NULL) {
+			pr_warn("io_uring is unavailable, fall back to pread\n");
+			sb->io = IO_PREAD;
+		}
+		break;
+	case IO_MMAP:
+		if (sb->dio_align) {
+			pr_warn("mmap can't bypass page cache, fall back to pread\n");
+			sb->io = IO_PREAD;
+			break;
+		}
+		if (sb->patch) {
+			/* caches must not point into the original image */
+			pr_warn("mmap can't be used with patch output, fall back to pread\n");
+			sb->io = IO_PREAD;
+			break;
+		}
+		if (sb->total_size <= 0) {
+			pr_err("mmap: image size is unknown\n");
+			return -EINVAL;
+		}
+		map = mmap(NULL, sb->total_size,
+				(sb->opt & BIT(OPT_READONLY)) ? PROT_READ : PROT_READ | PROT_WRITE,
+				MAP_SHARED, sb->fd, 0);
+		if (map == MAP_FAILED) {
+			pr_err("mmap: %s\n", strerror(errno));
+			return -errno;
+		}
+		sb->map = map;
+		break;
+	default:
+		pr_err("Invalid I/O backend (%d)\n", sb->io);
+		return -EINVAL;
+	}
+
+	pr_debug("I/O backend: %s\n", io_backend_name[sb->io]);
+	return 0;
+}
+
+/**
+ * @brief Release I/O backend
+ * @param [in] sb Filesystem metadata
+ */
+void cleanup_io(struct super_block *sb)
+{
+	if (sb->map) {
+		munmap(sb->map, sb->total_size);
+		sb->map = NULL;
+	}
+	if (sb->ring) {
+		release_ring(sb->ring);
+		sb->ring = NULL;
+	}
+}
+
+/**
+ * @brief Allocate buffer for I/O of image
+ * @param [in] sb   Filesystem metadata
+ * @param [in] size byte size
+ *
+ * @return allocated buffer (or NULL), released by free()
+ *
+ * @note With O_DIRECT, buffer is aligned to @sb->dio_align.
+ */
+void *alloc_io_buffer(struct super_block *sb, size_t size)
+{
+	void *buf;
+
+	if (!sb->dio_align)
+		return malloc(size);
+
+	if ((errno = posix_memalign(&buf, sb->dio_align, size)) != 0)
+		return NULL;
+	return buf;
+}
+
+/**
+ * @brief Check whether buffer and range satisfy alignment
+ * @param [in] buf    buffer
+ * @param [in] size   byte size
+ * @param [in] offset byte offset in file
+ * @param [in] align  alignment (0: none)
+ *
+ * @return aligned or not
+ */
+static inline bool is_aligned_io(const void *buf, size_t size, off_t offset, size_t align)
+{
+	return !align || !(((uintptr_t)buf | size | (uint64_t)offset) & (align - 1));
+}
+
+/**
+ * @brief Read or write unaligned range through aligned bounce buffer
+ * @param [in] fd     file opened with O_DIRECT
+ * @param [in] buf    buffer
+ * @param [in] size   byte size
+ * @param [in] offset byte offset in file
+ * @param [in] align  alignment
+ * @param [in] write  write or not
+ *
+ * @return transferred bytes (or -1 with errno)
+ *
+ * @note Write is read-modify-write of the whole aligned blocks. If the
+ *       last block crosses the end of file, file is truncated back.
+ */
+static ssize_t bounce_io(int fd, void *buf, size_t size, off_t offset, size_t align, bool write)
+{
+	off_t start = offset - offset % align;
+	size_t head = offset - start;
+	size_t len = ROUNDUP((head + size), align) * align;
+	ssize_t ret = -1, got;
+	char *tmp;
+
+	if ((errno = posix_memalign((void **)&tmp, align, len)) != 0)
+		return -1;
+
+	while ((got = pread(fd, tmp, len, start)) < 0 && errno == EINTR)
+		;
+	if (got < 0)
+		goto out;
+
+	if (!write) {
+		ret = got > head ? MIN(size, got - head) : 0;
+		memcpy(buf, tmp + head, ret);
+		goto out;
+	}
+
+	memset(tmp + got, 0, len - got);
+	memcpy(tmp + head, buf, size);
+	while ((ret = pwrite(fd, tmp, len, start)) < 0 && errno == EINTR)
+		;
+	if (ret < 0)
+		goto out;
+	/* don't extend file by padding of the last block */
+	if (got < len && ftruncate(fd, start + MAX((size_t)got, head + size)) < 0)
+		ret = -1;
+	else
+		ret = MIN(size, ret > head ? ret - head : 0);
+out:
+	if (got < 0)
+		ret = -1;
+	free(tmp);
+	return ret;
+}
+
+/**
+ * @brief pread() which satisfies alignment of O_DIRECT
+ * @param [in]  fd     file
+ * @param [out] buf    buffer
+ * @param [in]  size   byte size
+ * @param [in]  offset byte offset in file
+ * @param [in]  align  alignment required by @fd (0: none)
+ *
+ * @return read bytes (or -1 with errno)
+ */
+ssize_t pread_direct(int fd, void *buf, size_t size, off_t offset, size_t align)
+{
+	if (is_aligned_io(buf, size, offset, align))
+		return pread(fd, buf, size, offset);
+	return bounce_io(fd, buf, size, offset, align, false);
+}
+
+/**
+ * @brief pwrite() which satisfies alignment of O_DIRECT
+ * @param [in] fd     file
+ * @param [in] buf    buffer
+ * @param [in] size   byte size
+ * @param [in] offset byte offset in file
+ * @param [in] align  alignment required by @fd (0: none)
+ *
+ * @return written bytes (or -1 with errno)
+ */
+ssize_t pwrite_direct(int fd, const void *buf, size_t size, off_t offset, size_t align)
+{
+	if (is_aligned_io(buf, size, offset, align))
+		return pwrite(fd, buf, size, offset);
+	return bounce_io(fd, (void *)buf, size, offset, align, true);
+}
+
+/**
+ * @brief Check whether all buffers of request satisfy alignment
+ * @param [in] sb  Filesystem metadata
+ * @param [in] req I/O request
+ *
+ * @return aligned or not
+ */
+static bool is_aligned_request(struct super_block *sb, struct io_request *req)
+{
+	int i;
+
+	if (!req->vec)
+		return is_aligned_io(req->data, req->size, req->offset, sb->dio_align);
+
+	for (i = 0; i < req->nr_vec; i++)
+		if (!is_aligned_io(req->vec[i].iov_base, req->vec[i].iov_len,
+					req->offset, sb->dio_align))
+			return false;
+	return true;
+}
+
+/**
+ * @brief Get buffers of request
+ * @param [in]  req I/O request
+ * @param [out] nr  the number of buffers
+ *
+ * @return buffers
+ */
+static struct iovec *request_vec(struct io_request *req, int *nr)
+{
+	if (req->vec) {
+		*nr = req->nr_vec;
+		return req->vec;
+	}
+
+	req->iov.iov_base = req->data;
+	req->iov.iov_len = req->size;
+	*nr = 1;
+	return &req->iov;
+}
+
+/**
+ * @brief Complete request synchronously
+ * @param [in] sb    Filesystem metadata
+ * @param [in] req   I/O request
+ * @param [in] done  bytes already transferred
+ * @param [in] write write request or not
+ *
+ * @return transferred bytes (or Negative errno)
+ *
+ * @note Vectored request is issued by one preadv/pwritev, and its short
+ *       transfer is completed buffer by buffer. With O_DIRECT, unaligned
+ *       request is transferred buffer by buffer through bounce buffer.
+ */
+static ssize_t sync_io(struct super_block *sb, struct io_request *req, size_t done, bool write)
+{
+	int i, nr;
+	ssize_t ret;
+	size_t pos, len;
+	char *buf, *map;
+	struct iovec *vec = request_vec(req, &nr);
+
+	if (sb->map) {
+		if ((map = map_sector(sb, req->offset / sb->sector_size,
+						req->size / sb->sector_size)) == NULL)
+			return -EINVAL;
+		for (i = 0, pos = 0; i < nr; pos += vec[i++].iov_len) {
+			if (map + pos == vec[i].iov_base)
+				continue;
+			if (write)
+				memcpy(map + pos, vec[i].iov_base, vec[i].iov_len);
+			else
+				memcpy(vec[i].iov_base, map + pos, vec[i].iov_len);
+		}
+		return req->size;
+	}
+
+	while (!done && nr > 1 && is_aligned_request(sb, req)) {
+		if (write)
+			ret = pwritev(req->fd, vec, nr, req->offset);
+		else
+			ret = preadv(req->fd, vec, nr, req->offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return 0;
+		done = ret;
+	}
+
+	for (i = 0, pos = 0; i < nr && done < req->size; pos += vec[i++].iov_len) {
+		buf = vec[i].iov_base;
+		len = vec[i].iov_len;
+		while (done < pos + len) {
+			if (write)
+				ret = pwrite_direct(req->fd, buf + done - pos, pos + len - done,
+						req->offset + done, sb->dio_align);
+			else
+				ret = pread_direct(req->fd, buf + done - pos, pos + len - done,
+						req->offset + done, sb->dio_align);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			if (ret == 0)
+				return done;
+			done += ret;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * @brief Record request into patch, or apply patch to read data
+ * @param [in] sb    Filesystem metadata
+ * @param [in] req   I/O request
+ * @param [in] write write request or not
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int patch_io(struct super_block *sb, struct io_request *req, bool write)
+{
+	int i, nr;
+	size_t pos, len;
+	struct iovec *vec = request_vec(req, &nr);
+
+	for (i = 0, pos = 0; i < nr; pos += vec[i++].iov_len) {
+		if (write) {
+			if (patch_write(sb->patch, vec[i].iov_base, req->offset + pos, vec[i].iov_len))
+				return -ENOMEM;
+		} else if (pos < req->ret) {
+			len = MIN(vec[i].iov_len, req->ret - pos);
+			patch_read(sb->patch, vec[i].iov_base, req->offset + pos, len);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Submit a batch of read/write requests
+ * @param [in] sb    Filesystem metadata
+ * @param [in] req   I/O requests (byte offset and size)
+ * @param [in] nr    the number of requests
+ * @param [in] write write requests or not
+ *
+ * @return the number of failed requests (each result is stored in req->ret)
+ *
+ * @note With io_uring, up to queue_depth requests are in flight at once.
+ *       Otherwise requests are issued one by one.
+ */
+int submit_io(struct super_block *sb, struct io_request *req, size_t nr, bool write)
+{
+	size_t i;
+	int failed = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (req[i].fd < 0)
+			req[i].fd = sb->fd;
+		req[i].ret = 0;
+	}
+
+	if (sb->patch && write) {
+		for (i = 0; i < nr; i++)
+			req[i].ret = patch_io(sb, &req[i], true) ? -ENOMEM : req[i].size;
+		goto out;
+	}
+
+	/* io_uring can't bounce unaligned O_DIRECT request */
+	for (i = 0; i < nr && is_aligned_request(sb, &req[i]); i++)
+		;
+
+	if (sb->ring && i == nr) {
+		submit_ring(sb->ring, req, nr, write);
+		/* Issue rejected request and complete short transfer synchronously */
+		for (i = 0; i < nr; i++) {
+			if (req[i].ret == -ECANCELED)
+				req[i].ret = sync_io(sb, &req[i], 0, write);
+			else if (req[i].ret >= 0 && req[i].ret < req[i].size)
+				req[i].ret = sync_io(sb, &req[i], req[i].ret, write);
+		}
+	} else {
+		for (i = 0; i < nr; i++)
+			req[i].ret = sync_io(sb, &req[i], 0, write);
+	}
+
+	if (sb->patch)
+		for (i = 0; i < nr; i++)
+			if (req[i].ret > 0)
+				patch_io(sb, &req[i], false);
+out:
+	for (i = 0; i < nr; i++) {
+		if (req[i].ret < 0) {
+			pr_err("%s: %s\n", write ? "write" : "read", strerror(-req[i].ret));
+			failed++;
+		} else if (write) {
+			stat_add(sb, batch_write_bytes, req[i].ret);
+		} else {
+			stat_add(sb, batch_read_bytes, req[i].ret);
+		}
+	}
+	if (write)
+		stat_add(sb, batch_writes, nr);
+	else
+		stat_add(sb, batch_reads, nr);
+
+	return failed;
+}
+
+/**
+ * @brief Hint that a range of image will be read soon
+ * @param [in] sb     Filesystem metadata
+ * @param [in] offset byte offset in image
+ * @param [in] size   byte size
+ *
+ * @note Kernel reads the range into page cache (or mapped pages) in
+ *       background, so that the following read doesn't wait for the device.
+ *       Failure is ignored because it is only a hint.
+ */
+void readahead_io(struct super_block *sb, off_t offset, size_t size)
+{
+	off_t start;
+	long page = sysconf(_SC_PAGESIZE);
+
+	/* hint would fill page cache which O_DIRECT bypasses */
+	if (sb->dio_align || offset < 0 || (sb->total_size > 0 && offset >= sb->total_size))
+		return;
+	if (sb->total_size > 0)
+		size = MIN(size, sb->total_size - offset);
+	if (!size)
+		return;
+
+	if (sb->map) {
+		/* madvise() requires page aligned address */
+		start = page > 0 ? offset - offset % page : offset;
+		if (madvise((char *)sb->map + start, size + (offset - start), MADV_WILLNEED))
+			pr_debug("madvise: %s\n", strerror(errno));
+	} else {
+		errno = posix_fadvise(sb->fd, offset, size, POSIX_FADV_WILLNEED);
+		if (errno)
+			pr_debug("posix_fadvise: %s\n", strerror(errno));
+	}
+
+	stat_add(sb, readahead_hints, 1);
+	stat_add(sb, readahead_bytes, size);
+}
+
+/**
+ * @brief Get pointer to sectors in mapped image
+ * @param [in] sb    Filesystem metadata
+ * @param [in] index Start sector index
+ * @param [in] count The number of sectors
+ *
+ * @return pointer to sectors (or NULL if image isn't mapped)
+ */
+void *map_sector(struct super_block *sb, off_t index, size_t count)
+{
+	off_t offset = index * sb->sector_size;
+
+	if (!sb->map)
+		return NULL;
+
+	if (offset < 0 || offset + (off_t)(sb->sector_size * count) > sb->total_size)
+		return NULL;
+
+	return (char *)sb->map + offset;
+}
+
+/**
+ * @brief Get pointer to clusters in mapped image
+ * @param [in] sb    Filesystem metadata
+ * @param [in] index Start cluster index
+ * @param [in] count The number of clusters
+ *
+ * @return pointer to clusters (or NULL if image isn't mapped)
+ */
+void *map_cluster(struct super_block *sb, off_t index, size_t count)
+{
+	size_t sec_per_clu = sb->cluster_size / sb->sector_size;
+
+	if (index < EXFAT_FIRST_CLUSTER || index + count > sb->cluster_count + EXFAT_FIRST_CLUSTER)
+		return NULL;
+
+	return map_sector(sb,
+			sb->heap_offset + (index - EXFAT_FIRST_CLUSTER) * sec_per_clu,
+			sec_per_clu * count);
+}
@@ -24,7 +24,24 @@ unsigned int print_level = PRINT_WARNING;
 enum
 {
 	GETOPT_HELP_CHAR = (CHAR_MIN - 2),
-	GETOPT_VERSION_CHAR = (CHAR_MIN - 3)
+	GETOPT_VERSION_CHAR = (CHAR_MIN - 3),
+	GETOPT_CACHE_MB_CHAR = (CHAR_MIN - 4),
+	GETOPT_IO_CHAR = (CHAR_MIN - 5),
+	GETOPT_QUEUE_DEPTH_CHAR = (CHAR_MIN - 6),
+	GETOPT_APPLY_CHAR = (CHAR_MIN - 7),
+	GETOPT_MKIMAGE_CHAR = (CHAR_MIN - 8),
+	GETOPT_SECTOR_SIZE_CHAR = (CHAR_MIN - 9),
+	GETOPT_CLUSTER_SIZE_CHAR = (CHAR_MIN - 10),
+	GETOPT_FATS_CHAR = (CHAR_MIN - 11),
+	GETOPT_FILES_CHAR = (CHAR_MIN - 12),
+	GETOPT_FILES_PER_DIR_CHAR = (CHAR_MIN - 13),
+	GETOPT_FILE_CLUSTERS_CHAR = (CHAR_MIN - 14),
+	GETOPT_FRAGMENT_CHAR = (CHAR_MIN - 15),
+	GETOPT_STATS_CHAR = (CHAR_MIN - 16),
+	GETOPT_MAX_IO_CHAR = (CHAR_MIN - 17),
+	GETOPT_READAHEAD_CHAR = (CHAR_MIN - 18),
+	GETOPT_DIRECT_CHAR = (CHAR_MIN - 19),
+	GETOPT_FIX_CHECKSUM_CHAR = (CHAR_MIN - 20),
 };
 
 /**
@@ -33,6 +50,26 @@ enum
 static struct option const longopts[] =
 {
 	{"all", no_argument, NULL, 'a'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"output-dir", required_argument, NULL, 'o'},
+	{"patch", optional_argument, NULL, 'p'},
+	{"apply", required_argument, NULL, GETOPT_APPLY_CHAR},
+	{"fix-checksum", optional_argument, NULL, GETOPT_FIX_CHECKSUM_CHAR},
+	{"cache-mb", required_argument, NULL, GETOPT_CACHE_MB_CHAR},
+	{"io", required_argument, NULL, GETOPT_IO_CHAR},
+	{"queue-depth", required_argument, NULL, GETOPT_QUEUE_DEPTH_CHAR},
+	{"max-io", required_argument, NULL, GETOPT_MAX_IO_CHAR},
+	{"readahead", required_argument, NULL, GETOPT_READAHEAD_CHAR},
+	{"direct", no_argument, NULL, GETOPT_DIRECT_CHAR},
+	{"stats", optional_argument, NULL, GETOPT_STATS_CHAR},
+	{"mkimage", required_argument, NULL, GETOPT_MKIMAGE_CHAR},
+	{"sector-size", required_argument, NULL, GETOPT_SECTOR_SIZE_CHAR},
+	{"cluster-size", required_argument, NULL, GETOPT_CLUSTER_SIZE_CHAR},
+	{"fats", required_argument, NULL, GETOPT_FATS_CHAR},
+	{"files", required_argument, NULL, GETOPT_FILES_CHAR},
+	{"files-per-dir", required_argument, NULL, GETOPT_FILES_PER_DIR_CHAR},
+	{"file-clusters", required_argument, NULL, GETOPT_FILE_CLUSTERS_CHAR},
+	{"fragment", required_argument, NULL, GETOPT_FRAGMENT_CHAR},
 	{0,0,0,0}
 };
 
@@ -42,9 +79,40 @@ static struct option const longopts[] =
 static void usage(void)
 {
 	fprintf(stderr, "Usage: %s [OPTION]... FILE [PATTERN,...]\n", PROGRAM_NAME);
+	fprintf(stderr, "  or:  %s --apply=PATCH FILE [OUTPUT]\n", PROGRAM_NAME);
+	fprintf(stderr, "  or:  %s --mkimage=SIZE [GEOMETRY OPTION]... FILE\n", PROGRAM_NAME);
 	fprintf(stderr, "break FAT/exFAT filesystem image.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "  -a, --all\tBreak exFAT by all failure.\n");
+	fprintf(stderr, "  -o, --output-dir=DIR\tKeep FILE intact and write one broken image per\n");
+	fprintf(stderr, "                      \tPATTERN into DIR (use N+M to combine patterns).\n");
+	fprintf(stderr, "  -j, --jobs=N\tGenerate up to N images in parallel with -o. default: 1\n");
+	fprintf(stderr, "  -p, --patch=PATCH\tKeep FILE intact and write changes into PATCH.\n");
+	fprintf(stderr, "  --patch\tWith -o, write one patch file per PATTERN into DIR.\n");
+	fprintf(stderr, "  --apply=PATCH\tApply PATCH to FILE (or to a copy of FILE named OUTPUT).\n");
+	fprintf(stderr, "  --fix-checksum[=REGION]\tRecalculate Boot Checksum after breaking, so that\n");
+	fprintf(stderr, "                         \tonly PATTERN is broken (main, both). default: main\n");
+	fprintf(stderr, "  --cache-mb=SIZE\tLimit cached sectors/clusters to SIZE MiB.\n");
+	fprintf(stderr, "  --io=ENGINE\tSelect I/O backend (pread, mmap, io_uring). default: pread\n");
+	fprintf(stderr, "  --queue-depth=N\tKeep up to N requests in flight with io_uring. default: %d\n",
+			IO_QUEUE_DEPTH);
+	fprintf(stderr, "  --max-io=SIZE\tMerge adjacent reads/writes up to SIZE bytes (K/M suffix). default: %dK\n",
+			IO_MAX_SIZE >> 10);
+	fprintf(stderr, "  --readahead=SIZE\tHint SIZE bytes of cluster chain ahead of reading it\n");
+	fprintf(stderr, "                  \t(0: disable). default: %dK\n", IO_READAHEAD_SIZE >> 10);
+	fprintf(stderr, "  --direct\tBypass page cache with O_DIRECT (aligned to logical block size).\n");
+	fprintf(stderr, "  --stats[=FORMAT]\tPrint I/O, cache and pattern counters into stderr\n");
+	fprintf(stderr, "                  \tat exit (text, json). default: text\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  --mkimage=SIZE\tGenerate sparse exFAT image of SIZE bytes (K/M/G/T suffix).\n");
+	fprintf(stderr, "  --sector-size=SIZE\tBytes per sector (512 - 4096). default: 512\n");
+	fprintf(stderr, "  --cluster-size=SIZE\tBytes per cluster (up to 32M). default: by SIZE\n");
+	fprintf(stderr, "  --fats=N\tThe number of FATs (1 or 2). default: 1\n");
+	fprintf(stderr, "  --files=N\tThe number of files. default: 0\n");
+	fprintf(stderr, "  --files-per-dir=N\tFiles in each sub directory (0: all in root). default: %d\n",
+			MKIMAGE_FILES_PER_DIR);
+	fprintf(stderr, "  --file-clusters=N\tClusters in each file. default: 1\n");
+	fprintf(stderr, "  --fragment=N\tSplit each file into N-cluster fragments (0: contiguous).\n");
 	fprintf(stderr, "\n");
 }
 
@@ -61,6 +129,67 @@ static void version(const char *command_name, const char *version, const char *a
 	fprintf(stdout, "Written by %s.\n", author);
 }
 
+/**
+ * @brief Parse size with optional binary suffix (K, M, G, T)
+ * @param [in]  str  string
+ * @param [out] size parsed size
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int parse_size(const char *str, uint64_t *size)
+{
+	int shift = 0;
+	char *end;
+
+	errno = 0;
+	*size = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return -EINVAL;
+
+	switch (*end) {
+		case 'T':
+			shift += 10;
+			/* fall through */
+		case 'G':
+			shift += 10;
+			/* fall through */
+		case 'M':
+			shift += 10;
+			/* fall through */
+		case 'K':
+			shift += 10;
+			end++;
+			break;
+		default:
+			break;
+	}
+	if (*end != '\0' || *size > (UINT64_MAX >> shift))
+		return -EINVAL;
+	*size <<= shift;
+
+	return 0;
+}
+
+/**
+ * @brief Parse size of sector/cluster
+ * @param [in]  str  string
+ * @param [out] bits log2 of parsed size
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int parse_block_size(const char *str, uint8_t *bits)
+{
+	uint64_t size;
+
+	if (parse_size(str, &size) || size > EXFAT_CLUSTER_MAX || !is_power2(size))
+		return -EINVAL;
+	*bits = log_2(size);
+
+	return 0;
+}
+
 /**
  * @brief Parse cmdline argument
  * @param [in] sb   Filesystem metadata
@@ -98,15 +227,156 @@ int main(int argc, char *argv[])
 {
 	int opt;
 	int longindex;
-	struct super_block sb = {0};
+	int ret = EXIT_SUCCESS;
+	int stats_format = STATS_NONE;
+	unsigned long size;
+	uint64_t bytes;
+	unsigned int jobs = 1;
+	char *end;
+	char *outdir = NULL;
+	char *patch = NULL;
+	char *apply = NULL;
+	struct super_block sb = {.readahead = IO_READAHEAD_SIZE};
+	struct io_stats stats = {0};
+	struct mkimage_param mkparam = {
+		.num_fats = 1,
+		.files_per_dir = MKIMAGE_FILES_PER_DIR,
+		.file_clusters = 1,
+	};
 
 	while ((opt = getopt_long(argc, argv,
-					"a",
+					"aj:o:p:",
 					longopts, &longindex)) != -1) {
 		switch (opt) {
 			case 'a':
 				sb.opt |= BIT(OPT_ALL);
 				break;
+			case 'j':
+				size = strtoul(optarg, &end, 10);
+				if (*end != '\0' || !size || size > UINT16_MAX) {
+					pr_err("invalid number of jobs: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				jobs = size;
+				break;
+			case 'o':
+				outdir = optarg;
+				sb.opt |= BIT(OPT_READONLY);
+				break;
+			case 'p':
+				patch = optarg;
+				sb.opt |= BIT(OPT_READONLY) | BIT(OPT_PATCH);
+				break;
+			case GETOPT_APPLY_CHAR:
+				apply = optarg;
+				break;
+			case GETOPT_FIX_CHECKSUM_CHAR:
+				sb.opt |= BIT(OPT_FIX_CHECKSUM);
+				if (!optarg || !strcmp(optarg, "main")) {
+					sb.opt &= ~BIT(OPT_FIX_BACKUP);
+				} else if (!strcmp(optarg, "both")) {
+					sb.opt |= BIT(OPT_FIX_BACKUP);
+				} else {
+					pr_err("invalid boot region: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case GETOPT_CACHE_MB_CHAR:
+				size = strtoul(optarg, &end, 10);
+				if (*end != '\0' || !size) {
+					pr_err("invalid cache size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				sb.cache_limit = size << 20;
+				break;
+			case GETOPT_IO_CHAR:
+				if ((sb.io = parse_io_backend(optarg)) < 0) {
+					pr_err("invalid I/O backend: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case GETOPT_QUEUE_DEPTH_CHAR:
+				size = strtoul(optarg, &end, 10);
+				if (*end != '\0' || !size || size > UINT16_MAX) {
+					pr_err("invalid queue depth: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				sb.queue_depth = size;
+				break;
+			case GETOPT_MAX_IO_CHAR:
+				if (parse_size(optarg, &bytes) || bytes < EXFAT_SECTOR_MAX || bytes > SSIZE_MAX) {
+					pr_err("invalid I/O size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				sb.max_io = bytes;
+				break;
+			case GETOPT_DIRECT_CHAR:
+				sb.opt |= BIT(OPT_DIRECT);
+				break;
+			case GETOPT_READAHEAD_CHAR:
+				if (parse_size(optarg, &bytes) || bytes > SSIZE_MAX) {
+					pr_err("invalid readahead size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				sb.readahead = bytes;
+				break;
+			case GETOPT_STATS_CHAR:
+				if (!optarg) {
+					stats_format = STATS_TEXT;
+				} else if ((stats_format = parse_stats_format(optarg)) < 0) {
+					pr_err("invalid statistics format: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				sb.stats = (stats_format != STATS_NONE) ? &stats : NULL;
+				break;
+			case GETOPT_MKIMAGE_CHAR:
+				if (parse_size(optarg, &mkparam.size) || !mkparam.size) {
+					pr_err("invalid image size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case GETOPT_SECTOR_SIZE_CHAR:
+				if (parse_block_size(optarg, &mkparam.sector_bits)) {
+					pr_err("invalid sector size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case GETOPT_CLUSTER_SIZE_CHAR:
+				if (parse_block_size(optarg, &mkparam.cluster_bits)) {
+					pr_err("invalid cluster size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case GETOPT_FATS_CHAR:
+				size = strtoul(optarg, &end, 10);
+				if (*end != '\0' || !size || size > 2) {
+					pr_err("invalid number of FATs: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				mkparam.num_fats = size;
+				break;
+			case GETOPT_FILES_CHAR:
+				mkparam.files = strtoull(optarg, &end, 10);
+				if (*end != '\0') {
+					pr_err("invalid number of files: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case GETOPT_FILES_PER_DIR_CHAR:
+			case GETOPT_FILE_CLUSTERS_CHAR:
+			case GETOPT_FRAGMENT_CHAR:
+				size = strtoul(optarg, &end, 10);
+				if (*end != '\0' || size > UINT32_MAX) {
+					pr_err("invalid number: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				if (opt == GETOPT_FILES_PER_DIR_CHAR)
+					mkparam.files_per_dir = size;
+				else if (opt == GETOPT_FILE_CLUSTERS_CHAR)
+					mkparam.file_clusters = size;
+				else
+					mkparam.fragment = size;
+				break;
 			case GETOPT_HELP_CHAR:
 				usage();
 				exit(EXIT_SUCCESS);
@@ -123,22 +393,63 @@ int main(int argc, char *argv[])
 	print_level = PRINT_DEBUG;
 #endif
 
+	if (apply) {
+		if (optind != argc - 1 && optind != argc - 2) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		if (apply_patch(apply, argv[optind], argv[optind + 1]))
+			exit(EXIT_FAILURE);
+		return 0;
+	}
+
+	if (mkparam.size) {
+		if (optind != argc - 1) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		if (make_image(argv[optind], &mkparam))
+			exit(EXIT_FAILURE);
+		return 0;
+	}
+
 	if (optind != argc - MANDATORY_ARGUMENT) {
 		usage();
 		exit(EXIT_FAILURE);
 	}
 
-	if (fill_super(&sb, argv[optind]))
+	if ((sb.opt & BIT(OPT_PATCH)) && !outdir) {
+		if (!patch) {
+			pr_err("PATCH is required without --output-dir\n");
+			exit(EXIT_FAILURE);
+		}
+		if ((sb.patch = create_patch(patch)) == NULL)
+			exit(EXIT_FAILURE);
+	}
+
+	if (fill_super(&sb, argv[optind])) {
+		ret = EXIT_FAILURE;
 		goto out;
+	}
+
+	if (outdir) {
+		if (run_break_batch(&sb, outdir,
+				(sb.opt & BIT(OPT_ALL)) ? NULL : argv[optind + 1], jobs))
+			ret = EXIT_FAILURE;
+		goto out;
+	}
 
 	if (sb.opt & BIT(OPT_ALL))
 		enable_break_all_pattern(&sb);
 	else
-		parse_break_pattern(&sb, argv[2]);
+		parse_break_pattern(&sb, argv[optind + 1]);
 
-	run_break(&sb);
+	if (run_break(&sb))
+		ret = EXIT_FAILURE;
 out:
-	put_super(&sb);
+	if (put_super(&sb))
+		ret = EXIT_FAILURE;
+	print_stats(stderr, &stats, stats_format);
 
-	return 0;
+	return ret;
 }
@@ -0,0 +1,592 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+#include "endian.h"
+
+#define MKIMAGE_BOOT_SECTORS  12                //!< sectors in Main/Backup Boot region
+#define MKIMAGE_FAT_OFFSET    24                //!< volume-relative sector offset of the First FAT
+#define MKIMAGE_FAT_WINDOW    (256 * 1024)      //!< FAT entries written at once
+#define MKIMAGE_SERIAL        0x20220101        //!< VolumeSerialNumber
+#define MKIMAGE_MAX_CLUSTERS  0xFFFFFFF5        //!< the maximum ClusterCount
+
+/**
+ * Timestamp of generated files (2022-01-01 00:00:00)
+ */
+#define MKIMAGE_DATE   ((42 << 9) | (1 << 5) | 1)
+#define MKIMAGE_TIME   0
+
+/**
+ * image being generated
+ */
+struct mkimage {
+	int fd;                         //!< output image
+	const struct mkimage_param *param; //!< requested geometry and tree
+	uint32_t sector_size;           //!< bytes per sector
+	uint32_t cluster_size;          //!< bytes per cluster
+	uint64_t vol_length;            //!< volume size in sectors
+	uint32_t fat_length;            //!< length in sectors of each FAT
+	uint32_t heap_offset;           //!< sector offset of the Cluster Heap
+	uint32_t cluster_count;         //!< the number of clusters
+	uint32_t root;                  //!< the first cluster of root directory
+	uint32_t next;                  //!< next cluster to be allocated
+	uint32_t used;                  //!< the number of allocated clusters
+	uint8_t *bitmap;                //!< Allocation Bitmap
+	uint64_t bitmap_len;            //!< bytes of Allocation Bitmap
+	uint32_t *fat;                  //!< window of FAT entries
+	uint32_t fat_start;             //!< the first entry in @fat
+	bool fat_dirty;                 //!< whether @fat has any entry
+};
+
+/**
+ * @brief Get default cluster size for volume
+ * @param [in] size volume size in bytes
+ *
+ * @return log2 of bytes per cluster
+ */
+static uint8_t default_cluster_bits(uint64_t size)
+{
+	if (size <= (256ULL << 20))
+		return 12;
+	if (size <= (32ULL << 30))
+		return 15;
+	return 17;
+}
+
+/**
+ * @brief Write data into image
+ * @param [in] mk     image being generated
+ * @param [in] data   data
+ * @param [in] len    length of @data
+ * @param [in] offset byte offset in image
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int write_image(struct mkimage *mk, const void *data, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		if ((ret = pwrite(mk->fd, data, len, offset)) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			pr_err("pwrite: %s\n", strerror(-ret));
+			return ret;
+		}
+		data = (const char *)data + ret;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Get byte offset of cluster
+ * @param [in] mk  image being generated
+ * @param [in] clu cluster index
+ *
+ * @return byte offset in image
+ */
+static off_t cluster_offset(struct mkimage *mk, uint32_t clu)
+{
+	return (off_t)mk->heap_offset * mk->sector_size +
+		(off_t)(clu - EXFAT_FIRST_CLUSTER) * mk->cluster_size;
+}
+
+/**
+ * @brief Write FAT window into all FATs
+ * @param [in] mk image being generated
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int flush_fat_window(struct mkimage *mk)
+{
+	int ret;
+	uint8_t i;
+	size_t n;
+	off_t offset;
+
+	if (!mk->fat_dirty)
+		return 0;
+
+	n = MIN(MKIMAGE_FAT_WINDOW, (size_t)mk->cluster_count + EXFAT_FIRST_CLUSTER - mk->fat_start);
+	for (i = 0; i < mk->param->num_fats; i++) {
+		offset = ((off_t)MKIMAGE_FAT_OFFSET + (off_t)i * mk->fat_length) * mk->sector_size +
+			(off_t)mk->fat_start * sizeof(uint32_t);
+		if ((ret = write_image(mk, mk->fat, n * sizeof(uint32_t), offset)) != 0)
+			return ret;
+	}
+	memset(mk->fat, 0, MKIMAGE_FAT_WINDOW * sizeof(uint32_t));
+	mk->fat_dirty = false;
+
+	return 0;
+}
+
+/**
+ * @brief Set FAT entry
+ * @param [in] mk    image being generated
+ * @param [in] clu   cluster index
+ * @param [in] entry FAT entry
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Clusters are allocated in ascending order, so that FAT is written
+ *       by sliding window and unused part of FAT is kept as a hole.
+ */
+static int put_fat_entry(struct mkimage *mk, uint32_t clu, uint32_t entry)
+{
+	int ret;
+
+	if (clu >= mk->fat_start + MKIMAGE_FAT_WINDOW) {
+		if ((ret = flush_fat_window(mk)) != 0)
+			return ret;
+		mk->fat_start = clu - clu % MKIMAGE_FAT_WINDOW;
+	}
+	mk->fat[clu - mk->fat_start] = cpu_to_le32(entry);
+	mk->fat_dirty = true;
+
+	return 0;
+}
+
+/**
+ * @brief Allocate clusters
+ * @param [in]  mk       image being generated
+ * @param [in]  len      the number of clusters
+ * @param [in]  fragment clusters per fragment (0: contiguous)
+ * @param [in]  chain    whether cluster chain is recorded in FAT
+ * @param [out] first    the first cluster (0 if @len is 0)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note One free cluster is left after each fragment.
+ */
+static int alloc_clusters(struct mkimage *mk, uint64_t len, uint32_t fragment,
+		bool chain, uint32_t *first)
+{
+	int ret;
+	uint64_t i;
+	uint32_t clu, pos;
+
+	*first = len ? mk->next : 0;
+
+	for (i = 0; i < len; i++) {
+		clu = mk->next++;
+		if (fragment && (i + 1) % fragment == 0 && i + 1 < len)
+			mk->next++;
+		if (clu > mk->cluster_count + 1 || mk->next < clu) {
+			pr_err("Volume is too small for the directory tree.\n");
+			return -ENOSPC;
+		}
+
+		pos = clu - EXFAT_FIRST_CLUSTER;
+		mk->bitmap[pos / CHAR_BIT] |= BIT(pos % CHAR_BIT);
+		mk->used++;
+		if (chain && (ret = put_fat_entry(mk, clu,
+						i + 1 < len ? mk->next : EXFAT_LASTCLUSTER)) != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Build entry set for file/directory
+ * @param [out] d     dentries (cleared by caller)
+ * @param [in]  name  name (ASCII)
+ * @param [in]  attr  FileAttributes
+ * @param [in]  flags GeneralSecondaryFlags
+ * @param [in]  clu   FirstCluster
+ * @param [in]  size  DataLength
+ *
+ * @return the number of dentries
+ */
+static size_t build_dentry_set(struct exfat_dentry *d, const char *name, uint16_t attr,
+		uint8_t flags, uint32_t clu, uint64_t size)
+{
+	size_t i, len = MIN(strlen(name), MAX_NAME_LENGTH);
+	size_t names = ROUNDUP(len, FILENAME_LEN);
+	uint16_t uniname[MAX_NAME_LENGTH];
+
+	for (i = 0; i < len; i++)
+		uniname[i] = (unsigned char)name[i];
+
+	d[0].type = DENTRY_FILE;
+	d[0].dentry.file.num_ext = 1 + names;
+	d[0].dentry.file.attr = cpu_to_le16(attr);
+	d[0].dentry.file.create_time = cpu_to_le16(MKIMAGE_TIME);
+	d[0].dentry.file.create_date = cpu_to_le16(MKIMAGE_DATE);
+	d[0].dentry.file.modify_time = cpu_to_le16(MKIMAGE_TIME);
+	d[0].dentry.file.modify_date = cpu_to_le16(MKIMAGE_DATE);
+	d[0].dentry.file.access_time = cpu_to_le16(MKIMAGE_TIME);
+	d[0].dentry.file.access_date = cpu_to_le16(MKIMAGE_DATE);
+
+	d[1].type = DENTRY_STREAM;
+	d[1].dentry.stream.flags = flags;
+	d[1].dentry.stream.name_len = len;
+	d[1].dentry.stream.name_hash = cpu_to_le16(calc_name_hash(uniname, len, NULL));
+	d[1].dentry.stream.valid_size = cpu_to_le64(size);
+	d[1].dentry.stream.start_clu = cpu_to_le32(clu);
+	d[1].dentry.stream.size = cpu_to_le64(size);
+
+	for (i = 0; i < len; i++)
+		d[2 + i / FILENAME_LEN].dentry.name.name[i % FILENAME_LEN] = cpu_to_le16(uniname[i]);
+	for (i = 0; i < names; i++)
+		d[2 + i].type = DENTRY_NAME;
+
+	d[0].dentry.file.checksum = cpu_to_le16(calc_set_checksum(d, 2 + names));
+
+	return 2 + names;
+}
+
+/**
+ * @brief Allocate and describe regular files
+ * @param [in]  mk    image being generated
+ * @param [out] d     dentries of parent directory
+ * @param [in]  first index of the first file
+ * @param [in]  nr    the number of files
+ *
+ * @return the number of dentries (or Negative errno)
+ */
+static ssize_t make_files(struct mkimage *mk, struct exfat_dentry *d, uint64_t first, uint64_t nr)
+{
+	int ret;
+	uint64_t i;
+	size_t n = 0;
+	uint32_t clu;
+	uint8_t flags = ALLOC_POSSIBLE;
+	char name[MAX_NAME_LENGTH + 1];
+	const struct mkimage_param *param = mk->param;
+
+	/* contiguous file doesn't need FAT chain */
+	if (!param->fragment && param->file_clusters)
+		flags |= NOFATCHAIN;
+
+	for (i = first; i < first + nr; i++) {
+		if ((ret = alloc_clusters(mk, param->file_clusters, param->fragment,
+						!(flags & NOFATCHAIN), &clu)) != 0)
+			return ret;
+		snprintf(name, sizeof(name), "file%07lu", i);
+		n += build_dentry_set(d + n, name, ATTR_ARCHIVE, flags, clu,
+				(uint64_t)param->file_clusters * mk->cluster_size);
+	}
+
+	return n;
+}
+
+/**
+ * @brief the number of clusters for directory
+ * @param [in] mk       image being generated
+ * @param [in] dentries the number of dentries
+ *
+ * @return the number of clusters (at least 1)
+ */
+static uint32_t dir_clusters(struct mkimage *mk, uint64_t dentries)
+{
+	return MAX(ROUNDUP((dentries * sizeof(struct exfat_dentry)), mk->cluster_size), 1);
+}
+
+/**
+ * @brief Build compressed Up-case table
+ * @param [out] table Up-case table (at least 30 entries)
+ *
+ * @return the number of entries
+ *
+ * @note Only "a" - "z" are mapped, the others are identity mapping.
+ */
+static size_t build_upcase_table(uint16_t *table)
+{
+	size_t n = 0;
+	uint16_t c;
+
+	/* 0xFFFF means that following number of characters are identity mapping */
+	table[n++] = cpu_to_le16(0xFFFF);
+	table[n++] = cpu_to_le16('a');
+	for (c = 'a'; c <= 'z'; c++)
+		table[n++] = cpu_to_le16(toupper(c));
+	table[n++] = cpu_to_le16(0xFFFF);
+	table[n++] = cpu_to_le16(0x10000 - 'z' - 1);
+
+	return n;
+}
+
+/**
+ * @brief Write Main and Backup Boot region
+ * @param [in] mk image being generated
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int write_boot_region(struct mkimage *mk)
+{
+	int ret = 0;
+	size_t i, j;
+	uint32_t checksum;
+	uint8_t *region;
+	struct boot_sector *boot;
+
+	if ((region = calloc(MKIMAGE_BOOT_SECTORS, mk->sector_size)) == NULL)
+		return -ENOMEM;
+
+	boot = (struct boot_sector *)region;
+	memcpy(boot->jmp_boot, "\xEB\x76\x90", BOOTSEC_JUMPBOOT_LEN);
+	memcpy(boot->fs_name, "EXFAT   ", BOOTSEC_FSNAME_LEN);
+	boot->vol_length = cpu_to_le64(mk->vol_length);
+	boot->fat_offset = cpu_to_le32(MKIMAGE_FAT_OFFSET);
+	boot->fat_length = cpu_to_le32(mk->fat_length);
+	boot->clu_offset = cpu_to_le32(mk->heap_offset);
+	boot->clu_count = cpu_to_le32(mk->cluster_count);
+	boot->root_cluster = cpu_to_le32(mk->root);
+	boot->vol_serial = cpu_to_le32(MKIMAGE_SERIAL);
+	boot->fs_revision[0] = 0x00;
+	boot->fs_revision[1] = 0x01;
+	boot->sect_size_bits = log_2(mk->sector_size);
+	boot->sect_per_clus_bits = log_2(mk->cluster_size / mk->sector_size);
+	boot->num_fats = mk->param->num_fats;
+	boot->drv_sel = 0x80;
+	boot->percent_in_use = (uint64_t)mk->used * 100 / mk->cluster_count;
+	memset(boot->boot_code, 0xF4, sizeof(boot->boot_code));
+	boot->signature = cpu_to_le16(0xAA55);
+
+	/* Main Extended Boot Sectors */
+	for (i = 1; i <= 8; i++)
+		*(uint32_t *)(region + (i + 1) * mk->sector_size - sizeof(uint32_t)) =
+			cpu_to_le32(0xAA550000);
+
+	/* Main Boot Checksum (VolumeFlags and PercentInUse are excluded) */
+	checksum = calc_boot_checksum(region, mk->sector_size);
+	for (j = 0; j < mk->sector_size / sizeof(uint32_t); j++)
+		((uint32_t *)(region + (MKIMAGE_BOOT_SECTORS - 1) * mk->sector_size))[j] =
+			cpu_to_le32(checksum);
+
+	for (i = 0; i < 2; i++) {
+		if ((ret = write_image(mk, region, MKIMAGE_BOOT_SECTORS * mk->sector_size,
+						(off_t)i * MKIMAGE_BOOT_SECTORS * mk->sector_size)) != 0)
+			break;
+	}
+
+	free(region);
+	return ret;
+}
+
+/**
+ * @brief Decide volume layout
+ * @param [in] mk image being generated
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int setup_geometry(struct mkimage *mk)
+{
+	uint32_t spc;
+	uint64_t count;
+	const struct mkimage_param *param = mk->param;
+	uint8_t sector_bits = param->sector_bits ? param->sector_bits : 9;
+	uint8_t cluster_bits = param->cluster_bits ?
+		param->cluster_bits : MAX(default_cluster_bits(param->size), sector_bits);
+
+	if (sector_bits < 9 || sector_bits > 12) {
+		pr_err("invalid sector size: %u\n", 1U << sector_bits);
+		return -EINVAL;
+	}
+	if (cluster_bits < sector_bits || cluster_bits > 25) {
+		pr_err("invalid cluster size: %u\n", 1U << cluster_bits);
+		return -EINVAL;
+	}
+	if (param->num_fats != 1 && param->num_fats != 2) {
+		pr_err("invalid number of FATs: %u\n", param->num_fats);
+		return -EINVAL;
+	}
+
+	mk->sector_size = 1U << sector_bits;
+	mk->cluster_size = 1U << cluster_bits;
+	mk->vol_length = param->size >> sector_bits;
+	spc = mk->cluster_size / mk->sector_size;
+
+	if (mk->vol_length <= MKIMAGE_FAT_OFFSET + 2 * spc) {
+		pr_err("Volume is too small.\n");
+		return -EINVAL;
+	}
+
+	/* FAT is sized for the upper bound, and then the heap gets the rest */
+	count = MIN((mk->vol_length - MKIMAGE_FAT_OFFSET) / spc, MKIMAGE_MAX_CLUSTERS);
+	mk->fat_length = ROUNDUP(((count + EXFAT_FIRST_CLUSTER) * sizeof(uint32_t)), mk->sector_size);
+	mk->heap_offset = ROUNDUP((MKIMAGE_FAT_OFFSET + (uint64_t)mk->fat_length * param->num_fats), spc) * spc;
+	if (mk->heap_offset >= mk->vol_length || (mk->vol_length - mk->heap_offset) / spc < 3 ||
+			mk->heap_offset > UINT32_MAX) {
+		pr_err("Volume is too small.\n");
+		return -EINVAL;
+	}
+	mk->cluster_count = MIN((mk->vol_length - mk->heap_offset) / spc, count);
+	mk->vol_length = mk->heap_offset + (uint64_t)mk->cluster_count * spc;
+	mk->next = EXFAT_FIRST_CLUSTER;
+
+	return 0;
+}
+
+/**
+ * @brief Generate sub directories and files
+ * @param [in]  mk image being generated
+ * @param [out] d  dentries of root directory
+ *
+ * @return the number of dentries in root directory (or Negative errno)
+ */
+static ssize_t make_tree(struct mkimage *mk, struct exfat_dentry *d)
+{
+	ssize_t ret = 0;
+	uint64_t i, nr, nr_dirs;
+	uint32_t clu, clusters;
+	size_t n = 0;
+	char name[MAX_NAME_LENGTH + 1];
+	struct exfat_dentry *sub;
+	const struct mkimage_param *param = mk->param;
+
+	if (!param->files_per_dir)
+		return make_files(mk, d, 0, param->files);
+
+	nr_dirs = ROUNDUP(param->files, (uint64_t)param->files_per_dir);
+	clusters = dir_clusters(mk, (uint64_t)param->files_per_dir * 3);
+	if ((sub = malloc((size_t)clusters * mk->cluster_size)) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_dirs; i++) {
+		nr = MIN(param->files_per_dir, param->files - i * param->files_per_dir);
+		clusters = dir_clusters(mk, nr * 3);
+		if ((ret = alloc_clusters(mk, clusters, 0, true, &clu)) != 0)
+			break;
+
+		memset(sub, 0, (size_t)clusters * mk->cluster_size);
+		if ((ret = make_files(mk, sub, i * param->files_per_dir, nr)) < 0)
+			break;
+		if ((ret = write_image(mk, sub, (size_t)clusters * mk->cluster_size,
+						cluster_offset(mk, clu))) != 0)
+			break;
+
+		snprintf(name, sizeof(name), "dir%06lu", i);
+		n += build_dentry_set(d + n, name, ATTR_DIRECTORY, ALLOC_POSSIBLE, clu,
+				(uint64_t)clusters * mk->cluster_size);
+	}
+
+	free(sub);
+	return ret < 0 ? ret : (ssize_t)n;
+}
+
+/**
+ * @brief Generate exFAT image
+ * @param [in] path  output image
+ * @param [in] param geometry and directory tree
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Clusters are allocated in ascending order (Allocation Bitmap,
+ *       Up-case table, root directory, and each sub directory followed by
+ *       its files). File data is never written, so that image stays sparse.
+ *       Each file name is at most 15 characters (3 dentries per file).
+ */
+int make_image(const char *path, const struct mkimage_param *param)
+{
+	int ret;
+	uint8_t i;
+	ssize_t n;
+	size_t upcase_len, root_clusters;
+	uint64_t entries;
+	uint32_t bitmap_clu[2] = {0}, upcase_clu;
+	uint16_t upcase[32];
+	struct exfat_dentry *root = NULL;
+	struct mkimage mk = {.fd = -1, .param = param};
+
+	if ((ret = setup_geometry(&mk)) != 0)
+		return ret;
+
+	mk.bitmap_len = ROUNDUP((uint64_t)mk.cluster_count, CHAR_BIT);
+	mk.bitmap = calloc(1, mk.bitmap_len);
+	mk.fat = calloc(MKIMAGE_FAT_WINDOW, sizeof(uint32_t));
+	entries = 2 + param->num_fats + 3 * (param->files_per_dir ?
+			ROUNDUP(param->files, (uint64_t)param->files_per_dir) : param->files);
+	root_clusters = dir_clusters(&mk, entries);
+	root = calloc(root_clusters, mk.cluster_size);
+	if (!mk.bitmap || !mk.fat || !root) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if ((mk.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		ret = -errno;
+		pr_err("open %s: %s\n", path, strerror(-ret));
+		goto out;
+	}
+	if (ftruncate(mk.fd, (off_t)(mk.vol_length * mk.sector_size)) < 0) {
+		ret = -errno;
+		pr_err("ftruncate %s: %s\n", path, strerror(-ret));
+		goto out;
+	}
+
+	/* Media type and reserved entry */
+	if ((ret = put_fat_entry(&mk, 0, 0xFFFFFFF8)) != 0 ||
+			(ret = put_fat_entry(&mk, 1, EXFAT_LASTCLUSTER)) != 0)
+		goto out;
+
+	for (i = 0; i < param->num_fats; i++) {
+		if ((ret = alloc_clusters(&mk, ROUNDUP(mk.bitmap_len, mk.cluster_size),
+						0, true, &bitmap_clu[i])) != 0)
+			goto out;
+		root[i].type = DENTRY_BITMAP;
+		root[i].dentry.bitmap.flags = i;
+		root[i].dentry.bitmap.start_clu = cpu_to_le32(bitmap_clu[i]);
+		root[i].dentry.bitmap.size = cpu_to_le64(mk.bitmap_len);
+	}
+
+	upcase_len = build_upcase_table(upcase) * sizeof(uint16_t);
+	if ((ret = alloc_clusters(&mk, 1, 0, true, &upcase_clu)) != 0)
+		goto out;
+	if ((ret = write_image(&mk, upcase, upcase_len, cluster_offset(&mk, upcase_clu))) != 0)
+		goto out;
+	root[i].type = DENTRY_UPCASE;
+	root[i].dentry.upcase.checksum = cpu_to_le32(calc_table_checksum(upcase, upcase_len));
+	root[i].dentry.upcase.start_clu = cpu_to_le32(upcase_clu);
+	root[i].dentry.upcase.size = cpu_to_le64(upcase_len);
+
+	if ((ret = alloc_clusters(&mk, root_clusters, 0, true, &mk.root)) != 0)
+		goto out;
+	if ((n = make_tree(&mk, root + i + 1)) < 0) {
+		ret = n;
+		goto out;
+	}
+	if ((ret = write_image(&mk, root, root_clusters * mk.cluster_size,
+					cluster_offset(&mk, mk.root))) != 0)
+		goto out;
+
+	if ((ret = flush_fat_window(&mk)) != 0)
+		goto out;
+	for (i = 0; i < param->num_fats; i++)
+		if ((ret = write_image(&mk, mk.bitmap, mk.bitmap_len,
+						cluster_offset(&mk, bitmap_clu[i]))) != 0)
+			goto out;
+
+	if ((ret = write_boot_region(&mk)) != 0)
+		goto out;
+
+	pr_info("%s: %lu sectors, %u clusters (%u bytes), %lu files, %u%% used\n",
+			path, mk.vol_length, mk.cluster_count, mk.cluster_size,
+			param->files, (uint32_t)((uint64_t)mk.used * 100 / mk.cluster_count));
+out:
+	if (mk.fd >= 0 && close(mk.fd) < 0 && !ret)
+		ret = -errno;
+	free(root);
+	free(mk.fat);
+	free(mk.bitmap);
+
+	return ret;
+}
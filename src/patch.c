@@ -0,0 +1,497 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+#include "endian.h"
+
+/**
+ * magic number in patch file
+ */
+#define PATCH_MAGIC   "BXFPATCH"
+#define PATCH_VERSION 1
+
+/**
+ * Patch file header (all fields are little endian)
+ */
+struct patch_header {
+	char magic[8];       //!< PATCH_MAGIC
+	__le32 version;      //!< PATCH_VERSION
+	__le32 reserved;     //!< must be zero
+	__le64 image_size;   //!< byte size of the source image
+	__le64 source_hash;  //!< hash of the source image (see hash_source())
+	__le64 nr_records;   //!< the number of records
+} __attribute__((packed));
+
+/**
+ * Patch record header, followed by @len bytes
+ */
+struct patch_record_header {
+	__le64 offset;       //!< byte offset in image
+	__le64 len;          //!< byte length
+} __attribute__((packed));
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL  //!< FNV-1a 64bit offset basis
+#define FNV_PRIME        0x100000001B3ULL       //!< FNV-1a 64bit prime
+
+/**
+ * @brief Update FNV-1a hash
+ * @param [in] hash current hash
+ * @param [in] data target data
+ * @param [in] len  byte length
+ *
+ * @return updated hash
+ */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/**
+ * @brief Calculate hash of the source image
+ * @param [in]  fd    source image
+ * @param [in]  align alignment required by @fd (0: none)
+ * @param [in]  size  byte size of source image
+ * @param [in]  rec  patch records
+ * @param [in]  nr   the number of records
+ * @param [out] hash calculated hash
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Hashing whole multi-TB image is too slow, so the hash covers
+ *       image size and original bytes of every patched range. That is
+ *       enough to detect applying to a different or modified image.
+ */
+static int hash_source(int fd, size_t align, off_t size, struct patch_record *rec, size_t nr,
+		uint64_t *hash)
+{
+	size_t i, max = 0;
+	uint64_t h = FNV_OFFSET_BASIS;
+	__le64 le;
+	unsigned char *buf;
+
+	for (i = 0; i < nr; i++)
+		max = MAX(max, rec[i].len);
+	if ((buf = malloc(max + 1)) == NULL)
+		return -ENOMEM;
+
+	le = cpu_to_le64(size);
+	h = fnv1a(h, &le, sizeof(le));
+	for (i = 0; i < nr; i++) {
+		if (pread_direct(fd, buf, rec[i].len, rec[i].offset, align) != rec[i].len) {
+			pr_err("read: %s\n", strerror(errno ? errno : EIO));
+			free(buf);
+			return -EIO;
+		}
+		le = cpu_to_le64(rec[i].offset);
+		h = fnv1a(h, &le, sizeof(le));
+		h = fnv1a(h, buf, rec[i].len);
+	}
+
+	free(buf);
+	*hash = h;
+	return 0;
+}
+
+/**
+ * @brief Create patch
+ * @param [in] path output patch file
+ *
+ * @return created patch (or NULL)
+ */
+struct patch *create_patch(const char *path)
+{
+	struct patch *patch;
+
+	if ((patch = calloc(1, sizeof(struct patch))) == NULL) {
+		pr_err("calloc: %s\n", strerror(errno));
+		return NULL;
+	}
+	if ((patch->path = strdup(path)) == NULL) {
+		free(patch);
+		return NULL;
+	}
+	return patch;
+}
+
+/**
+ * @brief Release patch
+ * @param [in] patch target patch
+ */
+void free_patch(struct patch *patch)
+{
+	size_t i;
+
+	if (!patch)
+		return;
+
+	for (i = 0; i < patch->nr; i++)
+		free(patch->rec[i].data);
+	free(patch->rec);
+	free(patch->path);
+	free(patch);
+}
+
+/**
+ * @brief Record modified data in patch
+ * @param [in] patch  target patch
+ * @param [in] data   modified data
+ * @param [in] offset byte offset in image
+ * @param [in] len    byte length
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Records are kept sorted and never overlap. Overlapping or
+ *       adjacent records are merged, and newer data wins.
+ */
+int patch_write(struct patch *patch, const void *data, off_t offset, size_t len)
+{
+	size_t lo = 0, hi = patch->nr, first, last, i;
+	off_t start = offset, end = offset + len;
+	unsigned char *buf;
+	struct patch_record *rec;
+
+	/* first record that ends at or after @offset */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (patch->rec[mid].offset + (off_t)patch->rec[mid].len < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = last = lo;
+	while (last < patch->nr && patch->rec[last].offset <= end)
+		last++;
+
+	if (first < last) {
+		start = MIN(start, patch->rec[first].offset);
+		end = MAX(end, patch->rec[last - 1].offset + (off_t)patch->rec[last - 1].len);
+	}
+
+	if ((buf = malloc(end - start)) == NULL)
+		return -ENOMEM;
+	for (i = first; i < last; i++) {
+		memcpy(buf + (patch->rec[i].offset - start), patch->rec[i].data, patch->rec[i].len);
+		free(patch->rec[i].data);
+	}
+	memcpy(buf + (offset - start), data, len);
+
+	if (first == last) {
+		if (patch->nr == patch->size) {
+			patch->size = patch->size ? patch->size * 2 : 16;
+			rec = realloc(patch->rec, patch->size * sizeof(struct patch_record));
+			if (!rec) {
+				free(buf);
+				return -ENOMEM;
+			}
+			patch->rec = rec;
+		}
+		memmove(&patch->rec[first + 1], &patch->rec[first],
+				(patch->nr - first) * sizeof(struct patch_record));
+		patch->nr++;
+	} else if (last - first > 1) {
+		memmove(&patch->rec[first + 1], &patch->rec[last],
+				(patch->nr - last) * sizeof(struct patch_record));
+		patch->nr -= last - first - 1;
+	}
+
+	patch->rec[first].offset = start;
+	patch->rec[first].len = end - start;
+	patch->rec[first].data = buf;
+
+	return 0;
+}
+
+/**
+ * @brief Overlay recorded data onto data read from image
+ * @param [in]  patch  target patch
+ * @param [out] data   data read from image
+ * @param [in]  offset byte offset in image
+ * @param [in]  len    byte length
+ */
+void patch_read(struct patch *patch, void *data, off_t offset, size_t len)
+{
+	size_t lo = 0, hi = patch->nr;
+	off_t start, end = offset + len;
+	struct patch_record *rec;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (patch->rec[mid].offset + (off_t)patch->rec[mid].len <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < patch->nr && patch->rec[lo].offset < end; lo++) {
+		rec = &patch->rec[lo];
+		start = MAX(offset, rec->offset);
+		memcpy((char *)data + (start - offset),
+				rec->data + (start - rec->offset),
+				MIN(end, rec->offset + (off_t)rec->len) - start);
+	}
+}
+
+/**
+ * @brief Extract byte ranges actually changed from the source image
+ * @param [in]  fd    source image
+ * @param [in]  align alignment required by @fd (0: none)
+ * @param [in]  patch target patch
+ * @param [out] diff  changed ranges (data points into @patch)
+ * @param [out] nr    the number of changed ranges
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note Caches are written back per sector/cluster, while patterns
+ *       change only a few bytes. Unchanged gaps shorter than a record
+ *       header are kept, since splitting there makes the patch larger.
+ */
+static int diff_patch(int fd, size_t align, struct patch *patch,
+		struct patch_record **diff, size_t *nr)
+{
+	size_t i, pos, start, size = 0, n = 0, max = 0;
+	struct patch_record *rec, *tmp;
+	unsigned char *orig;
+
+	*diff = NULL;
+	*nr = 0;
+
+	for (i = 0; i < patch->nr; i++)
+		max = MAX(max, patch->rec[i].len);
+	if ((orig = malloc(max + 1)) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < patch->nr; i++) {
+		rec = &patch->rec[i];
+		if (pread_direct(fd, orig, rec->len, rec->offset, align) != rec->len) {
+			pr_err("read: %s\n", strerror(errno ? errno : EIO));
+			goto err;
+		}
+
+		for (pos = 0; pos < rec->len; ) {
+			if (rec->data[pos] == orig[pos]) {
+				pos++;
+				continue;
+			}
+			start = pos;
+			while (pos < rec->len) {
+				size_t same = 0;
+
+				while (pos + same < rec->len && rec->data[pos + same] == orig[pos + same])
+					same++;
+				if (pos + same == rec->len || same > sizeof(struct patch_record_header))
+					break;
+				pos += same;
+				while (pos < rec->len && rec->data[pos] != orig[pos])
+					pos++;
+			}
+
+			if (n == size) {
+				size = size ? size * 2 : 16;
+				if ((tmp = realloc(*diff, size * sizeof(struct patch_record))) == NULL)
+					goto err;
+				*diff = tmp;
+			}
+			(*diff)[n].offset = rec->offset + start;
+			(*diff)[n].len = pos - start;
+			(*diff)[n].data = rec->data + start;
+			n++;
+		}
+	}
+
+	free(orig);
+	*nr = n;
+	return 0;
+err:
+	free(orig);
+	free(*diff);
+	*diff = NULL;
+	return -EIO;
+}
+
+/**
+ * @brief Write patch into file
+ * @param [in] sb    Filesystem metadata (source image)
+ * @param [in] patch target patch
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+int save_patch(struct super_block *sb, struct patch *patch)
+{
+	int ret = 0;
+	size_t i, nr;
+	uint64_t hash;
+	FILE *fp;
+	struct patch_header head = {0};
+	struct patch_record_header rh;
+	struct patch_record *diff;
+
+	if ((ret = diff_patch(sb->fd, sb->dio_align, patch, &diff, &nr)) != 0)
+		return ret;
+
+	if ((ret = hash_source(sb->fd, sb->dio_align, sb->total_size, diff, nr, &hash)) != 0)
+		goto out;
+
+	if ((fp = fopen(patch->path, "wb")) == NULL) {
+		pr_err("open: %s: %s\n", patch->path, strerror(errno));
+		ret = -errno;
+		goto out;
+	}
+
+	memcpy(head.magic, PATCH_MAGIC, sizeof(head.magic));
+	head.version = cpu_to_le32(PATCH_VERSION);
+	head.image_size = cpu_to_le64(sb->total_size);
+	head.source_hash = cpu_to_le64(hash);
+	head.nr_records = cpu_to_le64(nr);
+	if (fwrite(&head, sizeof(head), 1, fp) != 1)
+		ret = -EIO;
+
+	for (i = 0; !ret && i < nr; i++) {
+		rh.offset = cpu_to_le64(diff[i].offset);
+		rh.len = cpu_to_le64(diff[i].len);
+		if (fwrite(&rh, sizeof(rh), 1, fp) != 1 ||
+				fwrite(diff[i].data, diff[i].len, 1, fp) != 1)
+			ret = -EIO;
+	}
+
+	if (fclose(fp) || ret) {
+		pr_err("write: %s: %s\n", patch->path, strerror(errno ? errno : EIO));
+		ret = -EIO;
+		goto out;
+	}
+
+	pr_info("Patch: %s (%lu records)\n", patch->path, nr);
+out:
+	free(diff);
+	return ret;
+}
+
+/**
+ * @brief Apply patch file to image
+ * @param [in] path   patch file
+ * @param [in] image  pristine image
+ * @param [in] output output image (NULL: modify @image in place)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+int apply_patch(const char *path, const char *image, const char *output)
+{
+	int ret = 0, fd, src = -1;
+	size_t i;
+	uint64_t hash;
+	FILE *fp;
+	struct stat st;
+	struct patch *patch;
+	struct patch_header head;
+	struct patch_record_header rh;
+	struct patch_record *rec;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		pr_err("open: %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	if (fread(&head, sizeof(head), 1, fp) != 1 ||
+			memcmp(head.magic, PATCH_MAGIC, sizeof(head.magic)) ||
+			le32_to_cpu(head.version) != PATCH_VERSION) {
+		pr_err("%s is not a patch file\n", path);
+		fclose(fp);
+		return -EINVAL;
+	}
+
+	if ((patch = create_patch(path)) == NULL) {
+		fclose(fp);
+		return -ENOMEM;
+	}
+
+	patch->size = patch->nr = le64_to_cpu(head.nr_records);
+	if (patch->nr && (patch->rec = calloc(patch->nr, sizeof(struct patch_record))) == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < patch->nr; i++) {
+		rec = &patch->rec[i];
+		if (fread(&rh, sizeof(rh), 1, fp) != 1) {
+			pr_err("%s is truncated\n", path);
+			ret = -EINVAL;
+			goto out;
+		}
+		rec->offset = le64_to_cpu(rh.offset);
+		rec->len = le64_to_cpu(rh.len);
+		if ((rec->data = malloc(rec->len)) == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (fread(rec->data, rec->len, 1, fp) != 1) {
+			pr_err("%s is truncated\n", path);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if ((fd = open(image, output ? O_RDONLY : O_RDWR)) < 0) {
+		pr_err("open: %s: %s\n", image, strerror(errno));
+		ret = -errno;
+		goto out;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size != le64_to_cpu(head.image_size)) {
+		pr_err("%s doesn't match the source image size\n", image);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+	if ((ret = hash_source(fd, 0, st.st_size, patch->rec, patch->nr, &hash)) != 0)
+		goto close_fd;
+	if (hash != le64_to_cpu(head.source_hash)) {
+		pr_err("%s doesn't match the source image\n", image);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+
+	if (output) {
+		src = fd;
+		if ((fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			pr_err("open: %s: %s\n", output, strerror(errno));
+			ret = -errno;
+			fd = src;
+			goto close_fd;
+		}
+		if ((ret = clone_image(src, fd, st.st_size, 0)) != 0)
+			goto close_fd;
+	}
+
+	for (i = 0; i < patch->nr; i++) {
+		rec = &patch->rec[i];
+		if (pwrite(fd, rec->data, rec->len, rec->offset) != rec->len) {
+			pr_err("write: %s\n", strerror(errno ? errno : EIO));
+			ret = -EIO;
+			break;
+		}
+	}
+
+close_fd:
+	if (src >= 0)
+		close(src);
+	close(fd);
+out:
+	fclose(fp);
+	free_patch(patch);
+	return ret;
+}
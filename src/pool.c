@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+
+/**
+ * job queue owned by one worker
+ */
+struct pool_queue {
+	pthread_mutex_t lock;  //!< protect head and tail
+	size_t *jobs;          //!< job indexes
+	size_t head;           //!< next job to be stolen by other workers
+	size_t tail;           //!< end of jobs (owner pops from here)
+};
+
+/**
+ * thread pool
+ */
+struct pool {
+	struct pool_queue *queue;        //!< queue for each worker
+	unsigned int nr;                 //!< the number of workers
+	int (*func)(void *, size_t);     //!< job function
+	void *arg;                       //!< argument for job function
+	atomic_int ret;                  //!< the first error
+};
+
+/**
+ * worker in thread pool
+ */
+struct pool_worker {
+	struct pool *pool;     //!< thread pool
+	unsigned int id;       //!< index of own queue
+	pthread_t thread;      //!< worker thread
+};
+
+/**
+ * @brief Take the newest job from own queue
+ * @param [in]  q   own queue
+ * @param [out] job job index
+ *
+ * @retval true  job is taken
+ * @retval false queue is empty
+ */
+static bool pop_job(struct pool_queue *q, size_t *job)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*job = q->jobs[--q->tail];
+		found = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return found;
+}
+
+/**
+ * @brief Take the oldest job from other worker's queue
+ * @param [in]  q   victim queue
+ * @param [out] job job index
+ *
+ * @retval true  job is taken
+ * @retval false queue is empty
+ */
+static bool steal_job(struct pool_queue *q, size_t *job)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*job = q->jobs[q->head++];
+		found = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return found;
+}
+
+/**
+ * @brief Run jobs until no job is left in any queue
+ * @param [in] data worker
+ *
+ * @return NULL
+ */
+static void *pool_worker(void *data)
+{
+	int ret, expected;
+	unsigned int i;
+	size_t job;
+	struct pool_worker *worker = data;
+	struct pool *pool = worker->pool;
+
+	while (!atomic_load(&pool->ret)) {
+		if (!pop_job(&pool->queue[worker->id], &job)) {
+			for (i = 1; i < pool->nr; i++)
+				if (steal_job(&pool->queue[(worker->id + i) % pool->nr], &job))
+					break;
+			/* jobs are never added, so all queues are empty */
+			if (i >= pool->nr)
+				break;
+		}
+
+		if ((ret = pool->func(pool->arg, job)) != 0) {
+			expected = 0;
+			atomic_compare_exchange_strong(&pool->ret, &expected, ret);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Run jobs on work-stealing thread pool
+ * @param [in] nr_threads the number of worker threads
+ * @param [in] nr_jobs    the number of jobs
+ * @param [in] func       job function (called with job index 0 ~ nr_jobs - 1)
+ * @param [in] arg        argument for job function
+ *
+ * @retval 0 success
+ * @retval Negative the first error returned by @func
+ *
+ * @note Jobs are spread over per-worker queues in advance. A worker runs
+ *       its own jobs newest first, and steals the oldest job of another
+ *       worker once its queue is empty. No new job is started after
+ *       any job fails. With one thread, jobs run in the caller.
+ */
+int run_pool(unsigned int nr_threads, size_t nr_jobs, int (*func)(void *, size_t), void *arg)
+{
+	int ret = 0;
+	unsigned int i, started;
+	size_t job;
+	struct pool pool;
+	struct pool_worker *workers;
+
+	if (!nr_threads)
+		nr_threads = 1;
+	nr_threads = MIN(nr_threads, MAX(nr_jobs, 1));
+
+	pool.nr = nr_threads;
+	pool.func = func;
+	pool.arg = arg;
+	atomic_init(&pool.ret, 0);
+
+	if ((pool.queue = calloc(nr_threads, sizeof(struct pool_queue))) == NULL)
+		return -ENOMEM;
+	if ((workers = calloc(nr_threads, sizeof(struct pool_worker))) == NULL) {
+		free(pool.queue);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_mutex_init(&pool.queue[i].lock, NULL);
+		if ((pool.queue[i].jobs = calloc(nr_jobs / nr_threads + 1, sizeof(size_t))) == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	/* queue jobs in reverse order so that each worker starts from lower index */
+	for (job = nr_jobs; job-- > 0; ) {
+		struct pool_queue *q = &pool.queue[job % nr_threads];
+
+		q->jobs[q->tail++] = job;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+
+	if (nr_threads == 1) {
+		pool_worker(&workers[0]);
+	} else {
+		for (started = 0; started < nr_threads; started++) {
+			if ((ret = pthread_create(&workers[started].thread, NULL,
+							pool_worker, &workers[started])) != 0) {
+				pr_err("pthread_create: %s\n", strerror(ret));
+				ret = -ret;
+				atomic_store(&pool.ret, ret);
+				break;
+			}
+		}
+		for (i = 0; i < started; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	if (!ret)
+		ret = atomic_load(&pool.ret);
+out:
+	for (i = 0; i < nr_threads; i++) {
+		free(pool.queue[i].jobs);
+		pthread_mutex_destroy(&pool.queue[i].lock);
+	}
+	free(pool.queue);
+	free(workers);
+
+	return ret;
+}
@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include <stddef.h>
+
+#include "exfat.h"
+#include "breakexfat.h"
+
+/**
+ * statistics output format name
+ */
+static const char *stats_format_name[] = {
+	[STATS_NONE] = "none",
+	[STATS_TEXT] = "text",
+	[STATS_JSON] = "json",
+};
+
+/**
+ * scalar counter in struct io_stats
+ */
+struct stats_counter {
+	const char *name;  //!< counter name
+	size_t offset;     //!< offset in struct io_stats
+};
+
+#define STATS_COUNTER(member) {#member, offsetof(struct io_stats, member)}
+
+static const struct stats_counter io_counters[] = {
+	STATS_COUNTER(read_calls),
+	STATS_COUNTER(read_bytes),
+	STATS_COUNTER(write_calls),
+	STATS_COUNTER(write_bytes),
+	STATS_COUNTER(batch_reads),
+	STATS_COUNTER(batch_read_bytes),
+	STATS_COUNTER(batch_writes),
+	STATS_COUNTER(batch_write_bytes),
+	STATS_COUNTER(readahead_hints),
+	STATS_COUNTER(readahead_bytes),
+};
+
+static const struct stats_counter cache_counters[] = {
+	STATS_COUNTER(cache_hits),
+	STATS_COUNTER(cache_misses),
+	STATS_COUNTER(cache_fills),
+	STATS_COUNTER(cache_fill_bytes),
+	STATS_COUNTER(cache_evictions),
+	STATS_COUNTER(cache_writebacks),
+	STATS_COUNTER(cache_writeback_bytes),
+};
+
+#define COUNTER_NUM(c) (sizeof(c) / sizeof(c[0]))
+
+/**
+ * @brief Get value of counter
+ * @param [in] stats   counters
+ * @param [in] counter counter description
+ *
+ * @return counter value
+ */
+static inline uint64_t counter_value(const struct io_stats *stats, const struct stats_counter *counter)
+{
+	return *(const uint64_t *)((const char *)stats + counter->offset);
+}
+
+/**
+ * @brief Convert statistics format name to index
+ * @param [in] name format name
+ *
+ * @return statistics format (or Negative if unknown)
+ */
+int parse_stats_format(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(stats_format_name) / sizeof(stats_format_name[0]); i++)
+		if (!strcmp(name, stats_format_name[i]))
+			return i;
+
+	return -EINVAL;
+}
+
+/**
+ * @brief Take a snapshot of counters
+ * @param [in]  sb    Filesystem metadata
+ * @param [out] stats counters
+ *
+ * @retval 0 success
+ * @retval Negative failed (counters are not enabled)
+ *
+ * @note Counters are enabled by pointing @sb->stats to zeroed struct
+ *       before fill_super(). Counters of variants generated by
+ *       run_break_batch() are added when each variant is released.
+ */
+int get_stats(const struct super_block *sb, struct io_stats *stats)
+{
+	if (!sb || !sb->stats)
+		return -EINVAL;
+
+	*stats = *sb->stats;
+	stats->parent = NULL;
+
+	return 0;
+}
+
+/**
+ * @brief Add counters into other counters
+ * @param [in] dst counters to be added into
+ * @param [in] src counters
+ *
+ * @note @dst may be updated by multiple threads at the same time.
+ */
+void merge_stats(struct io_stats *dst, const struct io_stats *src)
+{
+	size_t i;
+	uint64_t *d = (uint64_t *)dst;
+	const uint64_t *s = (const uint64_t *)src;
+
+	/* all members before parent are uint64_t */
+	for (i = 0; i < offsetof(struct io_stats, parent) / sizeof(uint64_t); i++)
+		if (s[i])
+			__atomic_fetch_add(&d[i], s[i], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Print counters as JSON
+ * @param [in] fp    output stream
+ * @param [in] stats counters
+ */
+static void print_stats_json(FILE *fp, const struct io_stats *stats)
+{
+	size_t i;
+	bool first = true;
+
+	fprintf(fp, "{\"io\":{");
+	for (i = 0; i < COUNTER_NUM(io_counters); i++)
+		fprintf(fp, "%s\"%s\":%lu", i ? "," : "",
+				io_counters[i].name, counter_value(stats, &io_counters[i]));
+	fprintf(fp, "},\"cache\":{");
+	for (i = 0; i < COUNTER_NUM(cache_counters); i++)
+		fprintf(fp, "%s\"%s\":%lu", i ? "," : "",
+				cache_counters[i].name, counter_value(stats, &cache_counters[i]));
+	fprintf(fp, "},\"patterns\":[");
+	for (i = 0; i < count_break_pattern(); i++) {
+		if (!stats->pattern_runs[i])
+			continue;
+		fprintf(fp, "%s{\"index\":%lu,\"name\":\"%s\",\"runs\":%lu,\"ns\":%lu}",
+				first ? "" : ",", i, get_break_pattern_name(i),
+				stats->pattern_runs[i], stats->pattern_ns[i]);
+		first = false;
+	}
+	fprintf(fp, "]}\n");
+}
+
+/**
+ * @brief Print counters as text
+ * @param [in] fp    output stream
+ * @param [in] stats counters
+ */
+static void print_stats_text(FILE *fp, const struct io_stats *stats)
+{
+	size_t i;
+
+	for (i = 0; i < COUNTER_NUM(io_counters); i++)
+		fprintf(fp, "%-24s %lu\n", io_counters[i].name, counter_value(stats, &io_counters[i]));
+	for (i = 0; i < COUNTER_NUM(cache_counters); i++)
+		fprintf(fp, "%-24s %lu\n", cache_counters[i].name, counter_value(stats, &cache_counters[i]));
+	for (i = 0; i < count_break_pattern(); i++)
+		if (stats->pattern_runs[i])
+			fprintf(fp, "pattern %-2lu %-40s %lu runs, %lu ns\n", i, get_break_pattern_name(i),
+					stats->pattern_runs[i], stats->pattern_ns[i]);
+}
+
+/**
+ * @brief Print counters
+ * @param [in] fp     output stream
+ * @param [in] stats  counters
+ * @param [in] format STATS_TEXT or STATS_JSON
+ */
+void print_stats(FILE *fp, const struct io_stats *stats, int format)
+{
+	switch (format) {
+	case STATS_TEXT:
+		print_stats_text(fp, stats);
+		break;
+	case STATS_JSON:
+		print_stats_json(fp, stats);
+		break;
+	default:
+		break;
+	}
+}
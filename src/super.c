@@ -2,10 +2,13 @@
 /*
  *  Copyright (C) 2022 LeavaTail
  */
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "exfat.h"
 #include "breakexfat.h"
@@ -14,7 +17,7 @@
 
 static int read_boot_sector(struct super_block *sb);
 static int verify_boot_sector(struct super_block *sb, struct boot_sector *b);
-static int read_fat_region(struct super_block *sb);
+static int read_root_dentry(struct super_block *sb, uint32_t *chain, size_t len);
 static struct inode *read_root_dir(struct super_block *sb);
 
 /**
@@ -49,8 +52,13 @@ static int read_boot_sector(struct super_block *sb)
 	sb->num_fats = boot->num_fats;
 	sb->heap_offset = le32_to_cpu(boot->clu_offset);
 	sb->root_offset = le32_to_cpu(boot->root_cluster);
+	if (sb->num_fats == 2 && (le16_to_cpu(boot->vol_flags) & ACTIVE_FAT)) {
+		sb->active_fat = 1;
+		sb->active_bitmap = 1;
+	}
 
-	sb->sector_list = init_list_head(create_sector_cache(sb, 0, 1));
+	if (add_cache(sb, create_sector_cache(sb, 0, 1)))
+		ret = -EIO;
 out:
 	free(boot);
 
@@ -90,26 +98,47 @@ static int verify_boot_sector(struct super_block *sb, struct boot_sector *b)
 }
 
 /**
- * @brief Read FAT region
- * @param [in] sb Filesystem metadata
+ * @brief Read critical primary directory entries in root directory
+ * @param [in] sb    Filesystem metadata
+ * @param [in] chain clusters of root directory
+ * @param [in] len   the number of clusters
  *
  * @retval 0 success
  * @retval Negative failed
  */
-static int read_fat_region(struct super_block *sb)
+static int read_root_dentry(struct super_block *sb, uint32_t *chain, size_t len)
 {
-	struct cache *fat1, *fat2;
-
-	if ((fat1 = create_sector_cache(sb, sb->fat_offset, sb->fat_length)) == NULL)
-		return -EINVAL;
-	list_add_tail(sb->sector_list, fat1);
-
-	if (sb->num_fats == 1)
-		return 0;
-
-	if ((fat2 = create_sector_cache(sb, sb->fat_offset + sb->fat_length, sb->fat_length)) == NULL)
-		return -EINVAL;
-	list_add_tail(sb->sector_list, fat2);
+	size_t i, j;
+	size_t dentries = sb->cluster_size / sizeof(struct exfat_dentry);
+	struct cache *cache;
+	struct exfat_dentry *d;
+
+	for (i = 0; i < len; i++) {
+		if ((cache = get_cluster_cache(sb, chain[i])) == NULL)
+			return -EIO;
+		for (j = 0; j < dentries; j++) {
+			d = (struct exfat_dentry *)cache->data + j;
+			switch (d->type) {
+			case DENTRY_UNUSED:
+				return 0;
+			case DENTRY_BITMAP:
+				if (d->dentry.bitmap.flags & BIT(0)) {
+					sb->alloc_second = le32_to_cpu(d->dentry.bitmap.start_clu);
+				} else {
+					sb->alloc_offset = le32_to_cpu(d->dentry.bitmap.start_clu);
+					sb->alloc_length = le64_to_cpu(d->dentry.bitmap.size);
+				}
+				break;
+			case DENTRY_UPCASE:
+				sb->upcase_offset = le32_to_cpu(d->dentry.upcase.start_clu);
+				sb->upcase_size = le64_to_cpu(d->dentry.upcase.size);
+				sb->upcase_checksum = le32_to_cpu(d->dentry.upcase.checksum);
+				break;
+			default:
+				break;
+			}
+		}
+	}
 
 	return 0;
 }
@@ -124,36 +153,103 @@ static int read_fat_region(struct super_block *sb)
 static struct inode *read_root_dir(struct super_block *sb)
 {
 	struct inode *root;
-	uint32_t clu, next;
+	uint32_t clu, next, run;
+	uint32_t *chain = NULL, *tmp;
+	size_t len = 0, size = 0;
 
-	root = alloc_inode(sb);
+	root = alloc_root_inode(sb);
 	if (!root) {
 		pr_warn("Failed to allocate inode.\n");
 		return NULL;
 	}
 
-	strncpy(root->name, "/", strlen("/") + 1);
-	root->name_len = 1;
-	root->clu = sb->root_offset;
-	root->flags = 0;
-
 	clu = sb->root_offset;
 
+	/* Resolve cluster chain by each run first, and then read all clusters at once */
 	do {
-		sb->cluster_list = init_list_head(create_cluster_cache(sb, sb->root_offset, 1));
-		if (get_next_cluster(sb, root, clu, &next))
+		if (get_cluster_run(sb, root, clu, &run, &next))
 			goto err;
+		if (len + run > sb->cluster_count) {
+			pr_err("Cluster chain of root directory is looped.\n");
+			goto err;
+		}
+		if (len + run > size) {
+			size = MAX(size * 2, len + run);
+			if ((tmp = realloc(chain, size * sizeof(uint32_t))) == NULL)
+				goto err;
+			chain = tmp;
+		}
+		while (run--)
+			chain[len++] = clu++;
 		clu = next;
-
 	} while (clu != EXFAT_LASTCLUSTER);
 
+	if (prefetch_cluster_cache(sb, chain, len))
+		goto err;
+
+	if (read_root_dentry(sb, chain, len))
+		goto err;
+
+	free(chain);
 	return root;
 
 err:
-	free_inode(root);
+	free(chain);
+	free_inode(sb, root);
 	return NULL;
 }
 
+/**
+ * @brief Get size and I/O alignment of opened image
+ * @param [in] sb Filesystem metadata
+ * @param [in] st status of image
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note st_size of block device is 0, so its size is taken by BLKGETSIZE64.
+ *       O_DIRECT I/O is aligned to logical block size of block device, or
+ *       to preferred I/O size (up to page size) of regular file.
+ */
+static int get_image_size(struct super_block *sb, const struct stat *st)
+{
+	int lbs;
+	uint64_t size;
+	long page = sysconf(_SC_PAGESIZE);
+
+	sb->total_size = st->st_size;
+	sb->dio_align = 0;
+
+	if (S_ISBLK(st->st_mode)) {
+		if (ioctl(sb->fd, BLKGETSIZE64, &size) < 0) {
+			pr_err("BLKGETSIZE64: %s\n", strerror(errno));
+			return -errno;
+		}
+		sb->total_size = size;
+	}
+
+	if (!(sb->opt & BIT(OPT_DIRECT)))
+		return 0;
+
+	if (page <= 0)
+		page = 4096;
+	if (S_ISBLK(st->st_mode)) {
+		if (ioctl(sb->fd, BLKSSZGET, &lbs) < 0) {
+			pr_err("BLKSSZGET: %s\n", strerror(errno));
+			return -errno;
+		}
+		sb->dio_align = lbs;
+	} else {
+		sb->dio_align = MIN(MAX(st->st_blksize, EXFAT_SECTOR_MIN), page);
+	}
+	/* alignment is used as bit mask */
+	if (!sb->dio_align || (sb->dio_align & (sb->dio_align - 1)))
+		sb->dio_align = page;
+
+	pr_info("O_DIRECT alignment: %lu bytes\n", sb->dio_align);
+	return 0;
+}
+
 /**
  * @brief Initialize super block
  * @param [out] sb   Filesystem metadata
@@ -161,10 +257,13 @@ err:
  *
  * @retval 0 success
  * @retval Negative failed
+ *
+ * @note With OPT_DIRECT, image is opened with O_DIRECT. If the filesystem
+ *       doesn't support it, buffered I/O is used instead.
  */
 int fill_super(struct super_block *sb, const char *name)
 {
-	int ret = 0;
+	int ret = 0, flags;
 	struct stat stat;
 	struct inode *root;
 
@@ -172,8 +271,17 @@ int fill_super(struct super_block *sb, const char *name)
 		return -EINVAL;
 
 	sb->sector_size = 512;
+	flags = (sb->opt & BIT(OPT_READONLY)) ? O_RDONLY : O_RDWR;
 
-	if ((sb->fd = open(name, O_RDWR)) < 0) {
+	if (sb->opt & BIT(OPT_DIRECT)) {
+		if ((sb->fd = open(name, flags | O_DIRECT)) < 0 && errno == EINVAL) {
+			pr_warn("O_DIRECT isn't supported, fall back to buffered I/O\n");
+			sb->opt &= ~BIT(OPT_DIRECT);
+		}
+	}
+	if (!(sb->opt & BIT(OPT_DIRECT)))
+		sb->fd = open(name, flags);
+	if (sb->fd < 0) {
 		pr_err("open: %s\n", strerror(errno));
 		return -errno;
 	}
@@ -183,15 +291,14 @@ int fill_super(struct super_block *sb, const char *name)
 		ret = -errno;
 		goto err;
 	}
-	sb->total_size = stat.st_size;
+	if ((ret = get_image_size(sb, &stat)) != 0)
+		goto err;
 	sb->alloc_second = 0;
 
-	if ((ret = read_boot_sector(sb)) != 0) {
+	if ((ret = setup_io(sb)) != 0)
 		goto err;
-	}
 
-	if ((ret = read_fat_region(sb)) != 0) {
-		pr_err("Failed to load FAT\n");
+	if ((ret = read_boot_sector(sb)) != 0) {
 		goto err;
 	}
 
@@ -201,79 +308,138 @@ int fill_super(struct super_block *sb, const char *name)
 		goto err_put;
 	}
 
-	sb->inodes = init_list_head(root);
+	/* directory tree is read by get_dir_tree() at first use */
+	sb->inodes = &root->list;
 
 	return 0;
 
 err_put:
+	free_all_inodes(sb);
+	free_fat_table(sb);
 	remove_cache_list(sb, sb->sector_list);
+	remove_cache_list(sb, sb->cluster_list);
+	sb->sector_list = NULL;
+	sb->cluster_list = NULL;
 err:
+	cleanup_io(sb);
 	close(sb->fd);
 	return ret;
 }
 
 /**
- * @brief put_super super_block
- * @param [in] sb Filesystem metadata
+ * @brief Initialize super block for a copy of the parsed image
+ * @param [out] sb   Filesystem metadata
+ * @param [in]  base Filesystem metadata of the original image
+ * @param [in]  fd    opened file for the copy
+ * @param [in]  patch record modification in patch (NULL: write @fd)
  *
  * @retval 0 success
  * @retval Negative failed
+ *
+ * @note Geometry is taken over from @base, caches and inodes are not.
+ *       @fd and @patch are released by put_super(). If it failed, nothing
+ *       is left allocated in @sb, and caller releases @fd and @patch.
  */
-int put_super(struct super_block *sb)
+int clone_super(struct super_block *sb, const struct super_block *base, int fd,
+		struct patch *patch)
 {
-	if (!sb)
+	int ret;
+
+	if (!sb || !base)
 		return -EINVAL;
 
-	remove_cache_list(sb, sb->sector_list);
-	remove_cache_list(sb, sb->cluster_list);
+	*sb = *base;
+	sb->fd = fd;
+	sb->patch = patch;
+	if (!patch) {
+		/* variant writes into its own image opened without O_DIRECT */
+		sb->opt &= ~(BIT(OPT_READONLY) | BIT(OPT_DIRECT));
+		sb->dio_align = 0;
+	}
+	sb->patterns = 0;
+	sb->inodes = NULL;
+	sb->arena = NULL;
+	sb->tree_loaded = false;
+	sb->sector_list = NULL;
+	sb->cluster_list = NULL;
+	sb->cache_index = NULL;
+	/*
+	 * FAT and Allocation Bitmap are copied when the variant modifies them.
+	 * FAT partially loaded, or whose extents aren't built yet, is changed
+	 * by reading, so it can't be shared. The variant loads own one.
+	 */
+	if (!is_fat_table_loaded(sb) || sb->fat->stale)
+		sb->fat = NULL;
+	sb->fat_shared = sb->fat != NULL;
+	sb->bitmap_shared = sb->bitmap != NULL;
+	sb->upcase_shared = sb->upcase != NULL;
+	sb->lru_head = NULL;
+	sb->lru_tail = NULL;
+	sb->cache_size = 0;
+	/* variant counts by itself, and adds them into @base at put_super() */
+	if (base->stats) {
+		if ((sb->stats = calloc(1, sizeof(struct io_stats))) == NULL)
+			return -ENOMEM;
+		sb->stats->parent = base->stats;
+	}
 
-	if (sb->fd)
-		close(sb->fd);
+	/* put_super() isn't called for the variant failed to clone */
+	if ((ret = setup_io(sb)) != 0 && base->stats) {
+		free(sb->stats);
+		sb->stats = NULL;
+	}
 
-	return 0;
+	return ret;
 }
 
 /**
- * @brief allocate inode
+ * @brief put_super super_block
  * @param [in] sb Filesystem metadata
  *
- * @return allocated inode (or NULL)
+ * @retval 0 success
+ * @retval Negative failed (e.g. modified data couldn't be written back)
+ *
+ * @note Everything is released even if it failed.
  */
-struct inode *alloc_inode(struct super_block *sb)
+int put_super(struct super_block *sb)
 {
-	struct inode *inode;
-	time_t now = time(NULL);
-
-	if ((inode = calloc(1, sizeof(struct inode))) == NULL)
-		return NULL;
+	int ret, err;
 
-	if ((inode->name = malloc(sizeof(char) * (MAX_NAME_LENGTH + 1))) == NULL)
-		return NULL;
+	if (!sb)
+		return -EINVAL;
 
-	localtime_r(&now, &inode->mtime);
-	localtime_r(&now, &inode->atime);
-	localtime_r(&now, &inode->ctime);
-	inode->refcount = 1;
+	free_all_inodes(sb);
+	ret = flush_fat_table(sb);
+	free_fat_table(sb);
+	if ((err = flush_alloc_bitmap(sb)) != 0 && !ret)
+		ret = err;
+	free_alloc_bitmap(sb);
+	free_upcase_table(sb);
+
+	if ((err = remove_cache_list(sb, sb->sector_list)) != 0 && !ret)
+		ret = err;
+	if ((err = remove_cache_list(sb, sb->cluster_list)) != 0 && !ret)
+		ret = err;
+	sb->sector_list = NULL;
+	sb->cluster_list = NULL;
+
+	if (sb->patch) {
+		/* patch is the only output with -p */
+		if ((err = save_patch(sb, sb->patch)) != 0 && !ret)
+			ret = err;
+		free_patch(sb->patch);
+		sb->patch = NULL;
+	}
 
-	return inode;
-}
+	cleanup_io(sb);
+	if (sb->fd)
+		close(sb->fd);
 
-/**
- * @brief release inode
- * @param [in] inode file/directory
- *
- * @retval 0 success
- * @retval Negative failed
- */
-int free_inode(struct inode *inode)
-{
-	if (inode->refcount) {
-		pr_warn("other inodes are used by this inode(%p)\n", inode);
-		return -EINVAL;
+	if (sb->stats && sb->stats->parent) {
+		merge_stats(sb->stats->parent, sb->stats);
+		free(sb->stats);
+		sb->stats = NULL;
 	}
 
-	free(inode->name);
-	free(inode);
-
-	return 0;
+	return ret;
 }
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  Copyright (C) 2022 LeavaTail
+ */
+#include "exfat.h"
+#include "breakexfat.h"
+#include "endian.h"
+
+/**
+ * @brief Expand Up-case table on disk into lookup table
+ * @param [in]  data  Up-case table on disk
+ * @param [in]  len   the number of entries in @data
+ * @param [out] table Up-case table (UPCASE_TABLE_LEN entries, identity mapped)
+ *
+ * @note 0xFFFF followed by N means that the following N characters are
+ *       identity mapping (compressed form). An entry equal to its own index
+ *       is taken as identity mapping first, so that U+FFFF can map itself.
+ */
+static void expand_upcase_table(const __le16 *data, size_t len, uint16_t *table)
+{
+	size_t i;
+	uint32_t index = 0;
+	uint16_t c;
+	bool skip = false;
+
+	for (i = 0; i < len && index < UPCASE_TABLE_LEN; i++) {
+		c = le16_to_cpu(data[i]);
+		if (skip) {
+			index += c;
+			skip = false;
+		} else if (c == index) {
+			index++;
+		} else if (c == 0xFFFF) {
+			skip = true;
+		} else {
+			table[index++] = c;
+		}
+	}
+}
+
+/**
+ * @brief Read Up-case table on disk
+ * @param [in]  sb   Filesystem metadata
+ * @param [out] data Up-case table on disk (rounded up to cluster size)
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ */
+static int read_upcase_table(struct super_block *sb, void *data)
+{
+	int ret;
+	uint32_t clu, len, next;
+	size_t nr = ROUNDUP((size_t)sb->upcase_size, sb->cluster_size), pos = 0;
+	struct inode inode = {0};
+
+	/* read the table by each run of contiguous clusters */
+	inode.clu = sb->upcase_offset;
+	for (clu = inode.clu; pos < nr; clu = next) {
+		if ((ret = validate_cluster(sb, clu)) != 0)
+			return ret;
+		if ((ret = get_cluster_run(sb, &inode, clu, &len, &next)) != 0)
+			return ret;
+		len = MIN(len, nr - pos);
+		if ((ret = get_cluster(sb, (char *)data + pos * sb->cluster_size, clu, len)) != 0)
+			return ret;
+		pos += len;
+		if (pos < nr && next == EXFAT_LASTCLUSTER) {
+			pr_err("Cluster chain of Up-case table is too short.\n");
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Load Up-case table into memory
+ * @param [in] sb Filesystem metadata
+ *
+ * @retval 0 success
+ * @retval Negative failed
+ *
+ * @note @sb->upcase is available even if it failed. In that case, only
+ *       "a" - "z" are up-cased. The table is never modified, so that
+ *       variants share it if the original image has loaded it.
+ */
+int load_upcase_table(struct super_block *sb)
+{
+	int ret = 0;
+	uint32_t c, checksum;
+	uint16_t *table;
+	__le16 *data = NULL;
+
+	if ((table = malloc(UPCASE_TABLE_LEN * sizeof(uint16_t))) == NULL)
+		return -ENOMEM;
+	for (c = 0; c < UPCASE_TABLE_LEN; c++)
+		table[c] = c;
+
+	if (!sb->upcase_offset) {
+		pr_warn("Up-case table isn't found.\n");
+		ret = -ENOENT;
+		goto out;
+	}
+	if (!sb->upcase_size || sb->upcase_size % sizeof(uint16_t) ||
+			sb->upcase_size > UPCASE_TABLE_LEN * sizeof(uint16_t)) {
+		pr_warn("Up-case table has invalid size (%u).\n", sb->upcase_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if ((data = malloc(ROUNDUP((size_t)sb->upcase_size, sb->cluster_size) *
+					sb->cluster_size)) == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if ((ret = read_upcase_table(sb, data)) != 0)
+		goto out;
+
+	checksum = calc_table_checksum(data, sb->upcase_size);
+	if (checksum != sb->upcase_checksum) {
+		pr_warn("TableChecksum of Up-case table is mismatched (%08x != %08x).\n",
+				checksum, sb->upcase_checksum);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	expand_upcase_table(data, sb->upcase_size / sizeof(uint16_t), table);
+out:
+	/* fall back to minimum mapping, same as calc_name_hash() without table */
+	if (ret)
+		for (c = 'a'; c <= 'z'; c++)
+			table[c] = c - 'a' + 'A';
+	free(data);
+	sb->upcase = table;
+	sb->upcase_shared = false;
+	return ret;
+}
+
+/**
+ * @brief Get Up-case table (load it at first use)
+ * @param [in] sb Filesystem metadata
+ *
+ * @return Up-case table (NULL: ASCII only)
+ *
+ * @note Only NameHash needs the table, so that it isn't loaded at mount.
+ */
+const uint16_t *get_upcase_table(struct super_block *sb)
+{
+	if (!sb->upcase)
+		load_upcase_table(sb);
+
+	return sb->upcase;
+}
+
+/**
+ * @brief Release Up-case table
+ * @param [in] sb Filesystem metadata
+ */
+void free_upcase_table(struct super_block *sb)
+{
+	if (!sb->upcase_shared)
+		free(sb->upcase);
+	sb->upcase = NULL;
+	sb->upcase_shared = false;
+}
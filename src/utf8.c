@@ -2,156 +2,397 @@
 /*
  *  Copyright (C) 2021 LeavaTail
  */
-#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "utf8.h"
 
+/**
+ * @brief Get smaller length
+ */
+static inline size_t min_len(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
+
+/**
+ * @brief Copy leading ASCII characters from UTF-8 to UTF-16
+ * @param [in]  src UTF-8 characters
+ * @param [out] dst UTF-16 characters
+ * @param [in]  len the maximum number of characters
+ *
+ * @return the number of copied characters
+ *
+ * @note Eight bytes are tested at once, and the rest is copied one by one.
+ */
+static size_t ascii_utf8_to_utf16_generic(const unsigned char *src, uint16_t *dst, size_t len)
+{
+	size_t i, j;
+	uint64_t word;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&word, src + i, sizeof(word));
+		if (word & 0x8080808080808080ULL)
+			break;
+		for (j = 0; j < 8; j++)
+			dst[i + j] = src[i + j];
+	}
+	for (; i < len && src[i] < 0x80; i++)
+		dst[i] = src[i];
+
+	return i;
+}
+
+/**
+ * @brief Copy leading ASCII characters from UTF-16 to UTF-8
+ * @param [in]  src UTF-16 characters
+ * @param [out] dst UTF-8 characters
+ * @param [in]  len the maximum number of characters
+ *
+ * @return the number of copied characters
+ */
+static size_t ascii_utf16_to_utf8_generic(const uint16_t *src, unsigned char *dst, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && src[i] < 0x80; i++)
+		dst[i] = (unsigned char)src[i];
+
+	return i;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/**
+ * @brief Copy leading ASCII characters from UTF-8 to UTF-16 by SSE2
+ * @param [in]  src UTF-8 characters
+ * @param [out] dst UTF-16 characters
+ * @param [in]  len the maximum number of characters
+ *
+ * @return the number of copied characters
+ *
+ * @note SSE2 is always available on x86_64.
+ */
+static size_t ascii_utf8_to_utf16_sse2(const unsigned char *src, uint16_t *dst, size_t len)
+{
+	size_t i;
+	__m128i v, zero = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		if (_mm_movemask_epi8(v))
+			break;
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(v, zero));
+	}
+
+	return i + ascii_utf8_to_utf16_generic(src + i, dst + i, len - i);
+}
+
+/**
+ * @brief Copy leading ASCII characters from UTF-16 to UTF-8 by SSE2
+ * @param [in]  src UTF-16 characters
+ * @param [out] dst UTF-8 characters
+ * @param [in]  len the maximum number of characters
+ *
+ * @return the number of copied characters
+ */
+static size_t ascii_utf16_to_utf8_sse2(const uint16_t *src, unsigned char *dst, size_t len)
+{
+	size_t i;
+	__m128i v0, v1, mask = _mm_set1_epi16((short)0xFF80), zero = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v0 = _mm_loadu_si128((const __m128i *)(src + i));
+		v1 = _mm_loadu_si128((const __m128i *)(src + i + 8));
+		/* any character above U+007F */
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(v0, v1), mask),
+						zero)) != 0xFFFF)
+			break;
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(v0, v1));
+	}
+
+	return i + ascii_utf16_to_utf8_generic(src + i, dst + i, len - i);
+}
+
+/**
+ * @brief Copy leading ASCII characters from UTF-8 to UTF-16 by AVX2
+ * @param [in]  src UTF-8 characters
+ * @param [out] dst UTF-16 characters
+ * @param [in]  len the maximum number of characters
+ *
+ * @return the number of copied characters
+ */
+__attribute__((target("avx2")))
+static size_t ascii_utf8_to_utf16_avx2(const unsigned char *src, uint16_t *dst, size_t len)
+{
+	size_t i;
+	__m256i v;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		if (_mm256_movemask_epi8(v))
+			break;
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				_mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+		_mm256_storeu_si256((__m256i *)(dst + i + 16),
+				_mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+	}
+	/* avoid AVX-SSE transition penalty in the rest */
+	_mm256_zeroupper();
+
+	return i + ascii_utf8_to_utf16_sse2(src + i, dst + i, len - i);
+}
+
+/**
+ * @brief Copy leading ASCII characters from UTF-16 to UTF-8 by AVX2
+ * @param [in]  src UTF-16 characters
+ * @param [out] dst UTF-8 characters
+ * @param [in]  len the maximum number of characters
+ *
+ * @return the number of copied characters
+ *
+ * @note VPACKUSWB packs within 128-bit lanes, so 64-bit blocks are reordered.
+ */
+__attribute__((target("avx2")))
+static size_t ascii_utf16_to_utf8_avx2(const uint16_t *src, unsigned char *dst, size_t len)
+{
+	size_t i;
+	__m256i v0, v1, mask = _mm256_set1_epi16((short)0xFF80);
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v0 = _mm256_loadu_si256((const __m256i *)(src + i));
+		v1 = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+		if (!_mm256_testz_si256(_mm256_or_si256(v0, v1), mask))
+			break;
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				_mm256_permute4x64_epi64(_mm256_packus_epi16(v0, v1), 0xD8));
+	}
+	/* avoid AVX-SSE transition penalty in the rest */
+	_mm256_zeroupper();
+
+	return i + ascii_utf16_to_utf8_sse2(src + i, dst + i, len - i);
+}
+#endif
+
+/**
+ * @brief Copy leading ASCII characters from UTF-8 to UTF-16
+ * @param [in]  src UTF-8 characters
+ * @param [out] dst UTF-16 characters
+ * @param [in]  len the maximum number of characters
+ *
+ * @return the number of copied characters
+ */
+static size_t ascii_utf8_to_utf16(const unsigned char *src, uint16_t *dst, size_t len)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return ascii_utf8_to_utf16_avx2(src, dst, len);
+	return ascii_utf8_to_utf16_sse2(src, dst, len);
+#else
+	return ascii_utf8_to_utf16_generic(src, dst, len);
+#endif
+}
+
+/**
+ * @brief Copy leading ASCII characters from UTF-16 to UTF-8
+ * @param [in]  src UTF-16 characters
+ * @param [out] dst UTF-8 characters
+ * @param [in]  len the maximum number of characters
+ *
+ * @return the number of copied characters
+ */
+static size_t ascii_utf16_to_utf8(const uint16_t *src, unsigned char *dst, size_t len)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return ascii_utf16_to_utf8_avx2(src, dst, len);
+	return ascii_utf16_to_utf8_sse2(src, dst, len);
+#else
+	return ascii_utf16_to_utf8_generic(src, dst, len);
+#endif
+}
+
 /**
  * @brief convert UTF-8 character to UTF-32
- * @param [in]  u UTF-8 character
- * @param [out] d UTF-32 character
+ * @param [in]  u   UTF-8 character
+ * @param [in]  len remaining bytes in @u
+ * @param [out] d   UTF-32 character
  *
- * @return Byte size in UTF-32
+ * @return Byte size in UTF-8 (or -EILSEQ if invalid sequence)
+ *
+ * @note Overlong forms, surrogates and truncated sequences are rejected.
  */
-int utf8_to_utf32(unsigned char *u, uint32_t *d)
+static int utf8_to_utf32(const unsigned char *u, size_t len, uint32_t *d)
 {
-	int len = 0;
+	int i, size;
 	unsigned char c = *u;
+	uint32_t w;
+	static const uint32_t min[] = {0, 0, 0x80, 0x800, 0x10000};
 
-	/* 1 byte character   0x10?????? */
-	if ((c & 0x80) == 0x00) {
+	/* 1 byte character   0x0??????? */
+	if (c < 0x80) {
 		*d = c;
-		len = 1;
+		return 1;
 	/* 2 bytes character  0x110????? 0x10?????? */
 	} else if ((c & 0xE0) == 0xC0) {
-		*d =  (*u & 0x1F) << 6;
-		*d |= (*(u + 1) & 0x3F);
-		len = 2;
-	/* 3 bytes character  0x1110???? 0x10?????? 0x10??????*/
+		w = c & 0x1F;
+		size = 2;
+	/* 3 bytes character  0x1110???? 0x10?????? 0x10?????? */
 	} else if ((c & 0xF0) == 0xE0) {
-		*d =  (*u & 0x0F) << 12;
-		*d |= (*(u + 1) & 0x3F) << 6;
-		*d |= (*(u + 2) & 0x3F);
-		len = 3;
-	/* 4 bytes character  0x11110??? 0x10?????? 0x10?????? 0x10??????*/
+		w = c & 0x0F;
+		size = 3;
+	/* 4 bytes character  0x11110??? 0x10?????? 0x10?????? 0x10?????? */
 	} else if ((c & 0xF8) == 0xF0) {
-		*d =  (*u & 0x07) << 18;
-		*d |= (*(u + 1) & 0x3F) << 12;
-		*d |= (*(u + 2) & 0x3F) << 6;
-		*d |= (*(u + 3) & 0x3F);
-		len = 4;
+		w = c & 0x07;
+		size = 4;
 	} else {
-		fprintf(stderr, "Unexpected sequences %02x.\n", c);
+		return -EILSEQ;
 	}
-	return len;
+
+	if (len < size)
+		return -EILSEQ;
+	for (i = 1; i < size; i++) {
+		if ((u[i] & 0xC0) != 0x80)
+			return -EILSEQ;
+		w = (w << 6) | (u[i] & 0x3F);
+	}
+	if (w < min[size] || w > UNICODE_MAX || IS_SURROGATE(w))
+		return -EILSEQ;
+
+	*d = w;
+	return size;
 }
 
 /**
  * @brief convert UTF-32 character to UTF-8
- * @param [in]  u  UTF-32 character
- * @param [out] d  UTF-8 character
+ * @param [in]  u   UTF-32 character
+ * @param [out] d   UTF-8 character
+ * @param [in]  len remaining bytes in @d
  *
- * @return Byte size in UTF-8
+ * @return Byte size in UTF-8 (or -ENAMETOOLONG if @d is too short)
  */
-int utf32_to_utf8(uint32_t u, unsigned char *d)
+static int utf32_to_utf8(uint32_t u, unsigned char *d, size_t len)
 {
-	int len = 0;
-
-	if (u < 0x7f) {
-		*d = (unsigned char)u;
-		len = 1;
-	} else if (u < 0x7FF) {
-		*d++ = (0xC0 | (u >> 6));
-		*d++ = (0x80 | (u & 0x3F));
-		len = 2;
-	} else if (u < 0xFFFF) {
-		*d++ = (0xE0 | (u >> 12));
-		*d++ = (0x80 | ((u >> 6) & 0x3f));
-		*d++ = (0x80 | (u & 0x3F));
-		len = 3;
-	} else if (u < 0x10FFFF) {
-		*d++ = (0xF0 | (u >> 18));
-		*d++ = (0x80 | ((u >> 12) & 0x3f));
-		*d++ = (0x80 | ((u >> 6) & 0x3f));
-		*d++ = (0x80 | (u & 0x3F));
-		len = 4;
-	} else {
-		fprintf(stderr, "can't convert to U+%04x.\n", u);
+	if (u < 0x80) {
+		if (len < 1)
+			return -ENAMETOOLONG;
+		d[0] = (unsigned char)u;
+		return 1;
+	} else if (u < 0x800) {
+		if (len < 2)
+			return -ENAMETOOLONG;
+		d[0] = 0xC0 | (u >> 6);
+		d[1] = 0x80 | (u & 0x3F);
+		return 2;
+	} else if (u < 0x10000) {
+		if (len < 3)
+			return -ENAMETOOLONG;
+		d[0] = 0xE0 | (u >> 12);
+		d[1] = 0x80 | ((u >> 6) & 0x3F);
+		d[2] = 0x80 | (u & 0x3F);
+		return 3;
 	}
-	return len;
+
+	if (len < 4)
+		return -ENAMETOOLONG;
+	d[0] = 0xF0 | (u >> 18);
+	d[1] = 0x80 | ((u >> 12) & 0x3F);
+	d[2] = 0x80 | ((u >> 6) & 0x3F);
+	d[3] = 0x80 | (u & 0x3F);
+	return 4;
 }
 
 /**
  * @brief convert UTF-8 characters to UTF-16
- * @param [in]  src     UTF-8 characters
- * @param [in]  namelen UTF-8 characters length
- * @param [out] dist    UTF-16 characters
+ * @param [in]  src  UTF-8 characters
+ * @param [in]  len  UTF-8 characters length (bytes)
+ * @param [out] dist UTF-16 characters
+ * @param [in]  size the maximum number of UTF-16 characters in @dist
+ *
+ * @return the number of UTF-16 characters
+ * @retval -EILSEQ      @src isn't valid UTF-8
+ * @retval -ENAMETOOLONG @dist is too short
  *
- * @return byte size in UTF-16
+ * @note Characters above U+FFFF are converted into surrogate pair.
  */
-int utf8s_to_utf16s(unsigned char *src, uint16_t namelen, uint16_t* dist)
+int utf8s_to_utf16s(const unsigned char *src, size_t len, uint16_t *dist, size_t size)
 {
-	int size = 0, len = 0, out_len = 0;
-	unsigned char *u = src;
+	int n;
+	size_t i = 0, out = 0;
 	uint32_t w;
 
-	while (len < namelen) {
-		u = src + len;
-		w = (uint32_t)*u;
-		size = utf8_to_utf32(u, &w);
+	while (i < len) {
+		if (src[i] < 0x80) {
+			n = ascii_utf8_to_utf16(src + i, dist + out, min_len(len - i, size - out));
+			if (!n)
+				return -ENAMETOOLONG;
+			i += n;
+			out += n;
+			continue;
+		}
+
+		if ((n = utf8_to_utf32(src + i, len - i, &w)) < 0)
+			return n;
+		i += n;
+
 		if (w <= 0xFFFF) {
-			*(dist + out_len) = w;
-			len += size;
-			out_len ++;
-		} else if (w <= UNICODE_MAX) {
-			/* TODO: Implement surrogate pair */
-			return 0;
+			if (out + 1 > size)
+				return -ENAMETOOLONG;
+			dist[out++] = w;
 		} else {
-			fprintf(stderr, "Unicode doesn't support. (%0x)\n", w);
-			return 0;
+			if (out + 2 > size)
+				return -ENAMETOOLONG;
+			w -= 0x10000;
+			dist[out++] = SURROGATE_PAIR_UPPER | (w >> 10);
+			dist[out++] = SURROGATE_PAIR_LOWER | (w & 0x3FF);
 		}
 	}
-	return out_len;
+	return out;
 }
 
 /**
  * @brief convert UTF-16 characters to UTF-8
- * @param [in]  src     UTF-16 characters
- * @param [in]  namelen UTF-16 characters length
- * @param [out] dist    UTF-8 characters
+ * @param [in]  src  UTF-16 characters
+ * @param [in]  len  UTF-16 characters length
+ * @param [out] dist UTF-8 characters
+ * @param [in]  size the maximum number of bytes in @dist
  *
  * @return byte size in UTF-8
+ * @retval -ENAMETOOLONG @dist is too short
+ *
+ * @note Unpaired surrogate (e.g. in broken image) is converted into
+ *       U+FFFD, so that the name can be still printed.
  */
-int utf16s_to_utf8s(uint16_t *src, uint16_t namelen, unsigned char* dist)
+int utf16s_to_utf8s(const uint16_t *src, size_t len, unsigned char *dist, size_t size)
 {
-	int size, len = 0;
-	uint16_t *u;
+	int n;
+	size_t i = 0, out = 0;
 	uint32_t w;
 
-	while (namelen--) {
-		u = src++;
-		w = (uint32_t)*u;
-		if (*u < 0x7f) {
-			/* 1 byte character */
-			*(dist + len) = (unsigned char)*u;
-			len++;
-		} else {
-			/* mult bytes character */
-			switch (*u & SURROGATE_PAIR_MASK) {
-				case SURROGATE_PAIR_UPPER:
-					/* FALLTHROUGH */
-				case SURROGATE_PAIR_LOWER:
-					break;
-				default:
-					/* convert UTF32(w) to UTF8(dist) */
-					size = utf32_to_utf8(w, dist + len);
-					len += size;
-					break;
-			}
+	while (i < len) {
+		if (src[i] < 0x80) {
+			n = ascii_utf16_to_utf8(src + i, dist + out, min_len(len - i, size - out));
+			if (!n)
+				return -ENAMETOOLONG;
+			i += n;
+			out += n;
+			continue;
 		}
+
+		w = src[i++];
+		if ((w & SURROGATE_PAIR_MASK) == SURROGATE_PAIR_UPPER && i < len &&
+				(src[i] & SURROGATE_PAIR_MASK) == SURROGATE_PAIR_LOWER)
+			w = 0x10000 + ((w & 0x3FF) << 10) + (src[i++] & 0x3FF);
+		else if (IS_SURROGATE(w))
+			w = UNICODE_REPLACEMENT;
+
+		if ((n = utf32_to_utf8(w, dist + out, size - out)) < 0)
+			return n;
+		out += n;
 	}
-	return len;
+	return out;
 }
-